@@ -0,0 +1,337 @@
+// Load generator and latency benchmark for the chat server: drives many authenticated connections at a target rate
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <cstring>
+#include <cstdlib>
+#include <fcntl.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <sys/epoll.h>
+#include "protocol.h"
+
+/*
+*  Every benchmark message carries "#B <send time in ns>" at the start of its
+*  body. Whoever receives it subtracts that from the current time, so a sample
+*  is the full client -> server -> client delivery latency. Sender and
+*  receivers share this process, and therefore the same steady clock.
+*/
+#define BENCH_TAG "#B "
+#define BENCH_GROUP "bench"
+#define DRAIN_TIMEOUT_MS 3000
+
+struct BenchConfig {
+    std::string host = "127.0.0.1";
+    int port = 12346;
+    std::string usersFile = "users.txt";
+    size_t conns = 10;
+    double rate = 1000;             // operations per second, over all connections
+    double duration = 10;           // seconds of traffic
+    unsigned mix[3] = {1, 1, 1};    // relative weights of /msg, /broadcast and /group_msg
+    size_t size = 64;               // message body size in bytes
+};
+
+struct BenchConn {
+    int fd = -1;
+    std::string username;
+    FrameReader reader;
+};
+
+struct BenchStats {
+    uint64_t sent[3] = {0, 0, 0};
+    uint64_t expected = 0;          // deliveries the server owes us for what has been sent
+    uint64_t received = 0;
+    uint64_t errors = 0;
+    std::vector<uint64_t> latencies;    // ns
+};
+
+enum { OP_MSG = 0, OP_BROADCAST = 1, OP_GROUP = 2 };
+const char *opNames[3] = {"/msg", "/broadcast", "/group_msg"};
+
+uint64_t nowNs() {
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/**
+ * @brief Writes `count` users "bench<i>:pw<i>" to `fileName`, for the server's --users flag and ours.
+ */
+int generateUsers(const std::string &fileName, size_t count) {
+    std::ofstream f(fileName);
+    if (!f.is_open()) {
+        std::cerr << "Error opening " << fileName << std::endl;
+        return -1;
+    }
+    for (size_t i = 0; i < count; i++) f << "bench" << i << ":pw" << i << "\n";
+    return 1;
+}
+
+/**
+ * @brief Reads up to `count` username:password pairs from a users file.
+ */
+std::vector<std::pair<std::string, std::string>> loadUsers(const std::string &fileName, size_t count) {
+    std::vector<std::pair<std::string, std::string>> users;
+    std::ifstream f(fileName);
+    std::string line;
+    while (users.size() < count && std::getline(f, line)) {
+        size_t colon = line.find(':');
+        if (colon == std::string::npos) continue;
+        users.emplace_back(line.substr(0, colon), line.substr(colon + 1));
+    }
+    return users;
+}
+
+/**
+ * @brief Connects to the server, runs the HELLO handshake and logs in.
+ *
+ * @return int Returns 1 with `conn` ready to use, otherwise returns -1.
+ */
+int openConnection(const BenchConfig &cfg, BenchConn &conn, const std::string &password) {
+    addrinfo hints{}, *res = nullptr;
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(cfg.host.c_str(), std::to_string(cfg.port).c_str(), &hints, &res) != 0) return -1;
+
+    conn.fd = socket(AF_INET, SOCK_STREAM, 0);
+    int ok = conn.fd >= 0 && connect(conn.fd, res->ai_addr, res->ai_addrlen) == 0;
+    freeaddrinfo(res);
+    if (!ok) return -1;
+
+    std::string buffer;
+    uint32_t serverMax;
+    if (recvFrame(conn.fd, conn.reader, buffer) <= 0 || parseHello(buffer, serverMax) < 0) return -1;
+    conn.reader.setMaxFrame(std::min<uint32_t>(serverMax, DEFAULT_MAX_FRAME));
+    if (sendFrame(conn.fd, helloPayload(DEFAULT_MAX_FRAME)) < 0) return -1;
+
+    if (recvFrame(conn.fd, conn.reader, buffer) <= 0 || sendFrame(conn.fd, conn.username) < 0) return -1;
+    if (recvFrame(conn.fd, conn.reader, buffer) <= 0 || sendFrame(conn.fd, password) < 0) return -1;
+    if (recvFrame(conn.fd, conn.reader, buffer) <= 0) return -1;
+    if (buffer.find("Welcome") == std::string::npos) return -1;
+    return 1;
+}
+
+/**
+ * @brief Blocks until a frame containing `needle` arrives on `conn`, skipping anything else.
+ */
+int waitFor(BenchConn &conn, const std::string &needle) {
+    std::string buffer;
+    while (recvFrame(conn.fd, conn.reader, buffer) > 0) {
+        if (buffer.find(needle) != std::string::npos) return 1;
+    }
+    return -1;
+}
+
+/**
+ * @brief Records a latency sample if `message` is one of ours; anything else (join notices, errors) is tallied and skipped.
+ */
+void handleFrame(const std::string &message, BenchStats &stats, uint64_t now) {
+    size_t tag = message.find(BENCH_TAG);
+    if (tag == std::string::npos) {
+        if (message.compare(0, 6, "Error:") == 0) stats.errors++;
+        return;
+    }
+    uint64_t sentAt = strtoull(message.c_str() + tag + strlen(BENCH_TAG), nullptr, 10);
+    stats.received++;
+    if (sentAt != 0 && now >= sentAt) stats.latencies.push_back(now - sentAt);
+}
+
+/**
+ * @brief Reads everything available on a non-blocking connection.
+ *
+ * @return int Returns -1 once the server has closed the connection, otherwise 1.
+ */
+int drainConnection(BenchConn &conn, BenchStats &stats) {
+    std::string message;
+    while (true) {
+        ssize_t n = conn.reader.readFrom(conn.fd);
+        if (n == 0) return -1;
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) return -1;
+        }
+        int r;
+        uint64_t now = nowNs();
+        while ((r = conn.reader.next(message)) > 0) {
+            // a heartbeat; only a connection that sends nothing for a long while is ever pinged
+            if (message == "/ping") sendFrame(conn.fd, "/pong");
+            else handleFrame(message, stats, now);
+        }
+        if (r < 0) return -1;
+        if (n < 0) return 1;
+    }
+}
+
+/**
+ * @brief Picks an operation according to the configured mix weights.
+ */
+int pickOperation(const BenchConfig &cfg, std::mt19937 &rng) {
+    unsigned total = cfg.mix[0] + cfg.mix[1] + cfg.mix[2];
+    unsigned r = std::uniform_int_distribution<unsigned>(0, total - 1)(rng);
+    if (r < cfg.mix[0]) return OP_MSG;
+    if (r < cfg.mix[0] + cfg.mix[1]) return OP_BROADCAST;
+    return OP_GROUP;
+}
+
+/**
+ * @brief Sends one timestamped operation from connection `from`.
+ */
+int sendOperation(const BenchConfig &cfg, std::vector<BenchConn> &conns, size_t from, int op, BenchStats &stats) {
+    std::string frame = opNames[op];
+    frame += ' ';
+    if (op == OP_MSG) frame += conns[(from + 1) % conns.size()].username + ' ';
+    if (op == OP_GROUP) frame += BENCH_GROUP " ";
+    size_t body = frame.size();
+    frame += BENCH_TAG + std::to_string(nowNs()) + ' ';
+    if (frame.size() - body < cfg.size) frame.append(cfg.size - (frame.size() - body), 'x');
+
+    if (sendFrame(conns[from].fd, frame) < 0) return -1;
+    stats.sent[op]++;
+    stats.expected += op == OP_MSG ? 1 : conns.size() - 1;
+    return 1;
+}
+
+uint64_t percentile(const std::vector<uint64_t> &sorted, double p) {
+    if (sorted.empty()) return 0;
+    size_t i = std::min(sorted.size() - 1, (size_t)(p * sorted.size()));
+    return sorted[i];
+}
+
+void printReport(const BenchConfig &cfg, BenchStats &stats, double seconds) {
+    std::sort(stats.latencies.begin(), stats.latencies.end());
+    uint64_t ops = stats.sent[0] + stats.sent[1] + stats.sent[2];
+
+    std::cout << "connections:   " << cfg.conns << "\n";
+    std::cout << "operations:    " << ops << " (" << stats.sent[0] << " msg, " << stats.sent[1] << " broadcast, "
+              << stats.sent[2] << " group) in " << seconds << " s = " << (uint64_t)(ops / seconds) << " ops/s\n";
+    std::cout << "deliveries:    " << stats.received << " of " << stats.expected << " expected = "
+              << (uint64_t)(stats.received / seconds) << " msgs/s";
+    if (stats.received < stats.expected) std::cout << " (" << stats.expected - stats.received << " lost)";
+    std::cout << "\n";
+    if (stats.errors) std::cout << "errors:        " << stats.errors << "\n";
+    std::cout << "latency (us):  p50 " << percentile(stats.latencies, 0.50) / 1000
+              << "  p99 " << percentile(stats.latencies, 0.99) / 1000
+              << "  p999 " << percentile(stats.latencies, 0.999) / 1000
+              << "  max " << (stats.latencies.empty() ? 0 : stats.latencies.back() / 1000) << std::endl;
+}
+
+void usage() {
+    std::cout << "Usage: ./bench_grp [--host HOST] [--port PORT] [--users FILE] [--conns N] [--rate OPS_PER_SEC]\n"
+                 "                   [--duration SECONDS] [--mix MSG:BROADCAST:GROUP] [--size BYTES]\n"
+                 "       ./bench_grp --gen-users N FILE" << std::endl;
+}
+
+int main(int argc, char *argv[]) {
+    BenchConfig cfg;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (arg == "--gen-users" && i + 2 < argc) {
+            return generateUsers(argv[i + 2], strtoul(argv[i + 1], nullptr, 10)) < 0 ? 1 : 0;
+        }
+        else if (arg == "--host" && hasValue) cfg.host = argv[++i];
+        else if (arg == "--port" && hasValue) cfg.port = atoi(argv[++i]);
+        else if (arg == "--users" && hasValue) cfg.usersFile = argv[++i];
+        else if (arg == "--conns" && hasValue) cfg.conns = strtoul(argv[++i], nullptr, 10);
+        else if (arg == "--rate" && hasValue) cfg.rate = atof(argv[++i]);
+        else if (arg == "--duration" && hasValue) cfg.duration = atof(argv[++i]);
+        else if (arg == "--size" && hasValue) cfg.size = strtoul(argv[++i], nullptr, 10);
+        else if (arg == "--mix" && hasValue) {
+            if (sscanf(argv[++i], "%u:%u:%u", &cfg.mix[0], &cfg.mix[1], &cfg.mix[2]) != 3) {
+                usage();
+                return 2;
+            }
+        }
+        else {
+            usage();
+            return 2;
+        }
+    }
+    if (cfg.conns < 2 || cfg.rate <= 0 || cfg.duration <= 0 || cfg.mix[0] + cfg.mix[1] + cfg.mix[2] == 0) {
+        std::cerr << "Error: need --conns >= 2, a positive --rate and --duration, and a non-zero --mix" << std::endl;
+        return 2;
+    }
+
+    auto users = loadUsers(cfg.usersFile, cfg.conns);
+    if (users.size() < cfg.conns) {
+        std::cerr << "Error: " << cfg.usersFile << " has only " << users.size() << " users, "
+                  << cfg.conns << " needed (see --gen-users)" << std::endl;
+        return 1;
+    }
+
+    // Log everyone in and put them all in one group, so /group_msg fans out to every connection
+    std::vector<BenchConn> conns(cfg.conns);
+    for (size_t i = 0; i < cfg.conns; i++) {
+        conns[i].username = users[i].first;
+        if (openConnection(cfg, conns[i], users[i].second) < 0) {
+            std::cerr << "Error: login failed for " << users[i].first << std::endl;
+            return 1;
+        }
+    }
+    sendFrame(conns[0].fd, "/create_group " BENCH_GROUP);
+    waitFor(conns[0], "Group " BENCH_GROUP);
+    for (size_t i = 1; i < cfg.conns; i++) {
+        sendFrame(conns[i].fd, "/join_group " BENCH_GROUP);
+        if (waitFor(conns[i], "You joined the group " BENCH_GROUP) < 0) {
+            std::cerr << "Error: " << conns[i].username << " could not join the group" << std::endl;
+            return 1;
+        }
+    }
+
+    int epoll_fd = epoll_create1(0);
+    for (size_t i = 0; i < cfg.conns; i++) {
+        fcntl(conns[i].fd, F_SETFL, fcntl(conns[i].fd, F_GETFL) | O_NONBLOCK);
+        epoll_event ev{};
+        ev.events = EPOLLIN;
+        ev.data.u64 = i;
+        epoll_ctl(epoll_fd, EPOLL_CTL_ADD, conns[i].fd, &ev);
+    }
+
+    BenchStats stats;
+    stats.latencies.reserve((size_t)(cfg.rate * cfg.duration) * 2);
+    std::mt19937 rng(425);
+    std::vector<epoll_event> events(cfg.conns);
+
+    // Open-loop pacing: operation k is due at start + k / rate, whether or not earlier ones were answered
+    uint64_t interval = (uint64_t)(1e9 / cfg.rate);
+    uint64_t start = nowNs(), end = start + (uint64_t)(cfg.duration * 1e9), due = start;
+    uint64_t drainUntil = 0;
+    size_t next = 0;
+    while (true) {
+        uint64_t now = nowNs();
+        while (now < end && due <= now) {
+            if (sendOperation(cfg, conns, next, pickOperation(cfg, rng), stats) < 0) {
+                std::cerr << "Error: send failed on " << conns[next].username << std::endl;
+                return 1;
+            }
+            next = (next + 1) % cfg.conns;
+            due += interval;
+        }
+        if (now >= end) {
+            if (drainUntil == 0) drainUntil = now + (uint64_t)DRAIN_TIMEOUT_MS * 1000000;
+            if (stats.received >= stats.expected || now >= drainUntil) break;
+        }
+
+        int timeoutMs = now < end ? (int)std::min<uint64_t>((due - std::min(due, now)) / 1000000, 10) : 10;
+        int n = epoll_wait(epoll_fd, events.data(), (int)events.size(), timeoutMs);
+        for (int i = 0; i < n; i++) {
+            BenchConn &conn = conns[events[i].data.u64];
+            if (drainConnection(conn, stats) < 0) {
+                std::cerr << "Error: server closed the connection of " << conn.username << std::endl;
+                return 1;
+            }
+        }
+    }
+
+    printReport(cfg, stats, cfg.duration);
+
+    for (auto &conn : conns) close(conn.fd);
+    close(epoll_fd);
+    return 0;
+}
@@ -0,0 +1,270 @@
+// Size-classed buffer pool with per-thread caches, the reference-counted frames built on it, and per-command scratch arenas
+
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#include <atomic>
+#include <mutex>
+#include <new>
+#include <utility>
+#include <algorithm>
+#include <string_view>
+#include <memory_resource>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+
+#define POOL_MIN_SHIFT 6                    // the smallest class holds 64 bytes
+#define POOL_CLASSES 11                     // 64 B .. 64 KiB, doubling; larger blocks come straight from malloc
+#define POOL_CACHE_BYTES (256 * 1024)       // per thread and class; beyond that half the list goes to the depot
+#define POOL_DEPOT_BYTES (4 * 1024 * 1024)  // per class in the shared depot; beyond that blocks are freed
+#define SCRATCH_ARENA_BYTES (16 * 1024)     // per thread; a command that needs more spills to the heap
+
+/*
+*  Blocks come in power-of-two classes. Every thread keeps one free list per
+*  class and serves acquire/release from it without any locking; only when a
+*  list runs dry or grows past POOL_CACHE_BYTES does it trade half a list's
+*  worth of blocks with the shared depot, under the depot's mutex. A block
+*  released on another thread than the one that acquired it (a frame written
+*  out by a recipient's reactor) simply joins the releasing thread's list, so
+*  blocks drift to where they are freed and the depot evens that out.
+*
+*  Free blocks are linked through their own first bytes, so the lists cost no
+*  memory of their own.
+*/
+class BufferPool{
+public:
+    /**
+     * @brief Returns a block of at least `bytes` bytes.
+     *
+     * @param capacity Set to the block's real size, which release() has to be given back.
+     */
+    static void* acquire(size_t bytes, size_t &capacity){
+        int c = classOf(bytes);
+        if(c < 0){
+            capacity = bytes;
+            return allocate(bytes);
+        }
+        capacity = classSize(c);
+        if(retired) return allocate(capacity);
+        FreeList &list = threadCache().lists[c];
+        if(!list.head) refill(list, c);
+        if(void *block = list.pop()) return block;
+        return allocate(capacity);
+    }
+
+    /**
+     * @brief Hands a block from acquire() back to the calling thread's cache.
+     *
+     * @param capacity The capacity acquire() reported, or the size that was asked for; both name the same class.
+     */
+    static void release(void *block, size_t capacity){
+        int c = classOf(capacity);
+        if(c < 0 || retired){
+            deallocate(block, capacity);
+            return;
+        }
+        FreeList &list = threadCache().lists[c];
+        list.push(block);
+        if(list.count > cacheLimit(c)) spill(list, c, list.count / 2);
+    }
+
+    /**
+     * @brief Returns the bytes currently obtained from malloc, whether in use or cached.
+     */
+    static size_t reservedBytes(){ return reserved().load(std::memory_order_relaxed); }
+
+private:
+    struct FreeBlock{ FreeBlock *next; };
+
+    struct FreeList{
+        FreeBlock *head = nullptr;
+        size_t count = 0;
+
+        void push(void *block){
+            FreeBlock *b = static_cast<FreeBlock*>(block);
+            b->next = head;
+            head = b;
+            count++;
+        }
+        void* pop(){
+            FreeBlock *b = head;
+            if(!b) return nullptr;
+            head = b->next;
+            count--;
+            return b;
+        }
+    };
+
+    struct Depot{
+        std::mutex m;
+        FreeList lists[POOL_CLASSES];
+    };
+
+    // a thread's cache goes back to the depot when the thread exits (threaded mode's connection threads)
+    struct ThreadCache{
+        FreeList lists[POOL_CLASSES];
+
+        ~ThreadCache(){
+            for(int c = 0; c < POOL_CLASSES; c++) spill(lists[c], c, lists[c].count);
+            retired = true;
+        }
+    };
+    // set once the thread's cache is gone; blocks freed later in that thread's teardown go straight to free()
+    static inline thread_local bool retired = false;
+
+    static int classOf(size_t bytes){
+        if(bytes > classSize(POOL_CLASSES - 1)) return -1;
+        if(bytes <= classSize(0)) return 0;
+        return 64 - __builtin_clzll((unsigned long long)bytes - 1) - POOL_MIN_SHIFT;
+    }
+    static size_t classSize(int c){ return (size_t)1 << (POOL_MIN_SHIFT + c); }
+    static size_t cacheLimit(int c){ return std::max<size_t>(2, POOL_CACHE_BYTES / classSize(c)); }
+
+    static void refill(FreeList &list, int c){
+        Depot &d = depot();
+        std::lock_guard<std::mutex> lock(d.m);
+        for(size_t n = cacheLimit(c) / 2; n > 0 && d.lists[c].head; n--) list.push(d.lists[c].pop());
+    }
+
+    static void spill(FreeList &list, int c, size_t n){
+        Depot &d = depot();
+        std::lock_guard<std::mutex> lock(d.m);
+        for(; n > 0 && list.head; n--){
+            void *block = list.pop();
+            if(d.lists[c].count * classSize(c) < POOL_DEPOT_BYTES) d.lists[c].push(block);
+            else deallocate(block, classSize(c));
+        }
+    }
+
+    static void* allocate(size_t bytes){
+        void *block = std::malloc(bytes);
+        if(!block) throw std::bad_alloc();
+        reserved().fetch_add(bytes, std::memory_order_relaxed);
+        return block;
+    }
+    static void deallocate(void *block, size_t bytes){
+        std::free(block);
+        reserved().fetch_sub(bytes, std::memory_order_relaxed);
+    }
+
+    static ThreadCache& threadCache(){
+        thread_local ThreadCache cache;
+        return cache;
+    }
+    // never destroyed, so a thread exiting during shutdown can still hand its cache back
+    static Depot& depot(){
+        static Depot *d = new Depot;
+        return *d;
+    }
+    static std::atomic<size_t>& reserved(){
+        static std::atomic<size_t> bytes{0};
+        return bytes;
+    }
+};
+
+/*
+*  Base for small objects that are created and destroyed on the message path
+*  (queue nodes, in-flight sends): their new/delete go to the BufferPool.
+*/
+struct Pooled{
+    static void* operator new(size_t bytes){
+        size_t capacity;
+        return BufferPool::acquire(bytes, capacity);
+    }
+    static void operator delete(void *block, size_t bytes){ BufferPool::release(block, bytes); }
+};
+
+/*
+*  An immutable encoded frame in one pooled block. The reference count and
+*  length sit in the block's header, right in front of the bytes, so a frame
+*  costs a single block from the pool and no separate control block.
+*/
+class PooledFrame{
+public:
+    const char* data() const { return reinterpret_cast<const char*>(this + 1); }
+    size_t size() const { return length; }
+    operator std::string_view() const { return std::string_view(data(), length); }
+
+private:
+    friend class SharedFrame;
+
+    mutable std::atomic<uint32_t> refs{1};
+    uint32_t length = 0;
+    size_t capacity = 0;
+};
+
+/*
+*  Owning reference to a PooledFrame: copying it bumps the count, and the last
+*  reference gives the block back to the pool of whichever thread drops it.
+*/
+class SharedFrame{
+public:
+    SharedFrame() = default;
+    SharedFrame(const SharedFrame &o) : frame(o.frame){
+        if(frame) frame->refs.fetch_add(1, std::memory_order_relaxed);
+    }
+    SharedFrame(SharedFrame &&o) noexcept : frame(o.frame){ o.frame = nullptr; }
+    SharedFrame& operator=(SharedFrame o) noexcept {
+        std::swap(frame, o.frame);
+        return *this;
+    }
+    ~SharedFrame(){ reset(); }
+
+    /**
+     * @brief Allocates a frame of `bytes` bytes, which the caller fills through `out` before sharing it.
+     */
+    static SharedFrame allocate(size_t bytes, char *&out){
+        size_t capacity;
+        void *block = BufferPool::acquire(sizeof(PooledFrame) + bytes, capacity);
+        SharedFrame ref;
+        ref.frame = new (block) PooledFrame;
+        ref.frame->length = (uint32_t)bytes;
+        ref.frame->capacity = capacity;
+        out = reinterpret_cast<char*>(ref.frame + 1);
+        return ref;
+    }
+
+    void reset(){
+        if(frame && frame->refs.fetch_sub(1, std::memory_order_acq_rel) == 1){
+            size_t capacity = frame->capacity;
+            frame->~PooledFrame();
+            BufferPool::release(frame, capacity);
+        }
+        frame = nullptr;
+    }
+
+    const PooledFrame* operator->() const { return frame; }
+    const PooledFrame& operator*() const { return *frame; }
+    explicit operator bool() const { return frame != nullptr; }
+
+private:
+    PooledFrame *frame = nullptr;
+};
+
+/*
+*  Scratch memory for handling one command: a bump allocator over a fixed
+*  per-thread buffer, rewound as a whole once the command is done, so the
+*  temporary containers a handler builds cost no malloc/free pairs. Anything
+*  that has to outlive the command must not be allocated from it.
+*/
+class ScratchArena{
+public:
+    std::pmr::memory_resource* resource(){ return &arena; }
+
+    /**
+     * @brief Frees everything allocated since the last rewind; nothing from the arena may still be in use.
+     */
+    void rewind(){ arena.release(); }
+
+    static ScratchArena& local(){
+        thread_local ScratchArena scratch;
+        return scratch;
+    }
+
+private:
+    alignas(std::max_align_t) char buffer[SCRATCH_ARENA_BYTES];
+    std::pmr::monotonic_buffer_resource arena{buffer, sizeof(buffer), std::pmr::new_delete_resource()};
+};
+
+#endif
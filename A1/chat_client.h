@@ -0,0 +1,832 @@
+// Asynchronous client library for the chat server: many sessions on one epoll loop, pipelined sends and automatic resume
+
+#ifndef CHAT_CLIENT_H
+#define CHAT_CLIENT_H
+
+#include <string>
+#include <string_view>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include <map>
+#include <unordered_map>
+#include <chrono>
+#include <atomic>
+#include <algorithm>
+#include <cstring>
+#include <cstdio>
+#include <charconv>
+#include <fcntl.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include "protocol.h"
+
+#define CHAT_RECONNECT_ATTEMPTS 5       // connection attempts in a row before a session gives up
+#define CHAT_RECONNECT_DELAY_MS 1000    // pause after the first failed attempt, doubled after every further one
+#define CHAT_RECONNECT_MAX_DELAY_MS 30000
+#define CHAT_STABLE_MS 10000            // a session up this long is healthy again: its next drop retries at once
+#define CHAT_MAX_EVENTS 256
+
+class ChatClient;
+
+/*
+*  One account logged in to the server. A session is created by
+*  ChatClient::open() and lives until its onClosed handler has run; all of
+*  its methods must be called on the thread running the client's loop (from
+*  a handler, or through ChatClient::post()).
+*
+*  send() never blocks and never waits for a reply: the frame is appended to
+*  the session's output buffer, and everything sent during one pass of the
+*  loop goes out with one write. Frames sent before the login completes are
+*  pipelined right behind it. If the connection drops, the session reconnects
+*  by itself (at once if it had been up a while, otherwise with a growing
+*  delay, and it gives up after a few drops in a row), resumes with its token (or logs in again if the server no
+*  longer has it) and then sends whatever had not been written yet; frames
+*  the kernel had already accepted are not sent twice, so delivery is at
+*  most once across a reconnect.
+*
+*  Files go through the server's spool: sendFile() uploads one in chunks,
+*  never more than the server's window ahead of its acknowledgements, and
+*  getFile() downloads one into "<path>.part" and renames it when complete.
+*  Both continue where they left off after a reconnect.
+*/
+class ChatSession {
+public:
+    struct Handlers {
+        // the server's welcome; `resumed` is true when the server kept the session (groups, queued messages)
+        std::function<void(ChatSession&, const std::string &welcome, bool resumed)> onLogin;
+        // every other frame; the string is reused for the next frame, so copy it to keep it
+        std::function<void(ChatSession&, const std::string &message)> onMessage;
+        // the session is over for good (failed login, reconnects exhausted or close()); it is freed afterwards
+        std::function<void(ChatSession&, const std::string &reason)> onClosed;
+        // a file sent to us (or to one of our groups) is ready for getFile(); without a handler it goes to onMessage
+        std::function<void(ChatSession&, uint64_t id, const std::string &from, const std::string &name, uint64_t size)> onFileOffer;
+        // a getFile() download is complete and renamed to `path`
+        std::function<void(ChatSession&, uint64_t id, const std::string &path)> onFileReceived;
+    };
+
+    ChatSession() = default;
+    ChatSession(const ChatSession&) = delete;
+    ChatSession& operator=(const ChatSession&) = delete;
+    ~ChatSession() {
+        for (auto &u : uploads) ::close(u.fd);
+        for (auto &d : downloads) ::close(d.fd);
+    }
+
+    /**
+     * @brief Queues one frame for the server.
+     *
+     * @return int Returns 1 if the frame was queued, otherwise returns -1 (too large, or the session is closing).
+     */
+    int send(std::string_view payload);
+
+    /**
+     * @brief Uploads the file at `path` to a user or a group; it keeps its base name.
+     *
+     * @return int Returns 1 if the upload was requested, otherwise returns -1 (the file cannot be read, or is empty).
+     *             The server's reasons for refusing it arrive through onMessage as an "Error: " frame.
+     */
+    int sendFile(const std::string &target, const std::string &path);
+
+    /**
+     * @brief Downloads the file the server offered as `id` to `path`, continuing an earlier "<path>.part".
+     *
+     * @return int Returns 1 if the download was requested, otherwise returns -1 (the file cannot be created).
+     */
+    int getFile(uint64_t id, const std::string &path);
+
+    /**
+     * @brief Ends the session: sends /exit so the server drops it at once, then closes the connection.
+     */
+    void close();
+
+    const std::string& username() const { return user; }
+    const std::string& resumeToken() const { return token; }
+    bool loggedIn() const { return state == State::ACTIVE; }
+    uint32_t maxFrame() const { return frameLimit; }
+    size_t queuedBytes() const { return out.size() - outStart + held.size(); }
+
+    void *userData = nullptr;           // free for the application
+
+private:
+    friend class ChatClient;
+    enum class State { CONNECTING, LOGGING_IN, RESUMING, ACTIVE, WAITING, CLOSED };
+
+    ChatClient *client = nullptr;
+    uint32_t id = 0;
+    uint32_t generation = 0;            // bumped per connection, so events for an old socket are ignored
+    State state = State::WAITING;
+    std::string user, password, token;
+    Handlers handlers;
+    sockaddr_storage address{};
+    socklen_t addressLen = 0;
+
+    int fd = -1;
+    FrameReader reader;
+    std::string frame;                  // the frame being handled, reused
+    uint32_t frameLimit = DEFAULT_MAX_FRAME;
+    bool helloSeen = false;
+    std::string out;                    // encoded frames for the socket
+    size_t outStart = 0;                // bytes of `out` already written
+    size_t frameStart = 0;              // start of the first frame of `out` not completely written
+    int loginFrames = 0;                // frames at the start of `out` that belong to the login, not the application
+    std::string held;                   // application frames waiting for a resume to be accepted
+    bool dirty = false;
+    bool closing = false;
+    int attempts = 0;                   // failed attempts, and drops soon after a login, in a row
+    uint64_t activeSince = 0;           // when the current connection was logged in (ms)
+    uint64_t retryAt = 0;
+
+    struct Upload {
+        int fd;
+        std::string target, name;
+        uint64_t size;
+        bool accepted = false;          // the server has answered /send_file with an id (again, after a reconnect)
+        uint64_t id = 0;
+        uint64_t next = 0;              // offset of the next chunk to send
+        uint64_t acked = 0;             // bytes the server has stored
+        size_t chunk = 0;
+        int window = 0;
+    };
+    struct Download {
+        int fd;
+        uint64_t id;
+        std::string path;
+        bool started = false;           // /file_start has told us the size
+        uint64_t size = 0;
+        uint64_t received;
+        uint64_t resentAt = UINT64_MAX; // offset last asked for again after a gap, so each gap is asked for once
+    };
+    std::vector<Upload> uploads;
+    std::vector<Download> downloads;
+};
+
+/*
+*  An epoll loop that runs any number of sessions, each with its own socket,
+*  on one thread. run() (or repeated poll() calls) drives it; post() and
+*  stop() may be called from any thread.
+*/
+class ChatClient {
+public:
+    ChatClient() {
+        epollFd = epoll_create1(EPOLL_CLOEXEC);
+        wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        epoll_event ev{};
+        ev.events = EPOLLIN;
+        ev.data.u64 = WAKE_KEY;
+        epoll_ctl(epollFd, EPOLL_CTL_ADD, wakeFd, &ev);
+    }
+
+    ~ChatClient() {
+        for (auto &entry : sessions) if (entry.second->fd >= 0) ::close(entry.second->fd);
+        ::close(wakeFd);
+        ::close(epollFd);
+    }
+
+    ChatClient(const ChatClient&) = delete;
+    ChatClient& operator=(const ChatClient&) = delete;
+
+    /**
+     * @brief Starts a session for `username` on the server at `host`:`port`; the loop does the connecting.
+     *
+     * @return ChatSession* The session (owned by the client, valid until its onClosed returns), or nullptr
+     *                      if `host` cannot be resolved.
+     */
+    ChatSession* open(const std::string &host, int port, const std::string &username, const std::string &password,
+                      ChatSession::Handlers handlers) {
+        addrinfo hints{}, *res = nullptr;
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        if (getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &res) != 0 || !res) return nullptr;
+
+        auto session = std::make_unique<ChatSession>();
+        ChatSession &s = *session;
+        s.client = this;
+        s.id = nextId++;
+        s.user = username;
+        s.password = password;
+        s.handlers = std::move(handlers);
+        memcpy(&s.address, res->ai_addr, res->ai_addrlen);
+        s.addressLen = res->ai_addrlen;
+        freeaddrinfo(res);
+
+        sessions[s.id] = std::move(session);
+        connect(s);
+        return &s;
+    }
+
+    /**
+     * @brief Runs `fn` on the loop thread during its next pass; safe to call from any thread.
+     */
+    void post(std::function<void()> fn) {
+        {
+            std::lock_guard<std::mutex> lock(postedMutex);
+            posted.push_back(std::move(fn));
+        }
+        wake();
+    }
+
+    /**
+     * @brief Makes run() return after the current pass; safe to call from any thread.
+     */
+    void stop() {
+        stopping = true;
+        wake();
+    }
+
+    /**
+     * @brief Runs the loop until stop() is called or the last session has closed.
+     */
+    void run() {
+        while (!stopping && !sessions.empty()) {
+            if (poll(-1) < 0) break;
+        }
+    }
+
+    /**
+     * @brief Runs one pass of the loop: waits up to `timeoutMs` (-1 for no limit) for activity and handles it.
+     *
+     * @return int The number of sessions still open, or -1 if epoll failed.
+     */
+    int poll(int timeoutMs) {
+        uint64_t now = nowMs();
+        // frames queued since the last pass (outside any handler) go out without waiting for activity
+        if (!dirty.empty()) timeoutMs = 0;
+        else if (!retries.empty()) {
+            int untilRetry = (int)(retries.begin()->first > now ? retries.begin()->first - now : 0);
+            timeoutMs = timeoutMs < 0 ? untilRetry : std::min(timeoutMs, untilRetry);
+        }
+
+        epoll_event events[CHAT_MAX_EVENTS];
+        int n = epoll_wait(epollFd, events, CHAT_MAX_EVENTS, timeoutMs);
+        if (n < 0 && errno != EINTR) return -1;
+        for (int i = 0; i < n; i++) {
+            if (events[i].data.u64 == WAKE_KEY) {
+                uint64_t count;
+                if (read(wakeFd, &count, sizeof(count)) < 0) {}
+                continue;
+            }
+            ChatSession *s = find((uint32_t)events[i].data.u64);
+            if (!s || s->fd < 0 || s->generation != (uint32_t)(events[i].data.u64 >> 32)) continue;
+            handleEvent(*s, events[i].events);
+        }
+
+        std::vector<std::function<void()>> work;
+        {
+            std::lock_guard<std::mutex> lock(postedMutex);
+            work.swap(posted);
+        }
+        for (auto &fn : work) fn();
+
+        now = nowMs();
+        while (!retries.empty() && retries.begin()->first <= now) {
+            auto entry = *retries.begin();
+            retries.erase(retries.begin());
+            ChatSession *s = find(entry.second);
+            if (s && s->state == ChatSession::State::WAITING && s->retryAt == entry.first) connect(*s);
+        }
+
+        // everything the handlers and posted work queued during this pass goes out now, one write per session
+        std::vector<uint32_t> toFlush;
+        toFlush.swap(dirty);
+        for (uint32_t id : toFlush) {
+            ChatSession *s = find(id);
+            if (s) {
+                s->dirty = false;
+                flush(*s);
+            }
+        }
+
+        for (uint32_t id : finished) sessions.erase(id);
+        finished.clear();
+        return (int)sessions.size();
+    }
+
+    size_t sessionCount() const { return sessions.size(); }
+
+private:
+    friend class ChatSession;
+    static constexpr uint64_t WAKE_KEY = ~0ull;
+
+    static uint64_t nowMs() {
+        return (uint64_t)std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    void wake() {
+        uint64_t one = 1;
+        if (write(wakeFd, &one, sizeof(one)) < 0) {}
+    }
+
+    ChatSession* find(uint32_t id) {
+        auto it = sessions.find(id);
+        return it == sessions.end() ? nullptr : it->second.get();
+    }
+
+    void markDirty(ChatSession &s) {
+        if (s.dirty) return;
+        s.dirty = true;
+        dirty.push_back(s.id);
+    }
+
+    /**
+     * @brief Opens a new connection for a session and queues its HELLO and login behind any unsent frames' place.
+     *
+     * With a resume token the login is `/resume TOKEN` and the application's frames wait for the welcome,
+     * since a refused resume leaves the connection expecting a username. A password login can take them
+     * right behind it: if it fails, the server closes the connection and they were never meant to run.
+     */
+    void connect(ChatSession &s) {
+        s.generation++;
+        s.fd = socket(s.address.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (s.fd < 0) {
+            connectionFailed(s, "Error connecting to server.");
+            return;
+        }
+        int one = 1;
+        setsockopt(s.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        if (::connect(s.fd, (const sockaddr*)&s.address, s.addressLen) < 0 && errno != EINPROGRESS) {
+            connectionFailed(s, "Error connecting to server.");
+            return;
+        }
+        epoll_event ev{};
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.u64 = ((uint64_t)s.generation << 32) | s.id;
+        if (epoll_ctl(epollFd, EPOLL_CTL_ADD, s.fd, &ev) < 0) {
+            connectionFailed(s, "Error connecting to server.");
+            return;
+        }
+
+        s.state = ChatSession::State::CONNECTING;
+        s.reader = FrameReader();
+        s.frameLimit = DEFAULT_MAX_FRAME;
+        s.helloSeen = false;
+        s.out.clear();
+        s.outStart = s.frameStart = 0;
+        appendFrame(s.out, helloPayload(DEFAULT_MAX_FRAME));
+        s.loginFrames = 2;
+        if (!s.token.empty()) {
+            appendFrame(s.out, "/resume " + s.token);
+        }
+        else {
+            appendFrame(s.out, "/login " + s.user + " " + s.password);
+            s.out += s.held;
+            s.held.clear();
+        }
+    }
+
+    /**
+     * @brief Drops a session's socket and keeps every frame that was not completely written for the next connection.
+     */
+    void dropConnection(ChatSession &s) {
+        if (s.fd >= 0) {
+            epoll_ctl(epollFd, EPOLL_CTL_DEL, s.fd, nullptr);
+            ::close(s.fd);
+            s.fd = -1;
+        }
+        // a half-written frame never reached the server as a frame, so it is sent again whole
+        size_t keep = s.frameStart;
+        for (int i = 0; i < s.loginFrames && keep + FRAME_HEADER_SIZE <= s.out.size(); i++) {
+            keep += FRAME_HEADER_SIZE + decodeFrameHeader(s.out.data() + keep);
+        }
+        if (keep < s.out.size()) s.held.insert(0, s.out, keep, std::string::npos);
+        s.out.clear();
+        s.outStart = s.frameStart = 0;
+        s.loginFrames = 0;
+    }
+
+    /**
+     * @brief Handles a connection that could not be set up or logged in: retries a few times, then gives up.
+     */
+    void connectionFailed(ChatSession &s, const std::string &reason) {
+        dropConnection(s);
+        if (s.closing || ++s.attempts >= CHAT_RECONNECT_ATTEMPTS) {
+            finish(s, reason);
+            return;
+        }
+        scheduleRetry(s, retryDelay(s.attempts));
+    }
+
+    /**
+     * @brief Handles a logged-in connection that dropped.
+     *
+     * A session that had been up for CHAT_STABLE_MS reconnects right away. One that drops again soon after its
+     * login counts as a failed attempt and backs off like one, so a server that keeps closing it is not hammered.
+     */
+    void connectionLost(ChatSession &s) {
+        dropConnection(s);
+        if (s.closing) {
+            finish(s, "Session closed.");
+            return;
+        }
+        if (nowMs() - s.activeSince >= CHAT_STABLE_MS) {
+            s.attempts = 0;
+            scheduleRetry(s, 0);
+            return;
+        }
+        if (++s.attempts >= CHAT_RECONNECT_ATTEMPTS) {
+            finish(s, "Connection to the server keeps dropping.");
+            return;
+        }
+        scheduleRetry(s, retryDelay(s.attempts));
+    }
+
+    static uint64_t retryDelay(int attempts) {
+        return std::min<uint64_t>(CHAT_RECONNECT_MAX_DELAY_MS, (uint64_t)CHAT_RECONNECT_DELAY_MS << (attempts - 1));
+    }
+
+    void scheduleRetry(ChatSession &s, uint64_t delayMs) {
+        s.state = ChatSession::State::WAITING;
+        s.retryAt = nowMs() + delayMs;
+        retries.emplace(s.retryAt, s.id);
+    }
+
+    void finish(ChatSession &s, const std::string &reason) {
+        if (s.state == ChatSession::State::CLOSED) return;
+        dropConnection(s);
+        s.state = ChatSession::State::CLOSED;
+        finished.push_back(s.id);
+        if (s.handlers.onClosed) s.handlers.onClosed(s, reason);
+    }
+
+    void handleEvent(ChatSession &s, uint32_t events) {
+        if (s.state == ChatSession::State::CONNECTING && (events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) {
+            int error = 0;
+            socklen_t len = sizeof(error);
+            if (getsockopt(s.fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0 || error != 0) {
+                connectionFailed(s, "Error connecting to server.");
+                return;
+            }
+            s.state = s.token.empty() ? ChatSession::State::LOGGING_IN : ChatSession::State::RESUMING;
+        }
+        if (events & (EPOLLIN | EPOLLRDHUP | EPOLLERR | EPOLLHUP)) {
+            if (readFrames(s) < 0) return;
+        }
+        if (events & EPOLLOUT) flush(s);
+    }
+
+    /**
+     * @brief Reads everything the socket has and handles every complete frame.
+     *
+     * @return int Returns 1 if the connection is still up, otherwise returns -1.
+     */
+    int readFrames(ChatSession &s) {
+        uint32_t generation = s.generation;
+        while (true) {
+            ssize_t n = s.reader.readFrom(s.fd);
+            if (n < 0 && errno == EINTR) continue;
+            bool closed = n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK);
+
+            int r;
+            while ((r = s.reader.next(s.frame)) > 0) {
+                handleFrame(s);
+                // the handler may have closed the session or replaced the connection
+                if (s.fd < 0 || s.generation != generation) return -1;
+            }
+            if (r < 0) {
+                // an oversize or malformed frame will come again after a reconnect, so it ends the session
+                finish(s, "Protocol error: the server sent an invalid frame.");
+                return -1;
+            }
+            if (closed) {
+                if (s.state == ChatSession::State::ACTIVE) connectionLost(s);
+                else connectionFailed(s, "Error connecting to server.");
+                return -1;
+            }
+            if (n < 0) return 1;
+        }
+    }
+
+    void handleFrame(ChatSession &s) {
+        const std::string &frame = s.frame;
+        if (!s.helloSeen) {
+            uint32_t serverMax;
+            if (parseHello(frame, serverMax) < 0) {
+                finish(s, "Protocol error: the server did not send a valid HELLO.");
+                return;
+            }
+            s.frameLimit = std::min<uint32_t>(serverMax, DEFAULT_MAX_FRAME);
+            s.reader.setMaxFrame(s.frameLimit);
+            s.helloSeen = true;
+            return;
+        }
+        if (frame == "/ping") {
+            // the server's heartbeat; answered here, so an application that only listens is not dropped
+            appendFrame(s.out, "/pong");
+            markDirty(s);
+            return;
+        }
+        if (s.state == ChatSession::State::ACTIVE) {
+            if (frame.rfind("Resume token: ", 0) == 0) {
+                s.token = frame.substr(14);
+                return;
+            }
+            if (frame[0] == '/' && handleFileFrame(s)) return;
+            if (frame.rfind("Error: Could not send the file", 0) == 0) {
+                // refused uploads are answered in order, so it is the oldest one waiting for its id
+                auto it = std::find_if(s.uploads.begin(), s.uploads.end(), [](const ChatSession::Upload &u) { return !u.accepted; });
+                if (it != s.uploads.end()) {
+                    ::close(it->fd);
+                    s.uploads.erase(it);
+                }
+            }
+            else if (frame.rfind("Error: Check the file id", 0) == 0) {
+                auto it = std::find_if(s.downloads.begin(), s.downloads.end(), [](const ChatSession::Download &d) { return !d.started; });
+                if (it != s.downloads.end()) {
+                    ::close(it->fd);
+                    s.downloads.erase(it);
+                }
+            }
+            // the server ended the session itself (e.g. --idle-timeout), so the disconnect that follows is final
+            if (frame.rfind("Disconnected: ", 0) == 0) s.closing = true;
+            if (s.handlers.onMessage) s.handlers.onMessage(s, frame);
+            return;
+        }
+
+        if (frame.rfind("Welcome", 0) == 0) {
+            bool resumed = s.state == ChatSession::State::RESUMING || frame.rfind("Welcome back", 0) == 0;
+            s.state = ChatSession::State::ACTIVE;
+            // `attempts` is only cleared once the session has stayed up for CHAT_STABLE_MS (see connectionLost())
+            s.activeSince = nowMs();
+            if (!s.held.empty()) {
+                s.out += s.held;
+                s.held.clear();
+                markDirty(s);
+            }
+            // transfers cut off by a reconnect ask the server where to continue
+            for (auto &u : s.uploads) {
+                if (!u.accepted) continue;
+                u.accepted = false;
+                s.send("/send_file " + u.target + " " + u.name + " " + std::to_string(u.size));
+            }
+            for (auto &d : s.downloads) {
+                d.resentAt = d.received;
+                s.send("/get_file " + std::to_string(d.id) + " " + std::to_string(d.received));
+            }
+            if (s.handlers.onLogin) s.handlers.onLogin(s, frame, resumed);
+        }
+        else if (frame == "Resume failed.") {
+            // the server no longer has the session; the same connection takes a password login instead
+            s.token.clear();
+            appendFrame(s.out, "/login " + s.user + " " + s.password);
+            s.loginFrames++;
+            s.out += s.held;
+            s.held.clear();
+            s.state = ChatSession::State::LOGGING_IN;
+            markDirty(s);
+        }
+        else if (frame.rfind("Authentication failed", 0) == 0) {
+            std::string reason = frame.substr(0, frame.find_last_not_of(" \n") + 1);
+            s.closing = true;
+            finish(s, reason);
+        }
+        else if (frame.rfind("Error: Server is busy", 0) == 0) {
+            // refused by the server's connection caps; worth another try after the usual delay
+            connectionFailed(s, frame);
+        }
+        // anything else before the welcome (the username prompt) is not for the application
+    }
+
+    /**
+     * @brief Parses a number at the front of `s` and drops it and the space after it.
+     */
+    static bool takeNumber(std::string_view &s, uint64_t &value) {
+        auto [end, ec] = std::from_chars(s.data(), s.data() + s.size(), value);
+        if (ec != std::errc() || end == s.data()) return false;
+        s.remove_prefix(end - s.data());
+        if (!s.empty() && s[0] == ' ') s.remove_prefix(1);
+        return true;
+    }
+
+    /**
+     * @brief Handles the server's file transfer frames.
+     *
+     * @return bool Returns true if the frame belonged to a transfer (or was an offer given to onFileOffer).
+     */
+    bool handleFileFrame(ChatSession &s) {
+        std::string_view frame = s.frame;
+        size_t space = frame.find(' ');
+        if (space == std::string_view::npos) return false;
+        std::string_view command = frame.substr(0, space), rest = frame.substr(space + 1);
+        uint64_t id;
+        if (!takeNumber(rest, id)) return false;
+
+        if (command == "/file_accept") {
+            // "/file_accept ID OFFSET CHUNK WINDOW TARGET NAME"
+            uint64_t offset, chunk, window;
+            if (!takeNumber(rest, offset) || !takeNumber(rest, chunk) || !takeNumber(rest, window) || chunk == 0) return true;
+            size_t split = rest.find(' ');
+            if (split == std::string_view::npos) return true;
+            std::string_view target = rest.substr(0, split), name = rest.substr(split + 1);
+            for (auto &u : s.uploads) {
+                if (u.accepted || u.target != target || u.name != name) continue;
+                u.accepted = true;
+                u.id = id;
+                u.next = u.acked = offset;
+                u.chunk = chunk;
+                u.window = (int)window;
+                pumpUpload(s, u);
+                break;
+            }
+            return true;
+        }
+        if (command == "/file_ack") {
+            uint64_t received;
+            if (!takeNumber(rest, received)) return true;
+            for (size_t i = 0; i < s.uploads.size(); i++) {
+                ChatSession::Upload &u = s.uploads[i];
+                // acks for chunks from before a reconnect mean nothing until the server has told us where to go on
+                if (!u.accepted || u.id != id) continue;
+                u.acked = std::max(u.acked, received);
+                if (u.acked >= u.size) {
+                    ::close(u.fd);
+                    s.uploads.erase(s.uploads.begin() + i);
+                }
+                else pumpUpload(s, u);
+                break;
+            }
+            return true;
+        }
+        if (command == "/file_start") {
+            // "/file_start ID SIZE OFFSET NAME"
+            uint64_t size;
+            if (!takeNumber(rest, size)) return true;
+            for (size_t i = 0; i < s.downloads.size(); i++) {
+                if (s.downloads[i].id != id) continue;
+                s.downloads[i].started = true;
+                s.downloads[i].size = size;
+                if (s.downloads[i].received >= size) finishDownload(s, i);
+                break;
+            }
+            return true;
+        }
+        if (command == "/file_data") {
+            // "/file_data ID OFFSET <bytes>"
+            uint64_t offset;
+            if (!takeNumber(rest, offset)) return true;
+            for (size_t i = 0; i < s.downloads.size(); i++) {
+                ChatSession::Download &d = s.downloads[i];
+                if (d.id != id || !d.started) continue;
+                if (offset == d.received) {
+                    if (pwrite(d.fd, rest.data(), rest.size(), (off_t)offset) != (ssize_t)rest.size()) {
+                        ::close(d.fd);
+                        s.downloads.erase(s.downloads.begin() + i);
+                        return true;
+                    }
+                    d.received += rest.size();
+                    if (d.received >= d.size) finishDownload(s, i);
+                }
+                else if (offset > d.received && d.resentAt != d.received) {
+                    // a chunk went missing (a dropped frame, or one cut off by a reconnect), the server starts again there
+                    d.resentAt = d.received;
+                    s.send("/get_file " + std::to_string(d.id) + " " + std::to_string(d.received));
+                }
+                break;
+            }
+            return true;
+        }
+        if (command == "/file_offer" && s.handlers.onFileOffer) {
+            // "/file_offer ID SENDER SIZE NAME"
+            size_t split = rest.find(' ');
+            if (split == std::string_view::npos) return false;
+            std::string from(rest.substr(0, split));
+            rest.remove_prefix(split + 1);
+            uint64_t size;
+            if (!takeNumber(rest, size)) return false;
+            s.handlers.onFileOffer(s, id, from, std::string(rest), size);
+            return true;
+        }
+        return false;
+    }
+
+    /**
+     * @brief Sends the next chunks of an upload, as many as its window allows.
+     */
+    void pumpUpload(ChatSession &s, ChatSession::Upload &u) {
+        std::string head = "/file_chunk " + std::to_string(u.id) + " ";
+        std::string payload;
+        while (u.next < u.size && u.next - u.acked < u.chunk * u.window) {
+            size_t len = (size_t)std::min<uint64_t>(u.chunk, u.size - u.next);
+            payload.assign(head).append(std::to_string(u.next)).append(1, ' ');
+            size_t at = payload.size();
+            payload.resize(at + len);
+            ssize_t n = pread(u.fd, payload.data() + at, len, (off_t)u.next);
+            // a file that shrank while being sent cannot be finished
+            if (n != (ssize_t)len || s.send(payload) < 0) return;
+            u.next += len;
+        }
+    }
+
+    void finishDownload(ChatSession &s, size_t i) {
+        ChatSession::Download d = std::move(s.downloads[i]);
+        s.downloads.erase(s.downloads.begin() + i);
+        ::close(d.fd);
+        if (rename((d.path + ".part").c_str(), d.path.c_str()) < 0) return;
+        if (s.handlers.onFileReceived) s.handlers.onFileReceived(s, d.id, d.path);
+    }
+
+    /**
+     * @brief Writes as much of a session's output as the socket takes without blocking.
+     */
+    void flush(ChatSession &s) {
+        if (s.fd < 0 || s.state == ChatSession::State::CONNECTING) return;
+        while (s.outStart < s.out.size()) {
+            ssize_t n = ::send(s.fd, s.out.data() + s.outStart, s.out.size() - s.outStart, MSG_NOSIGNAL | MSG_DONTWAIT);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+                if (s.state == ChatSession::State::ACTIVE) connectionLost(s);
+                else connectionFailed(s, "Error connecting to server.");
+                return;
+            }
+            s.outStart += n;
+            while (s.frameStart + FRAME_HEADER_SIZE <= s.outStart) {
+                size_t end = s.frameStart + FRAME_HEADER_SIZE + decodeFrameHeader(s.out.data() + s.frameStart);
+                if (end > s.outStart) break;
+                s.frameStart = end;
+                if (s.loginFrames > 0) s.loginFrames--;
+            }
+        }
+        if (s.outStart == s.out.size()) {
+            s.out.clear();
+            s.outStart = s.frameStart = 0;
+            if (s.closing && s.state == ChatSession::State::ACTIVE) shutdown(s.fd, SHUT_WR);
+        }
+        else if (s.frameStart > s.out.size() / 2) {
+            // keep a long backlog from growing without bound at the front
+            s.out.erase(0, s.frameStart);
+            s.outStart -= s.frameStart;
+            s.frameStart = 0;
+        }
+    }
+
+    int epollFd = -1;
+    int wakeFd = -1;
+    uint32_t nextId = 1;
+    std::unordered_map<uint32_t, std::unique_ptr<ChatSession>> sessions;
+    std::vector<uint32_t> dirty;                // sessions with output queued during this pass
+    std::vector<uint32_t> finished;             // closed sessions, freed at the end of the pass
+    std::multimap<uint64_t, uint32_t> retries;  // reconnect deadline (ms) -> session
+    std::mutex postedMutex;
+    std::vector<std::function<void()>> posted;
+    std::atomic<bool> stopping{false};
+};
+
+inline int ChatSession::send(std::string_view payload) {
+    if (closing || state == State::CLOSED || payload.size() > frameLimit) return -1;
+    // behind a pending resume, or while reconnecting, frames wait for the next login
+    if (state == State::ACTIVE || state == State::LOGGING_IN || (state == State::CONNECTING && token.empty())) {
+        appendFrame(out, payload);
+        client->markDirty(*this);
+    }
+    else {
+        appendFrame(held, payload);
+    }
+    return 1;
+}
+
+inline int ChatSession::sendFile(const std::string &target, const std::string &path) {
+    if (closing || state == State::CLOSED || target.empty() || target.find(' ') != std::string::npos) return -1;
+    std::string name = path.substr(path.find_last_of('/') + 1);
+    if (name.empty() || name.find(' ') != std::string::npos) return -1;
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+    struct stat st;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+        ::close(fd);
+        return -1;
+    }
+    uploads.push_back(Upload{fd, target, name, (uint64_t)st.st_size});
+    return send("/send_file " + target + " " + name + " " + std::to_string(st.st_size));
+}
+
+inline int ChatSession::getFile(uint64_t fileId, const std::string &path) {
+    if (closing || state == State::CLOSED) return -1;
+    for (auto &d : downloads) if (d.id == fileId) return -1;
+    int fd = ::open((path + ".part").c_str(), O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) return -1;
+    struct stat st;
+    uint64_t have = fstat(fd, &st) == 0 ? (uint64_t)st.st_size : 0;
+    downloads.push_back(Download{fd, fileId, path, false, 0, have});
+    return send("/get_file " + std::to_string(fileId) + " " + std::to_string(have));
+}
+
+inline void ChatSession::close() {
+    if (closing || state == State::CLOSED) return;
+    if (state != State::ACTIVE) {
+        closing = true;
+        client->finish(*this, "Session closed.");
+        return;
+    }
+    send("/exit");
+    closing = true;
+}
+
+#endif
@@ -3,104 +3,89 @@
 #include <iostream>
 #include <string>
 #include <thread>
-#include <mutex>
-#include <unordered_map>
-#include <unordered_set>
-#include <vector>
-#include <sstream>
-#include <cstring>
 #include <cstdlib>
-#include <unistd.h>
-#include <arpa/inet.h>
+#include <map>
+#include "chat_client.h"
 
-#define BUFFER_SIZE 1024
+int main(int argc, char *argv[]) {
+    // ./client_grp [HOST] [PORT], defaulting to the local server on 12346
+    std::string host = argc > 1 ? argv[1] : "127.0.0.1";
+    int port = argc > 2 ? atoi(argv[2]) : 12346;
 
-std::mutex cout_mutex;
-
-void handle_server_messages(int server_socket) {
-    char buffer[BUFFER_SIZE];
-    while (true) {
-        memset(buffer, 0, BUFFER_SIZE);
-        int bytes_received = recv(server_socket, buffer, BUFFER_SIZE, 0);
-        if (bytes_received <= 0) {
-            std::lock_guard<std::mutex> lock(cout_mutex);
-            std::cout << "Disconnected from server." << std::endl;
-            close(server_socket);
-            exit(0);
-        }
-        std::lock_guard<std::mutex> lock(cout_mutex);
-        std::cout << buffer << std::endl;
-    }
-}
-
-int main() {
-    int client_socket;
-    sockaddr_in server_address{};
-
-    client_socket = socket(AF_INET, SOCK_STREAM, 0);
-    if (client_socket < 0) {
-        std::cerr << "Error creating socket." << std::endl;
-        return 1;
-    }
-
-    server_address.sin_family = AF_INET;
-    server_address.sin_port = htons(12346);
-    server_address.sin_addr.s_addr = inet_addr("127.0.0.1");
-
-    if (connect(client_socket, (sockaddr*)&server_address, sizeof(server_address)) < 0) {
-        std::cerr << "Error connecting to server." << std::endl;
-        return 1;
-    }
-
-    std::cout << "Connected to the server." << std::endl;
-
-    // Authentication
+    // Authentication: the library sends the credentials as one "/login" frame right behind our HELLO
     std::string username, password;
-    char buffer[BUFFER_SIZE];
-
-    memset(buffer, 0, BUFFER_SIZE);
-    recv(client_socket, buffer, BUFFER_SIZE, 0); // Receive the message "Enter the user name" for the server
-    // You should have a line like this in the server.cpp code: send_message(client_socket, "Enter username: ");
- 
-    std::cout << buffer;
+    std::cout << "Enter username: ";
     std::getline(std::cin, username);
-    send(client_socket, username.c_str(), username.size(), 0);
-
-    memset(buffer, 0, BUFFER_SIZE);
-    recv(client_socket, buffer, BUFFER_SIZE, 0); // Receive the message "Enter the password" for the server
-    std::cout << buffer;
+    std::cout << "Enter password: ";
     std::getline(std::cin, password);
-    send(client_socket, password.c_str(), password.size(), 0);
-
-    memset(buffer, 0, BUFFER_SIZE);
-    // Depending on whether the authentication passes or not, receive the message "Authentication Failed" or "Welcome to the server"
-    recv(client_socket, buffer, BUFFER_SIZE, 0); 
-    std::cout << buffer << std::endl;
 
-    if (std::string(buffer).find("Authentication failed") != std::string::npos) {
-        close(client_socket);
+    // Everything is printed by the loop thread (inside the handlers), so output needs no lock
+    ChatClient client;
+    bool welcomed = false, exiting = false;
+    int status = 0;
+    ChatSession::Handlers handlers;
+    handlers.onLogin = [&](ChatSession &, const std::string &welcome, bool) {
+        std::cout << (welcomed ? "Reconnected. " : "") << welcome << std::endl;
+        welcomed = true;
+    };
+    handlers.onMessage = [](ChatSession &, const std::string &message) {
+        std::cout << message << std::endl;
+    };
+    // offered files are downloaded into the current directory under the name they were sent with
+    std::map<uint64_t, std::string> offered;
+    handlers.onFileOffer = [&offered](ChatSession &, uint64_t id, const std::string &from, const std::string &name, uint64_t size) {
+        offered[id] = name;
+        std::cout << "[" << from << "] offers " << name << " (" << size << " bytes), type /get_file " << id << " to download it" << std::endl;
+    };
+    handlers.onFileReceived = [](ChatSession &, uint64_t, const std::string &path) {
+        std::cout << "Saved " << path << "." << std::endl;
+    };
+    handlers.onClosed = [&](ChatSession &, const std::string &reason) {
+        if (!exiting) std::cout << (welcomed ? "Disconnected from server: " + reason : reason) << std::endl;
+        if (!welcomed) status = 1;
+    };
+
+    ChatSession *session = client.open(host, port, username, password, handlers);
+    if (!session) {
+        std::cerr << "Invalid server address." << std::endl;
         return 1;
     }
 
-    // Start thread for receiving messages from server
-    std::thread receive_thread(handle_server_messages, client_socket);
-    // We use detach because we want this thread to run in the background while the main thread continues running
-    receive_thread.detach();
-
-    // Send messages to the server
-    while (true) {
+    // stdin is read on its own thread; each line is handed to the loop, which owns the session
+    std::thread input([&client, &exiting, &offered, session]() {
         std::string message;
-        std::getline(std::cin, message);
-
-        if (message.empty()) continue;
-
-        send(client_socket, message.c_str(), message.size(), 0);
-
-        if (message == "/exit") {
-            close(client_socket);
-            break;
+        while (std::getline(std::cin, message)) {
+            if (message.empty()) continue;
+            bool last = message == "/exit";
+            client.post([&exiting, &offered, session, message, last]() {
+                if (last) {
+                    exiting = true;
+                    session->close();
+                }
+                else if (message.rfind("/send_file ", 0) == 0) {
+                    // "/send_file TARGET PATH": the library uploads the file, the server answers when it is through
+                    std::string args = message.substr(11);
+                    size_t split = args.find(' ');
+                    if (split == std::string::npos || session->sendFile(args.substr(0, split), args.substr(split + 1)) < 0) {
+                        std::cout << "Usage: /send_file <user|group> <path to a readable, non-empty file>" << std::endl;
+                    }
+                }
+                else if (message.rfind("/get_file ", 0) == 0) {
+                    uint64_t id = strtoull(message.c_str() + 10, nullptr, 10);
+                    auto it = offered.find(id);
+                    std::string path = it != offered.end() ? it->second : "file-" + std::to_string(id);
+                    if (session->getFile(id, path) < 0) std::cout << "Cannot save to " << path << "." << std::endl;
+                }
+                else if (session->send(message) < 0) {
+                    std::cout << "Message too long (limit is " << session->maxFrame() << " bytes)." << std::endl;
+                }
+            });
+            if (last) break;
         }
-    }
+    });
+    // We use detach because the loop below decides when the client is done, even while stdin is blocked
+    input.detach();
 
-    return 0;
+    client.run();
+    return status;
 }
@@ -0,0 +1,537 @@
+// Credential store: salted PBKDF2 password hashes in an mmap'd, sorted user database, reloaded in the background
+
+#ifndef CREDENTIAL_STORE_H
+#define CREDENTIAL_STORE_H
+
+#include <mutex>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+#include <cstdio>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <algorithm>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/random.h>
+#include <sys/inotify.h>
+#include <sys/signalfd.h>
+
+/*
+*  Two file formats are accepted. The original users.txt ("user:password" per
+*  line) is parsed into a sorted array; it is kept for small setups and
+*  malformed lines are skipped instead of crashing the server. The binary user
+*  database (built with `./server_grp --build-users users.txt users.db`) holds
+*  no plaintext: every user has a random 16 byte salt and a PBKDF2-HMAC-SHA256
+*  hash, the records are sorted by name, and the file is mapped as is, so
+*  loading a million users costs one mmap and a lookup is a binary search over
+*  pages the kernel faults in on demand.
+*
+*  Every load produces an immutable snapshot. A background thread reloads the
+*  file when it is replaced (inotify) or on SIGHUP and swaps the new snapshot
+*  in; a login in progress keeps the snapshot it started with, and a file that
+*  fails to load leaves the current one in place.
+*/
+#define USERDB_MAGIC "CHUSRDB1"
+#define USERDB_VERSION 1
+#define USERDB_SALT_SIZE 16
+#define USERDB_HASH_SIZE 32
+#define USERDB_DEFAULT_ITERATIONS 4096
+
+struct UserDbHeader{
+    char magic[8];
+    uint32_t version;
+    uint32_t iterations;    // PBKDF2 rounds, the same for every record of the file
+    uint64_t count;         // records, right after this header
+    uint64_t namesOffset;   // start of the username blob
+    uint64_t namesSize;
+};
+
+struct UserDbRecord{
+    uint64_t nameOffset;    // into the username blob
+    uint32_t nameLength;
+    uint32_t reserved;
+    uint8_t salt[USERDB_SALT_SIZE];
+    uint8_t hash[USERDB_HASH_SIZE];
+};
+
+/*
+    SHA-256 / PBKDF2 : start
+*/
+
+class Sha256{
+public:
+    Sha256(){
+        static const uint32_t init[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+        memcpy(state, init, sizeof(state));
+    }
+
+    void update(const void *data, size_t len){
+        const uint8_t *p = (const uint8_t*)data;
+        total += len;
+        if(used){
+            size_t take = std::min(len, (size_t)64 - used);
+            memcpy(block + used, p, take);
+            used += take;
+            p += take;
+            len -= take;
+            if(used < 64) return;
+            compress(block);
+            used = 0;
+        }
+        for(; len >= 64; p += 64, len -= 64) compress(p);
+        memcpy(block, p, len);
+        used = len;
+    }
+
+    void final(uint8_t out[USERDB_HASH_SIZE]){
+        uint64_t bits = total * 8;
+        uint8_t pad = 0x80;
+        update(&pad, 1);
+        pad = 0;
+        while(used != 56) update(&pad, 1);
+        uint8_t length[8];
+        for(int i = 0; i < 8; i++) length[i] = (uint8_t)(bits >> (56 - 8 * i));
+        update(length, 8);
+        for(int i = 0; i < 8; i++){
+            out[4 * i] = (uint8_t)(state[i] >> 24);
+            out[4 * i + 1] = (uint8_t)(state[i] >> 16);
+            out[4 * i + 2] = (uint8_t)(state[i] >> 8);
+            out[4 * i + 3] = (uint8_t)state[i];
+        }
+    }
+
+private:
+    static uint32_t rotr(uint32_t x, int n){ return x >> n | x << (32 - n); }
+
+    void compress(const uint8_t *p){
+        static const uint32_t k[64] = {
+            0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+            0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+            0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+            0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+            0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+            0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+            0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+            0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+        uint32_t w[64];
+        for(int i = 0; i < 16; i++) w[i] = (uint32_t)p[4 * i] << 24 | (uint32_t)p[4 * i + 1] << 16 | (uint32_t)p[4 * i + 2] << 8 | p[4 * i + 3];
+        for(int i = 16; i < 64; i++){
+            uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+        uint32_t a = state[0], b = state[1], c = state[2], d = state[3], e = state[4], f = state[5], g = state[6], h = state[7];
+        for(int i = 0; i < 64; i++){
+            uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + k[i] + w[i];
+            uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            h = g; g = f; f = e; e = d + t1;
+            d = c; c = b; b = a; a = t1 + t2;
+        }
+        state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+        state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+    }
+
+    uint32_t state[8];
+    uint8_t block[64];
+    uint64_t total = 0;
+    size_t used = 0;
+};
+
+/**
+ * @brief PBKDF2-HMAC-SHA256 with a 32 byte output (RFC 8018).
+ *
+ * The HMAC key pads are hashed once up front, so each round costs two SHA-256 compressions.
+ */
+inline void pbkdf2Sha256(std::string_view password, const uint8_t *salt, size_t saltLength, uint32_t iterations, uint8_t out[USERDB_HASH_SIZE]){
+    uint8_t key[64] = {};
+    if(password.size() > sizeof(key)){
+        Sha256 digest;
+        digest.update(password.data(), password.size());
+        digest.final(key);
+    }
+    else memcpy(key, password.data(), password.size());
+
+    Sha256 inner, outer;
+    uint8_t pad[64];
+    for(int i = 0; i < 64; i++) pad[i] = key[i] ^ 0x36;
+    inner.update(pad, sizeof(pad));
+    for(int i = 0; i < 64; i++) pad[i] = key[i] ^ 0x5c;
+    outer.update(pad, sizeof(pad));
+
+    auto hmac = [&](const uint8_t *a, size_t aLength, const uint8_t *b, size_t bLength, uint8_t mac[USERDB_HASH_SIZE]){
+        uint8_t digest[USERDB_HASH_SIZE];
+        Sha256 in = inner;
+        in.update(a, aLength);
+        if(bLength) in.update(b, bLength);
+        in.final(digest);
+        Sha256 o = outer;
+        o.update(digest, sizeof(digest));
+        o.final(mac);
+    };
+
+    static const uint8_t blockIndex[4] = {0, 0, 0, 1};
+    uint8_t u[USERDB_HASH_SIZE];
+    hmac(salt, saltLength, blockIndex, sizeof(blockIndex), u);
+    memcpy(out, u, sizeof(u));
+    for(uint32_t i = 1; i < iterations; i++){
+        hmac(u, sizeof(u), nullptr, 0, u);
+        for(int j = 0; j < USERDB_HASH_SIZE; j++) out[j] ^= u[j];
+    }
+}
+
+// Compares without an early exit, so the time taken does not tell how many leading bytes matched
+inline bool constantTimeEqual(const void *a, const void *b, size_t length){
+    const uint8_t *x = (const uint8_t*)a, *y = (const uint8_t*)b;
+    uint8_t diff = 0;
+    for(size_t i = 0; i < length; i++) diff |= x[i] ^ y[i];
+    return diff == 0;
+}
+
+/*
+    SHA-256 / PBKDF2 : end
+*/
+
+/**
+ * @brief Splits one users.txt line into username and password.
+ *
+ * @return bool Returns false for a malformed line (no ':' or an empty username), which the caller skips.
+ */
+inline bool parseUserLine(std::string_view line, std::string_view &username, std::string_view &password){
+    if(!line.empty() && line.back() == '\r') line.remove_suffix(1);
+    size_t colon = line.find(':');
+    if(colon == std::string_view::npos || colon == 0) return false;
+    username = line.substr(0, colon);
+    password = line.substr(colon + 1);
+    return true;
+}
+
+/**
+ * @brief Reads a users.txt file into (username, password) pairs sorted by username; a later line for the same user wins.
+ *
+ * @return int Returns 1 on success, otherwise returns -1 (the file cannot be read).
+ */
+inline int readUserText(const std::string &path, std::vector<std::pair<std::string, std::string>> &users){
+    std::ifstream f(path);
+    if(!f.is_open()) return -1;
+    std::string line;
+    size_t lineNumber = 0, skipped = 0;
+    while(std::getline(f, line)){
+        lineNumber++;
+        std::string_view username, password;
+        if(!parseUserLine(line, username, password)){
+            if(!line.empty() && line != "\r" && skipped++ < 5) fprintf(stderr, "%s:%zu: malformed user line skipped\n", path.c_str(), lineNumber);
+            continue;
+        }
+        users.emplace_back(username, password);
+    }
+    std::stable_sort(users.begin(), users.end(), [](auto &a, auto &b){ return a.first < b.first; });
+    // keep the last of every run of equal names
+    auto last = std::unique(users.rbegin(), users.rend(), [](auto &a, auto &b){ return a.first == b.first; });
+    users.erase(users.begin(), last.base());
+    return 1;
+}
+
+class CredentialSnapshot{
+public:
+    CredentialSnapshot() = default;
+    CredentialSnapshot(const CredentialSnapshot&) = delete;
+    CredentialSnapshot& operator=(const CredentialSnapshot&) = delete;
+    ~CredentialSnapshot(){ if(map) munmap(map, mapSize); }
+
+    /**
+     * @brief Loads a binary user database or, if the file does not start with its magic, a users.txt file.
+     *
+     * @return std::shared_ptr<CredentialSnapshot> The snapshot, or nullptr with the reason printed.
+     */
+    static std::shared_ptr<CredentialSnapshot> load(const std::string &path){
+        auto snapshot = std::make_shared<CredentialSnapshot>();
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if(fd < 0){
+            fprintf(stderr, "Cannot open %s: %s\n", path.c_str(), strerror(errno));
+            return nullptr;
+        }
+        struct stat st;
+        char magic[8] = {};
+        bool binary = fstat(fd, &st) == 0 && pread(fd, magic, sizeof(magic), 0) == (ssize_t)sizeof(magic)
+                      && memcmp(magic, USERDB_MAGIC, sizeof(magic)) == 0;
+        if(!binary){
+            ::close(fd);
+            if(readUserText(path, snapshot->plain) < 0){
+                fprintf(stderr, "Cannot read %s\n", path.c_str());
+                return nullptr;
+            }
+            return snapshot;
+        }
+
+        snapshot->mapSize = st.st_size;
+        void *map = mmap(nullptr, snapshot->mapSize, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if(map == MAP_FAILED){
+            fprintf(stderr, "Cannot map %s: %s\n", path.c_str(), strerror(errno));
+            return nullptr;
+        }
+        snapshot->map = map;
+
+        const UserDbHeader *header = (const UserDbHeader*)map;
+        size_t size = snapshot->mapSize;
+        if(size < sizeof(UserDbHeader) || header->version != USERDB_VERSION || header->iterations == 0
+           || header->count > (size - sizeof(UserDbHeader)) / sizeof(UserDbRecord)
+           || header->namesOffset > size || header->namesSize > size - header->namesOffset){
+            fprintf(stderr, "%s is not a valid user database\n", path.c_str());
+            return nullptr;
+        }
+        snapshot->records = (const UserDbRecord*)((const char*)map + sizeof(UserDbHeader));
+        snapshot->names = (const char*)map + header->namesOffset;
+        snapshot->namesSize = header->namesSize;
+        snapshot->count = header->count;
+        snapshot->iterations = header->iterations;
+        madvise(map, size, MADV_RANDOM);
+        return snapshot;
+    }
+
+    size_t size() const { return map ? count : plain.size(); }
+
+    bool exists(std::string_view username) const {
+        if(map) return find(username) != nullptr;
+        return findPlain(username) != plain.end();
+    }
+
+    /**
+     * @brief Checks a password; an unknown user costs as much as a wrong password.
+     */
+    bool verify(std::string_view username, std::string_view password) const {
+        if(!map){
+            auto it = findPlain(username);
+            if(it == plain.end()) return false;
+            return it->second.size() == password.size() && constantTimeEqual(it->second.data(), password.data(), password.size());
+        }
+
+        static const uint8_t dummySalt[USERDB_SALT_SIZE] = {};
+        const UserDbRecord *record = find(username);
+        uint8_t hash[USERDB_HASH_SIZE];
+        pbkdf2Sha256(password, record ? record->salt : dummySalt, USERDB_SALT_SIZE, iterations, hash);
+        return record && constantTimeEqual(hash, record->hash, USERDB_HASH_SIZE);
+    }
+
+private:
+    std::string_view nameOf(const UserDbRecord &record) const {
+        if(record.nameOffset > namesSize || record.nameLength > namesSize - record.nameOffset) return {};
+        return std::string_view(names + record.nameOffset, record.nameLength);
+    }
+
+    const UserDbRecord* find(std::string_view username) const {
+        size_t low = 0, high = count;
+        while(low < high){
+            size_t mid = low + (high - low) / 2;
+            int c = nameOf(records[mid]).compare(username);
+            if(c == 0) return &records[mid];
+            if(c < 0) low = mid + 1;
+            else high = mid;
+        }
+        return nullptr;
+    }
+
+    std::vector<std::pair<std::string, std::string>>::const_iterator findPlain(std::string_view username) const {
+        auto it = std::lower_bound(plain.begin(), plain.end(), username, [](auto &entry, std::string_view name){ return entry.first < name; });
+        return it != plain.end() && it->first == username ? it : plain.end();
+    }
+
+    // binary user database
+    void *map = nullptr;
+    size_t mapSize = 0;
+    const UserDbRecord *records = nullptr;
+    const char *names = nullptr;
+    size_t namesSize = 0;
+    size_t count = 0;
+    uint32_t iterations = 0;
+
+    // users.txt
+    std::vector<std::pair<std::string, std::string>> plain;
+};
+
+class CredentialStore{
+public:
+    /**
+     * @brief Loads `file`; also the file that watch() keeps reloading.
+     *
+     * @return int Returns 1 on success, otherwise returns -1.
+     */
+    int load(const std::string &file){
+        path = file;
+        return reload();
+    }
+
+    /**
+     * @brief Loads the file again and swaps the new snapshot in; on failure the current snapshot stays.
+     *
+     * @return int Returns 1 on success, otherwise returns -1.
+     */
+    int reload(){
+        std::shared_ptr<const CredentialSnapshot> next = CredentialSnapshot::load(path);
+        if(!next) return -1;
+        size_t users = next->size();
+        {
+            std::lock_guard<std::mutex> lock(m);
+            snapshot.swap(next);
+        }
+        fprintf(stderr, "Loaded %zu users from %s\n", users, path.c_str());
+        return 1;
+    }
+
+    std::shared_ptr<const CredentialSnapshot> current() const {
+        std::lock_guard<std::mutex> lock(m);
+        return snapshot;
+    }
+
+    bool exists(std::string_view username) const {
+        auto users = current();
+        return users && users->exists(username);
+    }
+
+    bool verify(std::string_view username, std::string_view password) const {
+        auto users = current();
+        return users && users->verify(username, password);
+    }
+
+    /**
+     * @brief Reloads whenever the file is rewritten or replaced in its directory, or on SIGHUP; never returns.
+     *
+     * SIGHUP has to be blocked in every thread first (blockReloadSignal()), so only this thread's
+     * signalfd sees it.
+     */
+    void watch(){
+        std::string dir = ".", name = path;
+        size_t slash = path.rfind('/');
+        if(slash != std::string::npos){
+            dir = slash == 0 ? "/" : path.substr(0, slash);
+            name = path.substr(slash + 1);
+        }
+
+        int notify = inotify_init1(IN_CLOEXEC);
+        if(notify >= 0 && inotify_add_watch(notify, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO) < 0){
+            perror("inotify_add_watch failed");
+            ::close(notify);
+            notify = -1;
+        }
+        sigset_t hup;
+        sigemptyset(&hup);
+        sigaddset(&hup, SIGHUP);
+        int signals = signalfd(-1, &hup, SFD_CLOEXEC);
+
+        pollfd fds[2] = {{notify, POLLIN, 0}, {signals, POLLIN, 0}};
+        alignas(inotify_event) char events[4096];
+        while(true){
+            if(poll(fds, 2, -1) < 0){
+                if(errno == EINTR) continue;
+                perror("poll failed");
+                return;
+            }
+            bool changed = false;
+            if(fds[0].revents & POLLIN){
+                ssize_t n = read(notify, events, sizeof(events));
+                for(ssize_t off = 0; off < n; ){
+                    const inotify_event *event = (const inotify_event*)(events + off);
+                    if(event->len && name == event->name) changed = true;
+                    off += sizeof(inotify_event) + event->len;
+                }
+            }
+            if(fds[1].revents & POLLIN){
+                signalfd_siginfo info;
+                if(read(signals, &info, sizeof(info)) == (ssize_t)sizeof(info)) changed = true;
+            }
+            if(changed) reload();
+        }
+    }
+
+private:
+    mutable std::mutex m;       // only guards swapping/copying the pointer
+    std::shared_ptr<const CredentialSnapshot> snapshot;
+    std::string path;
+};
+
+/**
+ * @brief Blocks SIGHUP in the calling thread and every thread it creates afterwards, so CredentialStore::watch() can take it.
+ */
+inline void blockReloadSignal(){
+    sigset_t hup;
+    sigemptyset(&hup);
+    sigaddset(&hup, SIGHUP);
+    pthread_sigmask(SIG_BLOCK, &hup, nullptr);
+}
+
+/**
+ * @brief Converts a users.txt file into a binary user database, replacing `dbPath` atomically.
+ *
+ * @param iterations PBKDF2 rounds per password; every login pays this once.
+ * @return int Returns 1 on success, otherwise returns -1 with the reason printed.
+ *
+ * Hashing is spread over all cores. The database is written to a temporary file, synced and renamed over
+ * `dbPath`, so a running server's watcher picks up a complete file and never sees a half-written one.
+ */
+inline int buildUserDb(const std::string &textPath, const std::string &dbPath, uint32_t iterations){
+    std::vector<std::pair<std::string, std::string>> users;
+    if(readUserText(textPath, users) < 0){
+        fprintf(stderr, "Cannot read %s\n", textPath.c_str());
+        return -1;
+    }
+
+    UserDbHeader header{};
+    memcpy(header.magic, USERDB_MAGIC, sizeof(header.magic));
+    header.version = USERDB_VERSION;
+    header.iterations = iterations ? iterations : 1;
+    header.count = users.size();
+    header.namesOffset = sizeof(UserDbHeader) + users.size() * sizeof(UserDbRecord);
+
+    std::vector<UserDbRecord> records(users.size());
+    std::string names;
+    for(size_t i = 0; i < users.size(); i++){
+        records[i].nameOffset = names.size();
+        records[i].nameLength = (uint32_t)users[i].first.size();
+        names += users[i].first;
+        if(getrandom(records[i].salt, USERDB_SALT_SIZE, 0) != USERDB_SALT_SIZE){
+            perror("getrandom failed");
+            return -1;
+        }
+    }
+    header.namesSize = names.size();
+
+    size_t workers = std::max(1u, std::thread::hardware_concurrency());
+    std::vector<std::thread> pool;
+    for(size_t w = 0; w < workers; w++){
+        pool.emplace_back([&, w]{
+            for(size_t i = w; i < users.size(); i += workers)
+                pbkdf2Sha256(users[i].second, records[i].salt, USERDB_SALT_SIZE, header.iterations, records[i].hash);
+        });
+    }
+    for(auto &t : pool) t.join();
+
+    std::string tmp = dbPath + ".tmp";
+    FILE *f = fopen(tmp.c_str(), "wb");
+    if(!f){
+        fprintf(stderr, "Cannot create %s: %s\n", tmp.c_str(), strerror(errno));
+        return -1;
+    }
+    bool ok = fwrite(&header, sizeof(header), 1, f) == 1
+              && (records.empty() || fwrite(records.data(), sizeof(UserDbRecord), records.size(), f) == records.size())
+              && (names.empty() || fwrite(names.data(), names.size(), 1, f) == 1)
+              && fflush(f) == 0 && fsync(fileno(f)) == 0;
+    ok = fclose(f) == 0 && ok;
+    if(!ok || rename(tmp.c_str(), dbPath.c_str()) < 0){
+        fprintf(stderr, "Cannot write %s: %s\n", dbPath.c_str(), strerror(errno));
+        unlink(tmp.c_str());
+        return -1;
+    }
+    printf("Wrote %zu users to %s (%u PBKDF2 rounds)\n", users.size(), dbPath.c_str(), header.iterations);
+    return 1;
+}
+
+#endif
@@ -0,0 +1,167 @@
+// Work-stealing worker pool that splits one large fan-out into partitions and runs them on several cores
+
+#ifndef FANOUT_POOL_H
+#define FANOUT_POOL_H
+
+#include <mutex>
+#include <deque>
+#include <atomic>
+#include <memory>
+#include <thread>
+#include <vector>
+#include <cstdint>
+#include <type_traits>
+#include <condition_variable>
+
+/*
+*  A fan-out is handed over as `parts` partitions numbered 0..parts-1. The
+*  calling thread deals partitions 1.. round-robin onto the workers' deques,
+*  runs partition 0 itself and then keeps taking partitions (its own or any
+*  other fan-out's) until none are left, so it is never idle while its
+*  fan-out is still running. Each fan-out counts its partitions down as they
+*  finish and the caller returns once the count reaches zero, so everything
+*  the fan-out queued is in place before the caller's next command runs.
+*
+*  Every worker owns a deque: it pops its own work from the back and, once
+*  that is empty, steals from the front of the others, so one worker stuck
+*  on a slow partition cannot hold up the rest. The deques are short and
+*  each has its own mutex; a partition is thousands of recipients, so the
+*  locking is noise next to the work.
+*/
+class FanoutPool{
+public:
+    ~FanoutPool(){
+        {
+            std::lock_guard<std::mutex> lock(sleepMutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for(auto &t : threads) t.join();
+    }
+
+    /**
+     * @brief Starts `count` worker threads; with 0 every fan-out runs inline on the caller.
+     */
+    void start(unsigned count){
+        queues.clear();
+        for(unsigned i = 0; i < count; i++) queues.push_back(std::make_unique<WorkQueue>());
+        for(unsigned i = 0; i < count; i++) threads.emplace_back([this, i]{ work(i); });
+    }
+
+    unsigned size() const { return (unsigned)queues.size(); }
+
+    /**
+     * @brief Runs `f(part)` for every part in [0, parts) across the pool and returns once all of them are done.
+     */
+    template<class F>
+    void run(uint32_t parts, F &&f){
+        if(parts == 0) return;
+        if(parts == 1 || queues.empty()){
+            for(uint32_t p = 0; p < parts; p++) f(p);
+            return;
+        }
+
+        Job job;
+        job.context = &f;
+        job.body = [](void *context, uint32_t part){ (*static_cast<std::remove_reference_t<F>*>(context))(part); };
+        job.remaining.store(parts, std::memory_order_relaxed);
+
+        {
+            // counted before they are queued, so a worker that takes one early can never drive the count below zero
+            std::lock_guard<std::mutex> lock(sleepMutex);
+            queued += parts - 1;
+        }
+        uint32_t first = nextQueue.fetch_add(1, std::memory_order_relaxed);
+        for(uint32_t p = 1; p < parts; p++){
+            WorkQueue &q = *queues[(first + p) % queues.size()];
+            std::lock_guard<std::mutex> lock(q.m);
+            q.tasks.push_back(Task{&job, p});
+        }
+        if(parts - 1 >= queues.size()) wake.notify_all();
+        else for(uint32_t p = 1; p < parts; p++) wake.notify_one();
+
+        finish(Task{&job, 0});
+        Task task;
+        while(job.remaining.load(std::memory_order_acquire) > 0 && take((size_t)first % queues.size(), task)) finish(task);
+
+        std::unique_lock<std::mutex> lock(job.m);
+        job.doneCv.wait(lock, [&]{ return job.done; });
+    }
+
+private:
+    struct Job{
+        void *context = nullptr;
+        void (*body)(void *context, uint32_t part) = nullptr;
+        std::atomic<uint32_t> remaining{0};    // partitions not finished yet
+        std::mutex m;
+        std::condition_variable doneCv;
+        bool done = false;                      // under `m`; the caller may only drop the job once this is set
+    };
+
+    struct Task{
+        Job *job = nullptr;
+        uint32_t part = 0;
+    };
+
+    struct WorkQueue{
+        std::mutex m;
+        std::deque<Task> tasks;
+    };
+
+    static void finish(const Task &task){
+        Job &job = *task.job;
+        job.body(job.context, task.part);
+        if(job.remaining.fetch_sub(1, std::memory_order_acq_rel) == 1){
+            // notified under the lock, so the caller cannot see `done` and destroy the job before this is over
+            std::lock_guard<std::mutex> lock(job.m);
+            job.done = true;
+            job.doneCv.notify_one();
+        }
+    }
+
+    /**
+     * @brief Takes a task from the back of queue `own`, or else steals one from the front of another queue.
+     */
+    bool take(size_t own, Task &task){
+        for(size_t i = 0; i < queues.size(); i++){
+            WorkQueue &q = *queues[(own + i) % queues.size()];
+            std::lock_guard<std::mutex> lock(q.m);
+            if(q.tasks.empty()) continue;
+            if(i == 0){
+                task = q.tasks.back();
+                q.tasks.pop_back();
+            }
+            else{
+                task = q.tasks.front();
+                q.tasks.pop_front();
+            }
+            std::lock_guard<std::mutex> sleepLock(sleepMutex);
+            queued--;
+            return true;
+        }
+        return false;
+    }
+
+    void work(unsigned self){
+        Task task;
+        while(true){
+            if(take(self, task)){
+                finish(task);
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(sleepMutex);
+            wake.wait(lock, [&]{ return stopping || queued > 0; });
+            if(stopping) return;
+        }
+    }
+
+    std::vector<std::unique_ptr<WorkQueue>> queues;
+    std::vector<std::thread> threads;
+    std::atomic<uint32_t> nextQueue{0};         // spreads the first partition of each fan-out over the queues
+    std::mutex sleepMutex;                      // guards `queued` and `stopping`
+    std::condition_variable wake;
+    size_t queued = 0;                          // tasks sitting in any queue
+    bool stopping = false;
+};
+
+#endif
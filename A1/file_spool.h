@@ -0,0 +1,217 @@
+// Spool directory for file transfers: uploads are staged on disk chunk by chunk and relayed to recipients from there
+
+#ifndef FILE_SPOOL_H
+#define FILE_SPOOL_H
+
+#include <mutex>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <cstdio>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <unordered_map>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define FILE_CHUNK_SIZE (32 * 1024)     // file bytes per /file_chunk or /file_data frame (less under a small frame limit)
+#define FILE_WINDOW_CHUNKS 4            // unacknowledged chunks an uploader may have on the wire
+#define FILE_CHUNK_OVERHEAD 64          // room kept in a frame for the command, id and offset in front of the bytes
+
+/*
+*  One file on its way from a sender to a user or a group. The spool file is
+*  written at increasing offsets as chunks arrive; once `received` reaches
+*  `size` it is complete, renamed from "<id>.part" to "<id>" and can be
+*  downloaded. The descriptor stays open for the transfer's whole life, so a
+*  download in progress keeps working even after the transfer has expired
+*  and its file was unlinked.
+*/
+struct FileTransfer{
+    uint64_t id = 0;
+    std::string sender;
+    std::string target;             // a username, or a group name if `toGroup`
+    std::string name;
+    bool toGroup = false;
+    uint64_t size = 0;
+    int fd = -1;
+
+    mutable std::mutex m;           // guards the fields below and serialises writes
+    uint64_t received = 0;
+    bool complete = false;
+    int64_t touchedAt = 0;          // steady clock, ms; last chunk, or last download started
+
+    ~FileTransfer(){ if(fd >= 0) ::close(fd); }
+};
+
+/*
+*  The registry of transfers plus the directory their files live in. An
+*  upload is keyed by sender, target, name and size until it completes, so a
+*  sender that reconnects and asks to send the same file again resumes where
+*  the spool left off instead of starting over. Transfers untouched for the
+*  TTL are dropped (and their files deleted) whenever a new one begins.
+*  Transfer ids restart with the server, so the directory is emptied on open.
+*/
+class FileSpool{
+public:
+    /**
+     * @brief Creates (or empties) the spool directory.
+     *
+     * @return int Returns 1 on success, otherwise returns -1 with the reason printed.
+     */
+    int open(const std::string &dir, uint64_t maxSize, int64_t ttlMs){
+        std::lock_guard<std::mutex> lock(m);
+        std::error_code ec;
+        std::filesystem::create_directories(dir, ec);
+        if(ec){
+            fprintf(stderr, "Cannot create spool directory %s: %s\n", dir.c_str(), ec.message().c_str());
+            return -1;
+        }
+        for(auto &entry : std::filesystem::directory_iterator(dir, ec)){
+            // only files named like ours ("<id>" or "<id>.part") are removed
+            std::string file = entry.path().filename().string();
+            if(file.size() > 5 && file.compare(file.size() - 5, 5, ".part") == 0) file.resize(file.size() - 5);
+            if(entry.is_regular_file() && !file.empty() && file.find_first_not_of("0123456789") == std::string::npos) std::filesystem::remove(entry.path(), ec);
+        }
+        directory = dir;
+        maxFileSize = maxSize;
+        ttl = ttlMs;
+        enabled = true;
+        return 1;
+    }
+
+    bool isOpen() const { return enabled; }
+    uint64_t sizeLimit() const { return maxFileSize; }
+
+    /**
+     * @brief Starts an upload, or finds the unfinished one with the same sender, target, name and size.
+     *
+     * @return std::shared_ptr<FileTransfer> The transfer (its `received` is where the sender continues),
+     *         or nullptr if the file is too large or cannot be created.
+     */
+    std::shared_ptr<FileTransfer> begin(std::string_view sender, std::string_view target, bool toGroup,
+                                        std::string_view name, uint64_t size, int64_t now){
+        if(!enabled || size == 0 || size > maxFileSize) return nullptr;
+        std::lock_guard<std::mutex> lock(m);
+        expireLocked(now);
+
+        std::string key = uploadKey(sender, target, name, size);
+        auto found = uploads.find(key);
+        if(found != uploads.end()){
+            auto it = transfers.find(found->second);
+            if(it != transfers.end()){
+                std::lock_guard<std::mutex> transferLock(it->second->m);
+                it->second->touchedAt = now;
+                return it->second;
+            }
+            uploads.erase(found);
+        }
+
+        auto transfer = std::make_shared<FileTransfer>();
+        transfer->id = nextId++;
+        transfer->sender = sender;
+        transfer->target = target;
+        transfer->name = name;
+        transfer->toGroup = toGroup;
+        transfer->size = size;
+        transfer->touchedAt = now;
+        transfer->fd = ::open(pathOf(transfer->id, false).c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+        if(transfer->fd < 0) return nullptr;
+        transfers.emplace(transfer->id, transfer);
+        uploads.emplace(std::move(key), transfer->id);
+        return transfer;
+    }
+
+    /**
+     * @brief Stores one chunk of an upload.
+     *
+     * @param received Set to the number of bytes the spool holds afterwards, which is what the sender is told.
+     * @return int Returns 2 if this chunk completed the file, 1 if it was stored, 0 if it was not the next one
+     *             (a repeat after a reconnect, or out of order) and was ignored, and -1 if the transfer is
+     *             unknown, not the sender's, or the write failed.
+     */
+    int write(uint64_t id, std::string_view sender, uint64_t offset, std::string_view data, int64_t now,
+              uint64_t &received, std::shared_ptr<FileTransfer> &transfer){
+        transfer = find(id);
+        if(!transfer || transfer->sender != sender) return -1;
+
+        {
+            std::lock_guard<std::mutex> lock(transfer->m);
+            received = transfer->received;
+            if(transfer->complete || offset != transfer->received || data.empty()) return 0;
+            if(data.size() > transfer->size - transfer->received) return -1;
+            size_t done = 0;
+            while(done < data.size()){
+                ssize_t n = pwrite(transfer->fd, data.data() + done, data.size() - done, (off_t)(offset + done));
+                if(n < 0 && errno == EINTR) continue;
+                if(n <= 0) return -1;
+                done += n;
+            }
+            transfer->received = received = offset + data.size();
+            transfer->touchedAt = now;
+            if(transfer->received < transfer->size) return 1;
+            transfer->complete = true;
+        }
+
+        // lock order is spool before transfer, so the transfer's lock is given up first
+        std::error_code ec;
+        std::filesystem::rename(pathOf(id, false), pathOf(id, true), ec);
+        std::lock_guard<std::mutex> spoolLock(m);
+        uploads.erase(uploadKey(transfer->sender, transfer->target, transfer->name, transfer->size));
+        return 2;
+    }
+
+    /**
+     * @brief Looks a transfer up by id.
+     */
+    std::shared_ptr<FileTransfer> find(uint64_t id){
+        std::lock_guard<std::mutex> lock(m);
+        auto it = transfers.find(id);
+        return it == transfers.end() ? nullptr : it->second;
+    }
+
+private:
+    static std::string uploadKey(std::string_view sender, std::string_view target, std::string_view name, uint64_t size){
+        std::string key;
+        key.append(sender).append(1, '\n').append(target).append(1, '\n').append(name).append(1, '\n').append(std::to_string(size));
+        return key;
+    }
+
+    std::string pathOf(uint64_t id, bool complete) const {
+        return directory + "/" + std::to_string(id) + (complete ? "" : ".part");
+    }
+
+    void expireLocked(int64_t now){
+        if(ttl <= 0) return;
+        for(auto it = transfers.begin(); it != transfers.end();){
+            FileTransfer &t = *it->second;
+            bool stale, complete;
+            {
+                std::lock_guard<std::mutex> lock(t.m);
+                stale = now - t.touchedAt > ttl;
+                complete = t.complete;
+            }
+            if(!stale){
+                ++it;
+                continue;
+            }
+            std::error_code ec;
+            std::filesystem::remove(pathOf(t.id, complete), ec);
+            if(!complete) uploads.erase(uploadKey(t.sender, t.target, t.name, t.size));
+            it = transfers.erase(it);
+        }
+    }
+
+    std::mutex m;
+    bool enabled = false;
+    std::string directory;
+    uint64_t maxFileSize = 0;
+    int64_t ttl = 0;
+    uint64_t nextId = 1;
+    std::unordered_map<uint64_t, std::shared_ptr<FileTransfer>> transfers;
+    std::unordered_map<std::string, uint64_t> uploads;     // unfinished uploads by sender, target, name and size
+};
+
+#endif
@@ -0,0 +1,252 @@
+// Asynchronous logger: per-thread lock-free ring buffers drained by one background writer
+
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <atomic>
+#include <array>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <chrono>
+#include <cstdarg>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <unistd.h>
+#include <sys/resource.h>
+
+enum class LogLevel{
+    DEBUG = 0,
+    INFO = 1,
+    WARN = 2,
+    ERROR = 3,
+    OFF = 4
+};
+
+#define LOG_RING_SLOTS 512              // records per thread, a power of two
+#define LOG_RECORD_SIZE 256             // bytes per record, text included; longer lines are truncated
+#define LOG_FLUSH_MS 2                  // how often the writer drains the rings when nobody wakes it
+#define LOG_WRITER_NICE 10
+
+struct LogRecord{
+    int64_t timeNs;                     // CLOCK_REALTIME
+    uint32_t thread;                    // the producing ring's id
+    LogLevel level;
+    uint16_t length;
+    char text[LOG_RECORD_SIZE - 8 - 4 - sizeof(LogLevel) - 2];
+};
+static_assert(sizeof(LogRecord) == LOG_RECORD_SIZE, "LogRecord must fill exactly one slot");
+
+/*
+*  Single-producer single-consumer ring of fixed-size records. The owning
+*  thread formats straight into the next free slot and publishes it with one
+*  release store; the writer thread copies published slots out and hands them
+*  back with another. A full ring drops the record (and counts it) rather
+*  than ever blocking the thread that logs.
+*/
+struct LogRing{
+    std::array<LogRecord, LOG_RING_SLOTS> slots;
+    std::atomic<uint64_t> head{0};      // next slot the writer reads
+    std::atomic<uint64_t> tail{0};      // next slot the owner writes
+    std::atomic<uint64_t> dropped{0};
+    std::atomic<bool> inUse{false};     // owned by a live thread; a free ring is reused by the next new thread
+    uint32_t id = 0;
+};
+
+/*
+*  Log calls only format into the calling thread's ring: no lock, no system
+*  call and no allocation. The writer thread wakes every LOG_FLUSH_MS (or
+*  early, when a ring is half full), merges whatever the rings hold by
+*  timestamp and writes it with one write() per pass.
+*
+*  Per-message records can be sampled: `sampled()` is true for one call in
+*  every `--log-sample N` on each thread, so a busy server logs a
+*  representative slice of its traffic instead of all of it.
+*/
+class Logger{
+public:
+    void setLevel(LogLevel level){ minLevel.store(level, std::memory_order_relaxed); }
+    void setSampleEvery(uint32_t n){ sampleEvery.store(n ? n : 1, std::memory_order_relaxed); }
+
+    bool enabled(LogLevel level) const { return level >= minLevel.load(std::memory_order_relaxed); }
+
+    /**
+     * @brief Returns true for one call in every `sampleEvery` on the calling thread.
+     */
+    bool sampled(){
+        thread_local uint32_t calls = 0;
+        return calls++ % sampleEvery.load(std::memory_order_relaxed) == 0;
+    }
+
+    /**
+     * @brief Parses "debug", "info", "warn", "error" or "off".
+     *
+     * @return int Returns 1 on success, otherwise returns -1.
+     */
+    static int parseLevel(const char *name, LogLevel &level){
+        static const char *names[] = {"debug", "info", "warn", "error", "off"};
+        for(int i = 0; i <= (int)LogLevel::OFF; i++){
+            if(strcmp(name, names[i]) == 0){
+                level = (LogLevel)i;
+                return 1;
+            }
+        }
+        return -1;
+    }
+
+    /**
+     * @brief Formats a record into the calling thread's ring; never blocks.
+     */
+    void write(LogLevel level, const char *fmt, ...) __attribute__((format(printf, 3, 4))){
+        if(!enabled(level)) return;
+        LogRing &ring = localRing();
+        uint64_t tail = ring.tail.load(std::memory_order_relaxed);
+        uint64_t used = tail - ring.head.load(std::memory_order_acquire);
+        if(used >= LOG_RING_SLOTS){
+            ring.dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+
+        LogRecord &record = ring.slots[tail & (LOG_RING_SLOTS - 1)];
+        timespec now;
+        clock_gettime(CLOCK_REALTIME, &now);
+        record.timeNs = (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+        record.thread = ring.id;
+        record.level = level;
+        va_list args;
+        va_start(args, fmt);
+        int n = vsnprintf(record.text, sizeof(record.text), fmt, args);
+        va_end(args);
+        record.length = (uint16_t)(n < 0 ? 0 : std::min<size_t>(n, sizeof(record.text) - 1));
+        ring.tail.store(tail + 1, std::memory_order_release);
+
+        // a ring filling up faster than the flush interval gets the writer out of its sleep
+        if(used + 1 == LOG_RING_SLOTS / 2) wake.notify_one();
+    }
+
+    /**
+     * @brief Writer loop: drains every ring to `fd` until the process exits.
+     *
+     * The thread lowers its own priority, so on a saturated machine the reactors win the CPU and the rings
+     * overflow (counted) instead of message handling slowing down.
+     */
+    void run(int fd){
+        setpriority(PRIO_PROCESS, (id_t)gettid(), LOG_WRITER_NICE);
+        std::vector<LogRecord> batch;
+        std::string out;
+        while(true){
+            {
+                std::unique_lock<std::mutex> lock(wakeMutex);
+                wake.wait_for(lock, std::chrono::milliseconds(LOG_FLUSH_MS));
+            }
+            drain(batch);
+            if(batch.empty()) continue;
+
+            out.clear();
+            for(const LogRecord &record : batch) format(record, out);
+            const char *p = out.data();
+            size_t left = out.size();
+            while(left > 0){
+                ssize_t n = ::write(fd, p, left);
+                if(n < 0){
+                    if(errno == EINTR) continue;
+                    break;
+                }
+                p += n;
+                left -= n;
+            }
+        }
+    }
+
+private:
+    /**
+     * @brief Copies every published record out of the rings, oldest first, plus one note per ring that dropped some.
+     */
+    void drain(std::vector<LogRecord> &batch){
+        batch.clear();
+        {
+            std::lock_guard<std::mutex> lock(ringsMutex);
+            for(auto &ring : rings){
+                uint64_t head = ring->head.load(std::memory_order_relaxed);
+                uint64_t tail = ring->tail.load(std::memory_order_acquire);
+                for(; head != tail; head++) batch.push_back(ring->slots[head & (LOG_RING_SLOTS - 1)]);
+                ring->head.store(head, std::memory_order_release);
+
+                uint64_t lost = ring->dropped.exchange(0, std::memory_order_relaxed);
+                if(lost > 0){
+                    LogRecord note{};
+                    note.timeNs = batch.empty() ? 0 : batch.back().timeNs;
+                    note.thread = ring->id;
+                    note.level = LogLevel::WARN;
+                    int n = snprintf(note.text, sizeof(note.text), "log ring full, %llu records dropped", (unsigned long long)lost);
+                    note.length = (uint16_t)std::min<size_t>(n, sizeof(note.text) - 1);
+                    batch.push_back(note);
+                }
+            }
+        }
+        std::stable_sort(batch.begin(), batch.end(), [](const LogRecord &a, const LogRecord &b){ return a.timeNs < b.timeNs; });
+    }
+
+    /**
+     * @brief Appends "YYYY-MM-DD HH:MM:SS.mmm LEVEL [tN] text\n" to `out`.
+     */
+    void format(const LogRecord &record, std::string &out){
+        static const char *labels[] = {"DEBUG", "INFO ", "WARN ", "ERROR"};
+        time_t seconds = (time_t)(record.timeNs / 1000000000);
+        if(seconds != cachedSecond){
+            tm local;
+            localtime_r(&seconds, &local);
+            strftime(cachedStamp, sizeof(cachedStamp), "%Y-%m-%d %H:%M:%S", &local);
+            cachedSecond = seconds;
+        }
+        char prefix[64];
+        int n = snprintf(prefix, sizeof(prefix), "%s.%03d %s [t%u] ", cachedStamp,
+                         (int)(record.timeNs / 1000000 % 1000), labels[(int)record.level], record.thread);
+        out.append(prefix, n);
+        out.append(record.text, record.length);
+        out.push_back('\n');
+    }
+
+    /**
+     * @brief Returns the calling thread's ring, claiming a free one (or creating one) on first use.
+     */
+    LogRing& localRing(){
+        // gives the ring back for reuse when the thread exits (threaded mode runs one thread per client)
+        struct Lease{
+            LogRing *ring = nullptr;
+            ~Lease(){ if(ring) ring->inUse.store(false, std::memory_order_release); }
+        };
+        thread_local Lease lease;
+        if(lease.ring) return *lease.ring;
+
+        std::lock_guard<std::mutex> lock(ringsMutex);
+        for(auto &ring : rings){
+            bool expected = false;
+            if(ring->inUse.compare_exchange_strong(expected, true)){
+                lease.ring = ring.get();
+                return *lease.ring;
+            }
+        }
+        rings.push_back(std::make_unique<LogRing>());
+        rings.back()->id = (uint32_t)(rings.size() - 1);
+        rings.back()->inUse.store(true, std::memory_order_relaxed);
+        lease.ring = rings.back().get();
+        return *lease.ring;
+    }
+
+    std::atomic<LogLevel> minLevel{LogLevel::INFO};
+    std::atomic<uint32_t> sampleEvery{1};
+    std::mutex ringsMutex;
+    std::vector<std::unique_ptr<LogRing>> rings;
+    std::mutex wakeMutex;
+    std::condition_variable wake;
+    time_t cachedSecond = 0;            // writer thread only
+    char cachedStamp[32] = "";
+};
+
+#endif
@@ -0,0 +1,450 @@
+// Segmented, memory-mapped append-only message log with group commit and per-recipient delivery cursors
+
+#ifndef MESSAGE_LOG_H
+#define MESSAGE_LOG_H
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <cstdio>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <algorithm>
+#include <filesystem>
+#include <unordered_map>
+#include <unordered_set>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "session_table.h"
+
+/*
+*  The log is a directory of fixed-size segment files, each preallocated and
+*  mapped MAP_SHARED, so appending a message is one memcpy under a mutex; no
+*  open/close or write() per message. A background thread calls sync() every
+*  few milliseconds, which msyncs everything appended since the last call
+*  (group commit) and saves the delivery cursors.
+*
+*  Every record carries a global sequence number. A DM whose recipient is
+*  offline is "pending" until the recipient logs in and drain() hands it over;
+*  a recipient's cursor is the highest sequence known to be delivered to them,
+*  which is all that has to survive a restart. Sealed segments that no longer
+*  hold pending records are deleted, and segments holding only a few are
+*  compacted by copying those records forward.
+*/
+#define LOG_RECORD_MAGIC 0x43484c47u    // "CHLG"
+#define LOG_SEGMENT_SIZE (16u * 1024 * 1024)
+#define LOG_COMPACT_RATIO 8             // compact a sealed segment once pending bytes are below 1/8 of it
+
+enum class LogRecordType : uint8_t{
+    DIRECT = 1,     // recipient is a username
+    GROUP = 2       // recipient is a group name; logged for durability, never pending
+};
+
+struct LogRecordHeader{
+    uint32_t magic;
+    uint32_t length;        // payload bytes
+    uint64_t seq;
+    uint8_t type;
+    uint8_t recipientLength;
+    uint16_t reserved;
+    uint32_t checksum;      // over recipient and payload, so a torn tail is recognised on recovery
+};
+
+class MessageLog{
+public:
+    ~MessageLog(){ close(); }
+
+    /**
+     * @brief Opens (or creates) the log in `dir` and recovers pending messages and cursors from it.
+     *
+     * @return int Returns 1 on success, otherwise returns -1 with the reason printed.
+     */
+    int open(const std::string &dir, size_t segmentSize = LOG_SEGMENT_SIZE){
+        std::lock_guard<std::mutex> lock(m);
+        directory = dir;
+        segmentBytes = segmentSize;
+        std::error_code ec;
+        std::filesystem::create_directories(dir, ec);
+        if(ec){
+            fprintf(stderr, "Cannot create log directory %s: %s\n", dir.c_str(), ec.message().c_str());
+            return -1;
+        }
+
+        loadCursors();
+        if(recover() < 0) return -1;
+        if(segments.empty() && openSegment(segmentBytes) < 0) return -1;
+        enabled = true;
+        return 1;
+    }
+
+    bool isOpen() const { return enabled; }
+
+    /**
+     * @brief Logs a DM and decides, atomically with logins, whether the recipient still needs it.
+     *
+     * @return int Returns 1 if the recipient is online and the caller should deliver now, 0 if the
+     *             message was stored for delivery at their next login, and -1 if it could not be logged.
+     */
+    int appendDirect(std::string_view recipient, std::string_view payload){
+        std::lock_guard<std::mutex> lock(m);
+        bool online = onlineUsers.find(recipient) != onlineUsers.end();
+        Location at;
+        if(appendLocked(LogRecordType::DIRECT, recipient, payload, nextSeq, at) < 0) return -1;
+
+        if(online){
+            advanceCursor(recipient, at.seq);
+            return 1;
+        }
+        auto it = pending.find(recipient);
+        if(it == pending.end()) it = pending.emplace(std::string(recipient), std::vector<Location>()).first;
+        it->second.push_back(at);
+        segments[at.segment].pendingBytes += at.size;
+        return 0;
+    }
+
+    /**
+     * @brief Logs a group message; group members are online by definition, so it is never pending.
+     */
+    int appendGroup(std::string_view group, std::string_view payload){
+        std::lock_guard<std::mutex> lock(m);
+        Location at;
+        return appendLocked(LogRecordType::GROUP, group, payload, nextSeq, at);
+    }
+
+    /**
+     * @brief Marks `recipient` online and hands every message stored for them to `deliver(payload)`, oldest first.
+     *
+     * @return size_t The number of messages delivered.
+     *
+     * Called right after the session is registered, so a DM sent concurrently is either drained here or
+     * sees the user as online and is delivered directly; it is never stranded.
+     */
+    template<class F>
+    size_t drain(std::string_view recipient, F deliver){
+        std::lock_guard<std::mutex> lock(m);
+        if(!enabled) return 0;
+        onlineUsers.emplace(recipient);
+
+        auto it = pending.find(recipient);
+        if(it == pending.end()) return 0;
+
+        std::vector<Location> locations;
+        locations.swap(it->second);
+        pending.erase(it);
+        std::sort(locations.begin(), locations.end(), [](const Location &a, const Location &b){ return a.seq < b.seq; });
+
+        for(auto &at : locations){
+            Segment &segment = segments[at.segment];
+            const LogRecordHeader *h = (const LogRecordHeader*)(segment.base + at.offset);
+            deliver(std::string_view(segment.base + at.offset + sizeof(LogRecordHeader) + h->recipientLength, h->length));
+            segment.pendingBytes -= at.size;
+            advanceCursor(recipient, at.seq);
+        }
+        return locations.size();
+    }
+
+    /**
+     * @brief Marks `recipient` offline, so DMs to them are stored from now on.
+     */
+    void setOffline(std::string_view recipient){
+        std::lock_guard<std::mutex> lock(m);
+        auto it = onlineUsers.find(recipient);
+        if(it != onlineUsers.end()) onlineUsers.erase(it);
+    }
+
+    /**
+     * @brief Group commit: flushes everything appended since the last call, saves the cursors and compacts.
+     *
+     * The msync runs outside the mutex, so appends continue while the disk catches up.
+     */
+    void sync(){
+        std::vector<std::pair<char*, size_t>> ranges;
+        std::string cursorText;
+        {
+            std::lock_guard<std::mutex> lock(m);
+            if(!enabled) return;
+            for(auto &entry : segments){
+                Segment &segment = entry.second;
+                if(segment.synced == segment.used) continue;
+                size_t from = segment.synced & ~(size_t)(sysconf(_SC_PAGESIZE) - 1);
+                ranges.emplace_back(segment.base + from, segment.used - from);
+                segment.synced = segment.used;
+            }
+            if(cursorsDirty){
+                cursorText = renderCursors();
+                cursorsDirty = false;
+            }
+        }
+
+        for(auto &range : ranges){
+            if(msync(range.first, range.second, MS_SYNC) < 0) perror("msync failed");
+        }
+        if(!cursorText.empty()) saveCursors(cursorText);
+
+        std::lock_guard<std::mutex> lock(m);
+        compact();
+    }
+
+    void close(){
+        std::lock_guard<std::mutex> lock(m);
+        for(auto &entry : segments){
+            msync(entry.second.base, entry.second.used, MS_SYNC);
+            munmap(entry.second.base, entry.second.capacity);
+        }
+        segments.clear();
+        if(cursorsDirty) saveCursors(renderCursors());
+        enabled = false;
+    }
+
+    size_t pendingCount(){
+        std::lock_guard<std::mutex> lock(m);
+        size_t n = 0;
+        for(auto &entry : pending) n += entry.second.size();
+        return n;
+    }
+
+private:
+    struct Segment{
+        char *base = nullptr;
+        size_t capacity = 0;
+        size_t used = 0;            // bytes of valid records
+        size_t synced = 0;          // bytes known to be on disk
+        size_t pendingBytes = 0;    // bytes of records still waiting for their recipient
+        std::string path;
+    };
+    struct Location{
+        uint64_t segment = 0;       // id of the segment holding the record
+        size_t offset = 0;
+        size_t size = 0;            // whole record, header included
+        uint64_t seq = 0;
+    };
+
+    static uint32_t checksum(std::string_view a, std::string_view b){
+        uint32_t h = 2166136261u;
+        for(char c : a){ h ^= (unsigned char)c; h *= 16777619u; }
+        for(char c : b){ h ^= (unsigned char)c; h *= 16777619u; }
+        return h;
+    }
+    static size_t recordSize(size_t recipient, size_t payload){
+        return (sizeof(LogRecordHeader) + recipient + payload + 7) & ~(size_t)7;
+    }
+
+    std::string segmentPath(uint64_t id) const {
+        char name[32];
+        snprintf(name, sizeof(name), "%020llu.log", (unsigned long long)id);
+        return directory + "/" + name;
+    }
+
+    int mapSegment(uint64_t id, const std::string &path, size_t capacity, bool create){
+        int fd = ::open(path.c_str(), O_RDWR | (create ? O_CREAT | O_EXCL : 0), 0644);
+        if(fd < 0){
+            perror("Cannot open log segment");
+            return -1;
+        }
+        if(create && posix_fallocate(fd, 0, capacity) != 0){
+            fprintf(stderr, "Cannot allocate log segment %s\n", path.c_str());
+            ::close(fd);
+            unlink(path.c_str());
+            return -1;
+        }
+        void *base = mmap(nullptr, capacity, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        ::close(fd);
+        if(base == MAP_FAILED){
+            perror("Cannot map log segment");
+            return -1;
+        }
+        Segment &segment = segments[id];
+        segment.base = (char*)base;
+        segment.capacity = capacity;
+        segment.path = path;
+        active = id;
+        return 1;
+    }
+
+    int openSegment(size_t capacity){
+        uint64_t id = nextSegment++;
+        return mapSegment(id, segmentPath(id), capacity, true);
+    }
+
+    /**
+     * @brief Copies one record into the active segment, rolling to a fresh segment when it does not fit.
+     *
+     * @param seq The record's sequence number: `nextSeq` for new messages, the original one when compaction moves a record.
+     */
+    int appendLocked(LogRecordType type, std::string_view recipient, std::string_view payload, uint64_t seq, Location &at){
+        if(!enabled || recipient.size() > UINT8_MAX) return -1;
+        size_t size = recordSize(recipient.size(), payload.size());
+
+        if(segments.empty() || segments[active].used + size > segments[active].capacity){
+            if(openSegment(std::max(segmentBytes, size)) < 0) return -1;
+        }
+        Segment &segment = segments[active];
+
+        char *out = segment.base + segment.used;
+        memcpy(out + sizeof(LogRecordHeader), recipient.data(), recipient.size());
+        memcpy(out + sizeof(LogRecordHeader) + recipient.size(), payload.data(), payload.size());
+        LogRecordHeader h{LOG_RECORD_MAGIC, (uint32_t)payload.size(), seq, (uint8_t)type,
+                          (uint8_t)recipient.size(), 0, checksum(recipient, payload)};
+        memcpy(out, &h, sizeof(h));
+
+        at = Location{active, segment.used, size, seq};
+        segment.used += size;
+        nextSeq = std::max(nextSeq, seq + 1);
+        return 1;
+    }
+
+    void advanceCursor(std::string_view recipient, uint64_t seq){
+        auto it = cursors.find(recipient);
+        if(it == cursors.end()) it = cursors.emplace(std::string(recipient), 0).first;
+        if(seq > it->second){
+            it->second = seq;
+            cursorsDirty = true;
+        }
+    }
+
+    /**
+     * @brief Rebuilds the segment list, the next sequence number and the pending index from disk.
+     */
+    int recover(){
+        std::vector<std::pair<uint64_t, std::string>> files;
+        for(auto &entry : std::filesystem::directory_iterator(directory)){
+            std::string name = entry.path().filename().string();
+            if(name.size() != 24 || name.compare(20, 4, ".log") != 0) continue;
+            files.emplace_back(strtoull(name.c_str(), nullptr, 10), entry.path().string());
+        }
+        std::sort(files.begin(), files.end());
+        if(!files.empty()) nextSegment = files.back().first + 1;
+
+        std::unordered_map<std::string, std::map<uint64_t, Location>, StringHash, std::equal_to<>> found;
+        for(auto &file : files){
+            size_t capacity = std::filesystem::file_size(file.second);
+            if(capacity < sizeof(LogRecordHeader) || mapSegment(file.first, file.second, capacity, false) < 0) continue;
+            Segment &segment = segments[file.first];
+
+            while(segment.used + sizeof(LogRecordHeader) <= capacity){
+                LogRecordHeader h;
+                memcpy(&h, segment.base + segment.used, sizeof(h));
+                size_t size = recordSize(h.recipientLength, h.length);
+                if(h.magic != LOG_RECORD_MAGIC || segment.used + size > capacity) break;
+                const char *recipient = segment.base + segment.used + sizeof(h);
+                std::string_view name(recipient, h.recipientLength), payload(recipient + h.recipientLength, h.length);
+                if(checksum(name, payload) != h.checksum) break;
+
+                auto cursor = cursors.find(name);
+                if(h.type == (uint8_t)LogRecordType::DIRECT && (cursor == cursors.end() || h.seq > cursor->second)){
+                    // a record copied forward by compaction may appear twice; either copy will do
+                    found[std::string(name)][h.seq] = Location{file.first, segment.used, size, h.seq};
+                }
+                nextSeq = std::max(nextSeq, h.seq + 1);
+                segment.used += size;
+            }
+            segment.synced = segment.used;
+        }
+
+        for(auto &user : found){
+            auto &list = pending[user.first];
+            for(auto &record : user.second){
+                list.push_back(record.second);
+                segments[record.second.segment].pendingBytes += record.second.size;
+            }
+        }
+        return 1;
+    }
+
+    /**
+     * @brief Deletes sealed segments nobody is waiting on, and copies the last few pending records out of mostly-delivered ones.
+     *
+     * A segment whose records were copied forward is only deleted on the next pass, after the copies have been synced.
+     */
+    void compact(){
+        for(auto it = segments.begin(); it != segments.end();){
+            uint64_t id = it->first;
+            Segment &segment = it->second;
+            if(id == active || segment.synced != segment.used || segment.pendingBytes * LOG_COMPACT_RATIO > segment.capacity){
+                ++it;
+                continue;
+            }
+            if(segment.pendingBytes > 0){
+                moveForward(id);
+                ++it;
+                continue;
+            }
+            munmap(segment.base, segment.capacity);
+            unlink(segment.path.c_str());
+            it = segments.erase(it);
+        }
+    }
+
+    int moveForward(uint64_t id){
+        for(auto &user : pending){
+            for(auto &at : user.second){
+                if(at.segment != id) continue;
+                Segment &from = segments[id];
+                const LogRecordHeader *h = (const LogRecordHeader*)(from.base + at.offset);
+                std::string_view payload(from.base + at.offset + sizeof(LogRecordHeader) + h->recipientLength, h->length);
+
+                // keep the original sequence number so delivery order and cursors are unaffected
+                Location moved;
+                if(appendLocked(LogRecordType::DIRECT, user.first, payload, at.seq, moved) < 0) return -1;
+
+                from.pendingBytes -= at.size;
+                segments[moved.segment].pendingBytes += moved.size;
+                at = moved;
+            }
+        }
+        return 1;
+    }
+
+    void loadCursors(){
+        std::ifstream f(directory + "/cursors");
+        std::string user;
+        uint64_t seq;
+        while(f >> user >> seq) cursors[user] = seq;
+    }
+
+    std::string renderCursors(){
+        std::string text;
+        for(auto &cursor : cursors){
+            // never claim delivery past a message the recipient still has waiting
+            uint64_t seq = cursor.second;
+            auto it = pending.find(cursor.first);
+            if(it != pending.end()){
+                for(auto &at : it->second) seq = std::min(seq, at.seq - 1);
+            }
+            text += cursor.first + " " + std::to_string(seq) + "\n";
+        }
+        return text.empty() ? "\n" : text;
+    }
+
+    void saveCursors(const std::string &text){
+        std::string path = directory + "/cursors", tmp = path + ".tmp";
+        int fd = ::open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if(fd < 0){
+            perror("Cannot save log cursors");
+            return;
+        }
+        bool ok = ::write(fd, text.data(), text.size()) == (ssize_t)text.size() && fdatasync(fd) == 0;
+        ::close(fd);
+        if(!ok || rename(tmp.c_str(), path.c_str()) < 0) perror("Cannot save log cursors");
+    }
+
+    std::mutex m;
+    bool enabled = false;
+    std::string directory;
+    size_t segmentBytes = LOG_SEGMENT_SIZE;
+    std::map<uint64_t, Segment> segments;     // id -> mapped segment, oldest first
+    uint64_t active = 0;
+    uint64_t nextSegment = 0;
+    uint64_t nextSeq = 1;
+    std::unordered_map<std::string, std::vector<Location>, StringHash, std::equal_to<>> pending;
+    std::unordered_map<std::string, uint64_t, StringHash, std::equal_to<>> cursors;
+    std::unordered_set<std::string, StringHash, std::equal_to<>> onlineUsers;
+    bool cursorsDirty = false;
+};
+
+#endif
@@ -0,0 +1,110 @@
+// Lock-free counters and log-linear latency/size histograms for the server's /stats surface
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <atomic>
+#include <string>
+#include <cstdint>
+#include <chrono>
+
+/*
+*  HDR-style histogram: values below 16 get a bucket each, and every power of
+*  two above that is split into 16 linear sub-buckets, so any recorded value
+*  is reported within 1/16 (6.25%) of its true size. Buckets are plain atomics,
+*  so recording is wait-free and any thread may read a (slightly racy)
+*  snapshot at any time.
+*/
+#define HISTOGRAM_SUB_BITS 4
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BITS)
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+
+class Histogram{
+public:
+    void record(uint64_t value){
+        counts[bucketOf(value)].fetch_add(1, std::memory_order_relaxed);
+        total.fetch_add(1, std::memory_order_relaxed);
+        uint64_t seen = maximum.load(std::memory_order_relaxed);
+        while(value > seen && !maximum.compare_exchange_weak(seen, value, std::memory_order_relaxed));
+    }
+
+    uint64_t count() const { return total.load(std::memory_order_relaxed); }
+    uint64_t max() const { return maximum.load(std::memory_order_relaxed); }
+
+    /**
+     * @brief Returns the highest value that falls in the same bucket as the `p`-th quantile (0 < p <= 1).
+     */
+    uint64_t percentile(double p) const {
+        uint64_t n = count();
+        if(n == 0) return 0;
+        uint64_t rank = (uint64_t)(p * n);
+        if(rank >= n) rank = n - 1;
+
+        uint64_t seen = 0;
+        for(size_t b = 0; b < HISTOGRAM_BUCKETS; b++){
+            seen += counts[b].load(std::memory_order_relaxed);
+            if(seen > rank){
+                uint64_t high = bucketHigh(b);
+                return high < max() ? high : max();
+            }
+        }
+        return max();
+    }
+
+private:
+    static size_t bucketOf(uint64_t v){
+        if(v < HISTOGRAM_SUB_BUCKETS) return (size_t)v;
+        int exp = 63 - __builtin_clzll(v);
+        size_t sub = (size_t)(v >> (exp - HISTOGRAM_SUB_BITS)) & (HISTOGRAM_SUB_BUCKETS - 1);
+        return (size_t)(exp - HISTOGRAM_SUB_BITS + 1) * HISTOGRAM_SUB_BUCKETS + sub;
+    }
+    static uint64_t bucketHigh(size_t b){
+        if(b < HISTOGRAM_SUB_BUCKETS) return b;
+        int exp = (int)(b / HISTOGRAM_SUB_BUCKETS) + HISTOGRAM_SUB_BITS - 1;
+        uint64_t low = (uint64_t)(HISTOGRAM_SUB_BUCKETS + b % HISTOGRAM_SUB_BUCKETS) << (exp - HISTOGRAM_SUB_BITS);
+        return low + ((uint64_t)1 << (exp - HISTOGRAM_SUB_BITS)) - 1;
+    }
+
+    std::atomic<uint64_t> counts[HISTOGRAM_BUCKETS] = {};
+    std::atomic<uint64_t> total{0};
+    std::atomic<uint64_t> maximum{0};
+};
+
+// One command's counters: how often it ran, how often it failed, how long the handler took and how many queues it fed
+struct CommandMetrics{
+    std::atomic<uint64_t> requests{0};
+    std::atomic<uint64_t> errors{0};
+    Histogram latencyNs;
+    Histogram fanout;
+};
+
+// Server-wide counters; every field is updated with relaxed atomics from whichever thread does the work
+struct ServerMetrics{
+    std::atomic<int64_t> connections{0};        // open sockets, authenticated or not
+    std::atomic<uint64_t> accepted{0};
+    std::atomic<uint64_t> refused{0};           // turned away by --max-conns or --max-conns-per-ip
+    std::atomic<uint64_t> framesIn{0};
+    std::atomic<uint64_t> bytesIn{0};
+    std::atomic<uint64_t> framesOut{0};
+    std::atomic<uint64_t> bytesOut{0};
+    std::atomic<uint64_t> sendCalls{0};         // sendmsg calls and io_uring sends writing out queued frames
+    std::atomic<uint64_t> framesDropped{0};     // discarded by the DROP_OLDEST policy
+    std::atomic<uint64_t> framesOversize{0};    // left out because they exceed the recipient's frame limit
+    std::atomic<uint64_t> slowConsumers{0};     // connections evicted by the DISCONNECT policy
+    std::atomic<uint64_t> invalidCommands{0};
+    std::atomic<uint64_t> authFailures{0};
+    std::atomic<uint64_t> rateLimited{0};       // commands rejected by a --rate-limit bucket
+    std::atomic<uint64_t> authTimeouts{0};      // connections that did not log in within --auth-timeout
+    std::atomic<uint64_t> heartbeatTimeouts{0}; // connections that did not answer a ping
+    std::atomic<uint64_t> idleTimeouts{0};      // sessions logged out by --idle-timeout
+    std::atomic<uint64_t> filesUploaded{0};     // uploads completed into the spool
+    std::atomic<uint64_t> fileBytesIn{0};       // file bytes stored from /file_chunk frames
+    std::atomic<uint64_t> fileBytesOut{0};      // file bytes relayed in /file_data frames
+    std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+};
+
+inline void bump(std::atomic<uint64_t> &counter, uint64_t by = 1){
+    counter.fetch_add(by, std::memory_order_relaxed);
+}
+
+#endif
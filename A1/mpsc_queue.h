@@ -0,0 +1,67 @@
+// Lock-free multi-producer single-consumer queue used to hand work to a reactor thread
+
+#ifndef MPSC_QUEUE_H
+#define MPSC_QUEUE_H
+
+#include <atomic>
+#include <utility>
+#include "buffer_pool.h"
+
+/*
+*  Intrusive linked queue in the style of Dmitry Vyukov's MPSC queue. Any
+*  thread may push: a push is one atomic exchange on `head` plus one store,
+*  and it never waits on other producers or on the consumer. Only the owning
+*  thread may pop. A pop can briefly see the queue as empty while a push is
+*  half done; producers wake the consumer after pushing, so the item is picked
+*  up on the consumer's next pass. Nodes come from the BufferPool, so a push
+*  and its pop are two free-list operations rather than a malloc/free pair.
+*/
+template<class T>
+class MpscQueue{
+public:
+    MpscQueue(){
+        Node *stub = new Node();
+        head.store(stub, std::memory_order_relaxed);
+        tail = stub;
+    }
+    ~MpscQueue(){
+        T value;
+        while(pop(value));
+        delete tail;
+    }
+    MpscQueue(const MpscQueue&) = delete;
+    MpscQueue& operator=(const MpscQueue&) = delete;
+
+    void push(T value){
+        Node *node = new Node(std::move(value));
+        Node *prev = head.exchange(node, std::memory_order_acq_rel);
+        prev->next.store(node, std::memory_order_release);
+    }
+
+    /**
+     * @brief Takes the oldest item; consumer thread only.
+     *
+     * @return bool Returns false if the queue is (momentarily) empty.
+     */
+    bool pop(T &out){
+        Node *next = tail->next.load(std::memory_order_acquire);
+        if(!next) return false;
+        out = std::move(next->value);
+        delete tail;
+        tail = next;
+        return true;
+    }
+
+private:
+    struct Node : Pooled{
+        std::atomic<Node*> next{nullptr};
+        T value{};
+        Node() = default;
+        explicit Node(T v) : value(std::move(v)) {}
+    };
+
+    alignas(64) std::atomic<Node*> head;    // producers' end
+    alignas(64) Node *tail;                 // consumer's end; the node here has already been consumed
+};
+
+#endif
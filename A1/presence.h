@@ -0,0 +1,208 @@
+// Presence: who is online, served to /who from a cached listing, plus the batched join/leave updates pushed to watchers
+
+#ifndef PRESENCE_H
+#define PRESENCE_H
+
+#include <map>
+#include <set>
+#include <mutex>
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <unordered_map>
+#include "protocol.h"
+#include "buffer_pool.h"
+
+struct Outbox;  // a connection's outbound queue, defined by the server
+
+#define LISTING_FRAME_BYTES 4096    // a listing longer than this is split over several frames
+
+using Listing = std::shared_ptr<const std::vector<SharedFrame>>;
+
+/**
+ * @brief Lays `names` out as "<title>a, b, c" frames, starting a new frame (with the title again) once one is full.
+ *
+ * @param separator What goes between two names.
+ * @return Listing The encoded frames; a listing without names is a single frame holding just the title.
+ */
+template<class Names>
+Listing buildListing(std::string_view title, const Names &names, std::string_view separator = ", "){
+    auto frames = std::make_shared<std::vector<SharedFrame>>();
+    std::string payload(title);
+    auto emit = [&]{
+        char *out;
+        SharedFrame frame = SharedFrame::allocate(FRAME_HEADER_SIZE + payload.size(), out);
+        encodeFrameHeader((uint32_t)payload.size(), out);
+        memcpy(out + FRAME_HEADER_SIZE, payload.data(), payload.size());
+        frames->push_back(std::move(frame));
+    };
+    bool first = true;
+    for(const auto &name : names){
+        std::string_view n(name);
+        if(!first && payload.size() + separator.size() + n.size() > LISTING_FRAME_BYTES){
+            emit();
+            payload.assign(title);
+            first = true;
+        }
+        if(!first) payload.append(separator);
+        payload.append(n);
+        first = false;
+    }
+    emit();
+    return frames;
+}
+
+/*
+*  The set of users with a live session. /who is answered from a listing
+*  that is rebuilt only when the set has changed since it was last built, so
+*  repeated /who between logins and logouts cost one reference count bump
+*  each instead of a walk over every user.
+*
+*  Changes are also collected for watchers, each tagged with the version it
+*  produced. A watcher remembers the version of the listing it started from
+*  and is only ever sent changes made after that, so the listing and the
+*  updates never overlap. takeUpdate() nets each batch (a user who came and
+*  went cancels out) into one "Presence: +a -b" listing that all watchers
+*  older than the batch share; only a watcher that joined mid-batch gets a
+*  listing of its own.
+*/
+class PresenceBoard{
+public:
+    /**
+     * @brief Marks `username` online; a second session of an online user changes nothing.
+     */
+    void online(std::string_view username){ change(username, true); }
+
+    /**
+     * @brief Marks `username` offline.
+     */
+    void offline(std::string_view username){ change(username, false); }
+
+    /**
+     * @brief Returns the /who listing for the current set, building it only if the set changed since the last call.
+     */
+    Listing snapshot(){
+        std::lock_guard<std::mutex> lock(m);
+        return snapshotLocked();
+    }
+
+    /**
+     * @brief Makes an outbound queue a watcher (again) from the current version on and calls `send(listing)` with the
+     *        /who listing of that version.
+     *
+     * `send` runs under the board's lock, so whatever it queues is ahead of the first update the watcher gets.
+     */
+    template<class Send>
+    void watch(const std::shared_ptr<Outbox> &box, Send send){
+        std::lock_guard<std::mutex> lock(m);
+        watchers[box.get()] = Watcher{box, version};
+        send(snapshotLocked());
+    }
+
+    /**
+     * @brief Removes an outbound queue from the watchers.
+     *
+     * @return bool Returns false if it was not watching.
+     */
+    bool unwatch(const Outbox *box){
+        std::lock_guard<std::mutex> lock(m);
+        return watchers.erase(box) > 0;
+    }
+
+    /**
+     * @brief Takes the batch of changes collected since the last call.
+     *
+     * @param updates Set to each watcher with the "Presence: +a -b" listing it should be sent; watchers that saw
+     *                none of the changes are left out.
+     * @return bool Returns false if there is nothing to send; the batch is dropped either way.
+     */
+    bool takeUpdate(std::vector<std::pair<std::shared_ptr<Outbox>, Listing>> &updates){
+        updates.clear();
+        std::lock_guard<std::mutex> lock(m);
+        if(!watchers.empty() && !batch.empty()){
+            std::map<uint64_t, Listing> bySince;    // watchers that started from the same version share a listing
+            for(auto &entry : watchers){
+                const Watcher &watcher = entry.second;
+                // every watcher older than the batch sees all of it, from the same listing
+                uint64_t since = std::max(watcher.since, batch.front().version - 1);
+                auto it = bySince.find(since);
+                if(it == bySince.end()) it = bySince.emplace(since, changesAfter(since)).first;
+                if(it->second) updates.emplace_back(watcher.box, it->second);
+            }
+        }
+        batch.clear();
+        return !updates.empty();
+    }
+
+    size_t size(){
+        std::lock_guard<std::mutex> lock(m);
+        return users.size();
+    }
+
+private:
+    struct Change{
+        uint64_t version;       // the board's version right after this change
+        std::string username;
+        bool online;
+    };
+
+    struct Watcher{
+        std::shared_ptr<Outbox> box;
+        uint64_t since;         // the version of the listing it was sent when it started watching
+    };
+
+    void change(std::string_view username, bool isOnline){
+        std::lock_guard<std::mutex> lock(m);
+        bool changed = isOnline ? users.emplace(username).second : users.erase(std::string(username)) > 0;
+        if(!changed) return;
+        version++;
+        batch.push_back(Change{version, std::string(username), isOnline});
+    }
+
+    // the caller holds `m`
+    Listing snapshotLocked(){
+        if(!cached || cachedVersion != version){
+            cached = buildListing("Online (" + std::to_string(users.size()) + "): ", users);
+            cachedVersion = version;
+        }
+        return cached;
+    }
+
+    /**
+     * @brief Nets the batch's changes made after version `since` into a listing; the caller holds `m`.
+     *
+     * @return Listing The listing, or nullptr if those changes cancel out (or there are none).
+     */
+    Listing changesAfter(uint64_t since){
+        struct Net{
+            bool before;        // online before the first of these changes
+            bool after;
+        };
+        std::map<std::string_view, Net> net;
+        for(const Change &c : batch){
+            if(c.version <= since) continue;
+            auto it = net.find(c.username);
+            if(it == net.end()) net.emplace(c.username, Net{!c.online, c.online});
+            else it->second.after = c.online;
+        }
+        std::vector<std::string> changes;
+        for(auto &[name, state] : net)
+            if(state.before != state.after) changes.push_back((state.after ? "+" : "-") + std::string(name));
+        if(changes.empty()) return nullptr;
+        return buildListing("Presence: ", changes, " ");
+    }
+
+    std::mutex m;
+    std::set<std::string, std::less<>> users;   // sorted, so the listing is too
+    uint64_t version = 0;                       // bumped by every change to `users`
+    Listing cached;
+    uint64_t cachedVersion = 0;
+    std::vector<Change> batch;                  // changes since the last takeUpdate(), oldest first
+    std::unordered_map<const Outbox*, Watcher> watchers;
+};
+
+#endif
@@ -0,0 +1,297 @@
+// Wire protocol shared by server_grp and client_grp: length-prefixed frames and the HELLO handshake
+
+#ifndef PROTOCOL_H
+#define PROTOCOL_H
+
+#include <string>
+#include <string_view>
+#include <cstdint>
+#include <cstring>
+#include <cerrno>
+#include <cstdio>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include "buffer_pool.h"
+
+/*
+*  Every message on the wire is a frame: a 4 byte big-endian payload length
+*  followed by the payload itself. The first frame in each direction is
+*  "HELLO <version> <max frame>", and both peers then use the smaller of the
+*  two advertised maxima for the rest of the connection.
+*/
+#define FRAME_HEADER_SIZE 4
+#define PROTOCOL_VERSION 1
+#define DEFAULT_MAX_FRAME (64 * 1024)
+#define MAX_FRAME_LIMIT (16 * 1024 * 1024)
+#define MIN_FRAME_LIMIT 1024      // the smallest limit either side may set or advertise; the server's own control frames (welcome, resume token, ...) must fit
+#define READ_CHUNK_SIZE (16 * 1024)
+#define SEND_TIMEOUT_MS 5000
+
+/**
+ * @brief Writes the 4 byte big-endian length header for a payload of `len` bytes into `out`.
+ */
+inline void encodeFrameHeader(uint32_t len, char *out){
+    out[0] = (char)((len >> 24) & 0xff);
+    out[1] = (char)((len >> 16) & 0xff);
+    out[2] = (char)((len >> 8) & 0xff);
+    out[3] = (char)(len & 0xff);
+}
+
+/**
+ * @brief Reads a 4 byte big-endian length header.
+ */
+inline uint32_t decodeFrameHeader(const char *in){
+    const unsigned char *p = (const unsigned char*)in;
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+/**
+ * @brief Appends one complete frame (header and payload) to `out`.
+ */
+inline void appendFrame(std::string &out, std::string_view payload){
+    char header[FRAME_HEADER_SIZE];
+    encodeFrameHeader((uint32_t)payload.size(), header);
+    out.append(header, FRAME_HEADER_SIZE);
+    out.append(payload.data(), payload.size());
+}
+
+/**
+ * @brief Returns `payload` wrapped in a frame.
+ */
+inline std::string encodeFrame(std::string_view payload){
+    std::string out;
+    out.reserve(FRAME_HEADER_SIZE + payload.size());
+    appendFrame(out, payload);
+    return out;
+}
+
+/**
+ * @brief Waits until `fd` is writable or `timeoutMs` passes.
+ *
+ * @return int Returns 1 if the socket is writable, otherwise returns -1.
+ */
+inline int waitWritable(int fd, int timeoutMs){
+    pollfd pfd{fd, POLLOUT, 0};
+    while(true){
+        int r = poll(&pfd, 1, timeoutMs);
+        if(r > 0) return 1;
+        if(r < 0 && errno == EINTR) continue;
+        return -1;
+    }
+}
+
+/**
+ * @brief Writes every byte of the iovec array, retrying short writes.
+ *
+ * @param fd The socket to write to.
+ * @param iov The buffers to write; entries are advanced in place as bytes go out.
+ * @param iovcnt The number of entries in `iov`.
+ * @return int Returns 1 once everything has been written, otherwise returns -1.
+ *
+ * Works on blocking and non-blocking sockets alike: on EAGAIN it waits up to SEND_TIMEOUT_MS
+ * for the socket to drain before giving up.
+ */
+inline int writeAllv(int fd, iovec *iov, int iovcnt){
+    while(iovcnt > 0){
+        msghdr msg{};
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovcnt;
+        ssize_t n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if(n < 0){
+            if(errno == EINTR) continue;
+            if(errno == EAGAIN || errno == EWOULDBLOCK){
+                if(waitWritable(fd, SEND_TIMEOUT_MS) < 0) return -1;
+                continue;
+            }
+            return -1;
+        }
+        while(iovcnt > 0 && (size_t)n >= iov->iov_len){
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if(iovcnt > 0){
+            iov->iov_base = (char*)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return 1;
+}
+
+/**
+ * @brief Sends `payload` as one frame, looping until the whole frame is written.
+ *
+ * @return int Returns 1 on success, otherwise returns -1.
+ */
+inline int sendFrame(int fd, std::string_view payload){
+    char header[FRAME_HEADER_SIZE];
+    encodeFrameHeader((uint32_t)payload.size(), header);
+    iovec iov[2] = {{header, FRAME_HEADER_SIZE}, {(void*)payload.data(), payload.size()}};
+    return writeAllv(fd, iov, payload.empty() ? 1 : 2);
+}
+
+/**
+ * @brief Builds the HELLO payload advertising this side's maximum frame size.
+ */
+inline std::string helloPayload(uint32_t maxFrame){
+    return "HELLO " + std::to_string(PROTOCOL_VERSION) + " " + std::to_string(maxFrame);
+}
+
+/**
+ * @brief Parses a peer's HELLO payload.
+ *
+ * @param payload The received payload.
+ * @param maxFrame Set to the peer's advertised maximum frame size.
+ * @return int Returns 1 if the payload is a HELLO for our protocol version advertising at least MIN_FRAME_LIMIT,
+ *             otherwise returns -1.
+ */
+inline int parseHello(std::string_view payload, uint32_t &maxFrame){
+    unsigned version = 0, advertised = 0;
+    std::string s(payload);
+    if(sscanf(s.c_str(), "HELLO %u %u", &version, &advertised) != 2) return -1;
+    if(version != PROTOCOL_VERSION || advertised < MIN_FRAME_LIMIT) return -1;
+    maxFrame = advertised > MAX_FRAME_LIMIT ? MAX_FRAME_LIMIT : advertised;
+    return 1;
+}
+
+/*
+*  Per-connection reassembly buffer. Bytes are appended as they arrive from
+*  the socket, and complete frames are sliced off the front; a partial frame
+*  simply stays buffered until the rest of it shows up. The buffer is a block
+*  from the BufferPool that is handed back as soon as it holds no bytes, so
+*  an idle connection keeps no read buffer at all and a busy one recycles the
+*  same few blocks through its thread's cache.
+*/
+class FrameReader{
+public:
+    explicit FrameReader(uint32_t maxFrame = DEFAULT_MAX_FRAME) : maxFrame(maxFrame) {}
+    FrameReader(FrameReader &&o) noexcept { take(o); }
+    FrameReader& operator=(FrameReader &&o) noexcept {
+        if(this != &o){
+            drop();
+            take(o);
+        }
+        return *this;
+    }
+    FrameReader(const FrameReader&) = delete;
+    FrameReader& operator=(const FrameReader&) = delete;
+    ~FrameReader(){ drop(); }
+
+    void setMaxFrame(uint32_t max){ maxFrame = max; }
+    uint32_t getMaxFrame() const { return maxFrame; }
+
+    /**
+     * @brief Performs one `recv()` into the reassembly buffer.
+     *
+     * @return ssize_t The number of bytes read, 0 on orderly shutdown, or -1 with errno set.
+     */
+    ssize_t readFrom(int fd){
+        reserve(READ_CHUNK_SIZE);
+        ssize_t n = recv(fd, buf + end, capacity - end, 0);
+        if(n > 0) end += n;
+        else dropIfEmpty();
+        return n;
+    }
+
+    /**
+     * @brief Appends bytes that were received elsewhere (e.g. by io_uring into a provided buffer).
+     */
+    void append(const char *data, size_t len){
+        if(len == 0) return;
+        reserve(len);
+        memcpy(buf + end, data, len);
+        end += len;
+    }
+
+    /**
+     * @brief Slices the next complete frame off the buffer.
+     *
+     * @param out Set to the frame's payload.
+     * @return int Returns 1 if a frame was extracted, 0 if more bytes are needed,
+     *             and -1 if the peer announced a frame larger than the negotiated maximum.
+     */
+    int next(std::string &out){
+        size_t avail = end - start;
+        if(avail < FRAME_HEADER_SIZE){
+            dropIfEmpty();
+            return 0;
+        }
+        uint32_t len = decodeFrameHeader(buf + start);
+        if(len > maxFrame) return -1;
+        if(avail < FRAME_HEADER_SIZE + (size_t)len) return 0;
+        out.assign(buf + start + FRAME_HEADER_SIZE, len);
+        start += FRAME_HEADER_SIZE + len;
+        dropIfEmpty();
+        return 1;
+    }
+
+private:
+    // makes room for `room` more bytes: slides a partial frame to the front, or moves it to a larger block
+    void reserve(size_t room){
+        if(capacity - end >= room) return;
+        size_t used = end - start;
+        if(buf && capacity - used >= room){
+            memmove(buf, buf + start, used);
+        }
+        else{
+            size_t grown;
+            char *bigger = static_cast<char*>(BufferPool::acquire(used + room, grown));
+            if(used) memcpy(bigger, buf + start, used);
+            drop();
+            buf = bigger;
+            capacity = grown;
+        }
+        start = 0;
+        end = used;
+    }
+
+    void dropIfEmpty(){
+        if(buf && start == end) drop();
+    }
+
+    void drop(){
+        if(buf) BufferPool::release(buf, capacity);
+        buf = nullptr;
+        capacity = start = end = 0;
+    }
+
+    void take(FrameReader &o){
+        buf = o.buf;
+        capacity = o.capacity;
+        start = o.start;
+        end = o.end;
+        maxFrame = o.maxFrame;
+        o.buf = nullptr;
+        o.capacity = o.start = o.end = 0;
+    }
+
+    char *buf = nullptr;
+    size_t capacity = 0;
+    size_t start = 0;       // the first byte not yet sliced off
+    size_t end = 0;         // one past the last byte received
+    uint32_t maxFrame = DEFAULT_MAX_FRAME;
+};
+
+/**
+ * @brief Blocks until one complete frame has been received.
+ *
+ * @return int Returns 1 with the payload in `out`, 0 if the peer closed the connection,
+ *             and -1 on a socket error or an oversized frame (errno EMSGSIZE).
+ */
+inline int recvFrame(int fd, FrameReader &reader, std::string &out){
+    while(true){
+        int r = reader.next(out);
+        if(r < 0) errno = EMSGSIZE;
+        if(r != 0) return r;
+        ssize_t n = reader.readFrom(fd);
+        if(n == 0) return 0;
+        if(n < 0){
+            if(errno == EINTR) continue;
+            return -1;
+        }
+    }
+}
+
+#endif
@@ -0,0 +1,333 @@
+// Replays a traffic capture (server_grp --capture) against one or two servers and compares how they kept up
+
+#include <iostream>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <cstdlib>
+#include "chat_client.h"
+#include "trace_file.h"
+
+/*
+*  Every user in the trace gets a ChatSession of its own on one ChatClient
+*  loop, opened at that user's first frame and closed where the trace says
+*  their connection closed, once everything before that has been written.
+*  A user's last close is left to the end of the run, so late deliveries to
+*  them still count. Frames go out at their captured time divided by
+*  --speed; with --speed max they go out as fast as the sessions log in and
+*  their buffers drain. A session's frames are sent in trace order either
+*  way, while frames of different sessions may overtake each other at max
+*  speed. Throughput is measured up to the last frame sent or received.
+*  Group membership commands are the exception to overtaking: nothing else
+*  is sent until the server has answered one (or REPLAY_BARRIER_MS passed),
+*  so a /join_group never outruns the /create_group of another session and
+*  both servers see the same groups.
+*
+*  Latency is the time from sending a /msg, /broadcast or /group_msg to the
+*  first delivery of its body to any session. Bodies are matched by text, so
+*  a body sent again before its first copy arrived is counted once.
+*/
+#define REPLAY_QUEUE_BYTES (1024 * 1024)    // at max speed a session's unsent output stays below this
+#define REPLAY_QUIET_MS 500                 // the run ends once nothing has arrived for this long...
+#define REPLAY_DRAIN_MS 5000                // ...or this long after the last frame was sent
+#define REPLAY_BARRIER_MS 1000              // longest wait for the answer to a membership command
+
+struct ReplayConfig {
+    std::string host = "127.0.0.1";
+    std::vector<int> ports;
+    std::string usersFile = "users.txt";
+    std::string traceFile;
+    double speed = 1;                       // 0 means as fast as possible
+};
+
+struct ReplayStats {
+    size_t sessions = 0;
+    size_t loginFailures = 0;
+    uint64_t frames = 0;
+    uint64_t skipped = 0;                   // frames of users without a password, or too large for the server
+    uint64_t deliveries = 0;
+    uint64_t errors = 0;
+    double seconds = 0;                     // to the last frame sent or received
+    std::vector<uint64_t> latencies;        // ns
+};
+
+uint64_t nowNs() {
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/**
+ * @brief Reads the username:password pairs of a users file into a map.
+ */
+std::unordered_map<std::string, std::string> loadPasswords(const std::string &fileName) {
+    std::unordered_map<std::string, std::string> passwords;
+    std::ifstream f(fileName);
+    std::string line;
+    while (std::getline(f, line)) {
+        size_t colon = line.find(':');
+        if (colon == std::string::npos) continue;
+        passwords[line.substr(0, colon)] = line.substr(colon + 1);
+    }
+    return passwords;
+}
+
+/**
+ * @brief Returns the body of a message command, or an empty view for any other frame.
+ */
+std::string_view messageBody(std::string_view frame) {
+    std::string_view args = frame;
+    size_t space = args.find(' ');
+    if (space == std::string_view::npos) return std::string_view();
+    std::string_view command = args.substr(0, space);
+    args.remove_prefix(space);
+    auto skip = [](std::string_view s) {
+        size_t begin = s.find_first_not_of(' ');
+        return begin == std::string_view::npos ? std::string_view() : s.substr(begin);
+    };
+    args = skip(args);
+    if (command == "/msg" || command == "/group_msg") {
+        // the recipient comes first
+        space = args.find(' ');
+        return space == std::string_view::npos ? std::string_view() : skip(args.substr(space));
+    }
+    return command == "/broadcast" ? args : std::string_view();
+}
+
+/**
+ * @brief Tells whether a frame changes group membership, which later frames of other sessions may depend on.
+ */
+bool isMembershipCommand(std::string_view frame) {
+    return frame.rfind("/create_group ", 0) == 0 || frame.rfind("/join_group ", 0) == 0 || frame.rfind("/leave_group ", 0) == 0;
+}
+
+/**
+ * @brief Plays the whole trace against one server.
+ */
+ReplayStats replay(const ReplayConfig &cfg, int port, const TraceReader &trace,
+                   const std::unordered_map<std::string, std::string> &passwords) {
+    ReplayStats stats;
+    ChatClient client;
+    std::vector<ChatSession*> live(trace.users.size(), nullptr);
+    std::vector<bool> refused(trace.users.size(), false);  // the server turned the login down, their frames are skipped
+    std::unordered_map<std::string, uint64_t> inFlight;     // message body -> send time
+    uint64_t lastArrival = 0;
+    ChatSession *barrier = nullptr;                         // waiting for the answer to its membership command
+    uint64_t barrierSince = 0;
+
+    ChatSession::Handlers handlers;
+    handlers.onMessage = [&](ChatSession &s, const std::string &message) {
+        uint64_t now = nowNs();
+        lastArrival = now;
+        if (message.compare(0, 6, "Error:") == 0) stats.errors++;
+        // deliveries look like "[sender]: body", "[Broadcast from sender]: body" or "[Group g]: body"
+        size_t split = message[0] == '[' ? message.find("]: ") : std::string::npos;
+        if (split == std::string::npos) {
+            if (&s == barrier) barrier = nullptr;
+            return;
+        }
+        stats.deliveries++;
+        auto it = inFlight.find(message.substr(split + 3));
+        if (it == inFlight.end()) return;
+        stats.latencies.push_back(now - it->second);
+        inFlight.erase(it);
+    };
+    handlers.onClosed = [&](ChatSession &s, const std::string &reason) {
+        if (&s == barrier) barrier = nullptr;
+        auto it = std::find(live.begin(), live.end(), &s);
+        if (it == live.end()) return;
+        *it = nullptr;
+        if (reason.rfind("Authentication failed", 0) == 0 || reason.rfind("Error", 0) == 0) {
+            refused[it - live.begin()] = true;
+            stats.loginFailures++;
+        }
+    };
+
+    // a close followed by no further frame of the same user is left to the end of the run
+    std::vector<bool> finalClose(trace.records.size(), false);
+    std::vector<bool> seen(trace.users.size(), false);
+    for (size_t i = trace.records.size(); i-- > 0;) {
+        const TraceRecord &record = trace.records[i];
+        if (record.type == TraceRecordType::END && !seen[record.user]) finalClose[i] = true;
+        seen[record.user] = true;
+    }
+
+    size_t next = 0;
+    uint64_t start = nowNs(), lastSent = start;
+    while (next < trace.records.size()) {
+        uint64_t now = nowNs();
+        while (next < trace.records.size()) {
+            const TraceRecord &record = trace.records[next];
+            if (barrier && now - barrierSince < (uint64_t)REPLAY_BARRIER_MS * 1000000) break;
+            barrier = nullptr;
+            if (cfg.speed > 0 && start + (uint64_t)(record.at / cfg.speed) > now) break;
+            ChatSession *&session = live[record.user];
+            if (record.type == TraceRecordType::END) {
+                // closing before the login went through, or with frames unwritten, would throw them away
+                if (session && !finalClose[next] && (!session->loggedIn() || session->queuedBytes() > 0)) break;
+                next++;
+                if (session && !finalClose[next - 1]) {
+                    session->close();
+                    session = nullptr;
+                }
+                continue;
+            }
+            if (cfg.speed == 0 && session && (!session->loggedIn() || session->queuedBytes() >= REPLAY_QUEUE_BYTES)) break;
+            next++;
+
+            // a recorded /exit is followed by its END, whose close() sends one
+            if (record.payload == "/exit") continue;
+            if (!session && !refused[record.user]) {
+                auto password = passwords.find(trace.users[record.user]);
+                if (password != passwords.end()) {
+                    session = client.open(cfg.host, port, password->first, password->second, handlers);
+                    if (session) stats.sessions++;
+                }
+            }
+            if (!session || session->send(record.payload) < 0) {
+                stats.skipped++;
+                continue;
+            }
+            std::string_view body = messageBody(record.payload);
+            if (!body.empty()) inFlight[std::string(body)] = now;
+            if (isMembershipCommand(record.payload)) {
+                barrier = session;
+                barrierSince = now;
+            }
+            stats.frames++;
+            lastSent = now;
+        }
+        if (next == trace.records.size()) break;
+
+        int timeoutMs = 1;
+        if (cfg.speed > 0 && !barrier) {
+            uint64_t due = start + (uint64_t)(trace.records[next].at / cfg.speed);
+            timeoutMs = due > now ? (int)std::min<uint64_t>((due - now) / 1000000, 100) : 0;
+        }
+        client.poll(timeoutMs);
+    }
+
+    // let the server catch up, then log everyone out
+    uint64_t sentAll = nowNs();
+    lastArrival = std::max(lastArrival, lastSent);
+    while (true) {
+        uint64_t now = nowNs();
+        if (now - std::max(lastArrival, sentAll) >= (uint64_t)REPLAY_QUIET_MS * 1000000 || now - sentAll >= (uint64_t)REPLAY_DRAIN_MS * 1000000) break;
+        client.poll(10);
+    }
+    stats.seconds = (lastArrival - start) / 1e9;
+    for (ChatSession *session : live) if (session) session->close();
+    uint64_t closing = nowNs();
+    while (client.sessionCount() > 0 && nowNs() - closing < (uint64_t)REPLAY_DRAIN_MS * 1000000) client.poll(10);
+    return stats;
+}
+
+uint64_t percentile(const std::vector<uint64_t> &sorted, double p) {
+    if (sorted.empty()) return 0;
+    size_t i = std::min(sorted.size() - 1, (size_t)(p * sorted.size()));
+    return sorted[i];
+}
+
+double perSecond(uint64_t count, double seconds) {
+    return seconds > 0 ? count / seconds : 0;
+}
+
+void printReport(const ReplayConfig &cfg, int port, ReplayStats &stats) {
+    std::sort(stats.latencies.begin(), stats.latencies.end());
+    std::cout << "server:        " << cfg.host << ":" << port << "\n";
+    std::cout << "sessions:      " << stats.sessions;
+    if (stats.loginFailures) std::cout << " (" << stats.loginFailures << " failed to log in)";
+    std::cout << "\n";
+    std::cout << "frames:        " << stats.frames << " in " << stats.seconds << " s = "
+              << (uint64_t)perSecond(stats.frames, stats.seconds) << " frames/s";
+    if (stats.skipped) std::cout << " (" << stats.skipped << " skipped)";
+    std::cout << "\n";
+    std::cout << "deliveries:    " << stats.deliveries << " in " << stats.seconds << " s = "
+              << (uint64_t)perSecond(stats.deliveries, stats.seconds) << " msgs/s\n";
+    if (stats.errors) std::cout << "errors:        " << stats.errors << "\n";
+    std::cout << "latency (us):  p50 " << percentile(stats.latencies, 0.50) / 1000
+              << "  p99 " << percentile(stats.latencies, 0.99) / 1000
+              << "  p999 " << percentile(stats.latencies, 0.999) / 1000
+              << "  max " << (stats.latencies.empty() ? 0 : stats.latencies.back() / 1000) << std::endl;
+}
+
+/**
+ * @brief Prints how the second server did relative to the first, in percent.
+ */
+void printComparison(const ReplayStats &a, const ReplayStats &b) {
+    auto change = [](double before, double after) {
+        if (before <= 0) return std::string("n/a");
+        double pct = (after - before) * 100 / before;
+        char text[32];
+        snprintf(text, sizeof(text), "%+.1f%%", pct);
+        return std::string(text);
+    };
+    std::cout << "second vs first:"
+              << "  frames/s " << change(perSecond(a.frames, a.seconds), perSecond(b.frames, b.seconds))
+              << "  msgs/s " << change(perSecond(a.deliveries, a.seconds), perSecond(b.deliveries, b.seconds))
+              << "  p50 " << change(percentile(a.latencies, 0.50), percentile(b.latencies, 0.50))
+              << "  p99 " << change(percentile(a.latencies, 0.99), percentile(b.latencies, 0.99))
+              << "  p999 " << change(percentile(a.latencies, 0.999), percentile(b.latencies, 0.999)) << std::endl;
+    if (a.deliveries != b.deliveries || a.errors != b.errors) {
+        std::cout << "note: the servers differ in deliveries (" << a.deliveries << " vs " << b.deliveries
+                  << ") or errors (" << a.errors << " vs " << b.errors << ")" << std::endl;
+    }
+}
+
+void usage() {
+    std::cout << "Usage: ./replay_grp --trace FILE [--host HOST] [--port PORT [--port PORT2]] [--users FILE]\n"
+                 "                    [--speed FACTOR|max]" << std::endl;
+}
+
+int main(int argc, char *argv[]) {
+    ReplayConfig cfg;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        bool hasValue = i + 1 < argc;
+        if (arg == "--trace" && hasValue) cfg.traceFile = argv[++i];
+        else if (arg == "--host" && hasValue) cfg.host = argv[++i];
+        else if (arg == "--port" && hasValue) cfg.ports.push_back(atoi(argv[++i]));
+        else if (arg == "--users" && hasValue) cfg.usersFile = argv[++i];
+        else if (arg == "--speed" && hasValue) {
+            std::string speed = argv[++i];
+            cfg.speed = speed == "max" ? 0 : atof(speed.c_str());
+            if (speed != "max" && cfg.speed <= 0) {
+                usage();
+                return 2;
+            }
+        }
+        else {
+            usage();
+            return 2;
+        }
+    }
+    if (cfg.ports.empty()) cfg.ports.push_back(12346);
+    if (cfg.traceFile.empty() || cfg.ports.size() > 2) {
+        usage();
+        return 2;
+    }
+
+    TraceReader trace;
+    if (trace.load(cfg.traceFile) < 0) return 1;
+    auto passwords = loadPasswords(cfg.usersFile);
+    double traceSeconds = trace.records.empty() ? 0 : trace.records.back().at / 1e9;
+    std::cout << "trace:         " << trace.records.size() << " records from " << trace.users.size() << " users over "
+              << traceSeconds << " s, replayed at " << (cfg.speed > 0 ? std::to_string(cfg.speed) + "x" : "max speed") << "\n";
+
+    // one server at a time, so the two runs do not compete for the machine
+    std::vector<ReplayStats> results;
+    for (int port : cfg.ports) {
+        std::cout << "\n";
+        results.push_back(replay(cfg, port, trace, passwords));
+        printReport(cfg, port, results.back());
+    }
+    if (results.size() == 2) {
+        std::cout << "\n";
+        printComparison(results[0], results[1]);
+    }
+    return 0;
+}
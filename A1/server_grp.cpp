@@ -6,33 +6,152 @@
 #include <unistd.h>
 #include<filesystem>
 #include <arpa/inet.h>
+#include <netinet/tcp.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/random.h>
+#include <sys/sendfile.h>
+#include "protocol.h"
+#include "session_table.h"
+#include "metrics.h"
+#include "message_log.h"
+#include "mpsc_queue.h"
+#include "credential_store.h"
+#include "logger.h"
+#include "timer_wheel.h"
+#include "file_spool.h"
+#include "trace_file.h"
+#include "presence.h"
+#include "fanout_pool.h"
+#include "verifier_pool.h"
+#ifdef USE_IO_URING
+#include "uring.h"
+#endif
 
 using namespace std;
 namespace fs = std::filesystem;
 
-#define BUFFER_SIZE 1024
+#define MAX_EVENTS 1024
+#define ACCEPT_BATCH 64     // connections a reactor accepts per pass of its loop before serving the ones it has
 
 int PORT;
-unordered_map<string, string> Users;
-unordered_map<string, int> sockets;
-unordered_map<string, set<int>> groups;
-vector<int> threads;
-mutex client_mutex;
+bool threadedMode = false;
+uint32_t maxFrameSize = DEFAULT_MAX_FRAME;
+CredentialStore credentials;        // users.txt or a binary user database, reloaded in the background
+Logger logger;                      // everything the server reports once it is running goes through here
+SessionRegistry sessions;
+GroupRegistry groups;
 enum class Commands{
     MESSAGE = 0,
     BROADCAST = 1,
     CREATE_GROUP = 2,
     JOIN_GROUP = 3,
     MESSAGE_GROUP = 4,
-    LEAVE_GROUP = 5
+    LEAVE_GROUP = 5,
+    STATS = 6,
+    HISTORY = 7,
+    EXIT = 8,
+    SEND_FILE = 9,
+    FILE_CHUNK = 10,
+    GET_FILE = 11,
+    WHO = 12,
+    MEMBERS = 13
 };
-unordered_map<string, Commands> commandMap = {
-    {"/msg", Commands::MESSAGE},
-    {"/broadcast", Commands::BROADCAST},
-    {"/create_group", Commands::CREATE_GROUP},
-    {"/join_group", Commands::JOIN_GROUP},
-    {"/group_msg", Commands::MESSAGE_GROUP},
-    {"/leave_group", Commands::LEAVE_GROUP}
+#define COMMAND_KINDS 14
+
+ServerMetrics metrics;
+CommandMetrics commandMetrics[COMMAND_KINDS];  // indexed by Commands value
+unordered_set<string> admins;                   // users allowed to run /stats
+int adminPort = -1;                             // local plaintext stats port, -1 when disabled
+MessageLog messageLog;                          // persistent DM/group log, only open with --log-dir
+int logSyncMs = 5;                              // group commit interval
+size_t historyMaxCount = 50;                    // per-group history limits; a count of 0 disables history
+size_t historyMaxBytes = 64 * 1024;
+FileSpool fileSpool;                            // staged file transfers, only open with --spool-dir
+uint64_t maxFileBytes = 64ull * 1024 * 1024;    // --max-file-size
+int64_t spoolTtlSeconds = 24 * 3600;            // --spool-ttl; transfers untouched this long are deleted
+TraceWriter trafficCapture;                     // every logged-in frame with its time, only open with --capture
+#define CAPTURE_FLUSH_MS 100
+PresenceBoard presence;                         // who is online, for /who and its watchers
+#define PRESENCE_BATCH_MS 200                   // join/leave updates to watchers go out in batches this far apart
+FanoutPool fanoutPool;                          // workers that share the fan-out of large broadcasts
+int fanoutThreads = -1;                         // --fanout-threads; -1 means one per core, 0 keeps every broadcast inline
+VerifierPool verifierPool;                      // workers that check passwords for the reactors
+int verifyThreads = 2;                          // --verify-threads; 0 checks passwords on the reactor itself
+uint32_t fanoutPartition = 2048;                // --fanout-partition; slots per partition, and the most sessions sent to inline
+int resumeTtlSeconds = 60;                      // how long a dropped session with a resume token is kept; 0 disables tokens
+int authTimeoutSeconds = 10;                    // a connection must be logged in this long after it was accepted; 0 waits forever
+int pingIntervalSeconds = 30;                   // a logged-in connection silent this long is sent "/ping"; 0 disables heartbeats
+int pongTimeoutSeconds = 10;                    // and dropped if nothing at all arrives this long after the ping
+int idleTimeoutSeconds = 0;                     // a session that sends no command this long is logged out; 0 disables
+
+// A session parked by disconnect(); the TTL is fixed, so parking order is also expiry order
+struct ParkedSession{
+    SessionHandle handle;
+    int64_t parkedAt;
+};
+mutex parkedMutex;
+deque<ParkedSession> parkedSessions;
+
+/*
+*  Per-connection state machine used by the epoll reactor. A connection walks
+*  HANDSHAKE -> AUTH_USERNAME -> AUTH_PASSWORD -> ACTIVE, which is exactly the
+*  sequence the threaded mode runs through in handle_client() and Authenticate().
+*  While the verifier pool checks a password the connection is VERIFYING and
+*  its further frames wait, buffered, for the verdict.
+*/
+enum class ConnState{
+    HANDSHAKE = 0,
+    AUTH_USERNAME = 1,
+    AUTH_PASSWORD = 2,
+    ACTIVE = 3,
+    VERIFYING = 4
+};
+#ifdef USE_IO_URING
+// io_uring reactors: where a connection's multishot recv stands; at most one is outstanding per connection
+enum class RecvState{
+    IDLE = 0,
+    ARMED = 1,
+    CANCELLING = 2
+};
+#endif
+// What the timeouts of one connection are measured from (steady clock, ms)
+struct Liveness{
+    int64_t openedAt = 0;
+    int64_t heardAt = 0;        // last frame of any kind
+    int64_t commandAt = 0;      // last command; a pong is not one
+    int64_t pingedAt = 0;       // last ping; it is unanswered while this is later than heardAt
+};
+enum class LivenessVerdict{
+    KEEP = 0,
+    PING = 1,                   // the caller sends "/ping" now
+    AUTH_TIMEOUT = 2,
+    NO_HEARTBEAT = 3,
+    IDLE = 4
+};
+struct Connection{
+    int fd;
+    ConnState state;
+    string username;
+    FrameReader reader;
+    Liveness live;
+    TimerHandle timer;          // the next check of `live`, on the reactor's timer wheel
+    uint64_t ticket = 0;        // the password check in flight; its verdict is dropped unless it still matches
+#ifdef USE_IO_URING
+    uint32_t tag = 0;           // io_uring reactors: tells this connection's recv completions from those of an earlier one on the same fd
+    RecvState recv = RecvState::IDLE;
+#endif
+};
+
+// A finished password check, handed from the verifier pool back to the connection's reactor
+struct LoginVerdict{
+    int fd = -1;
+    uint64_t ticket = 0;        // the connection's ticket when the check was submitted
+    int verdict = -1;           // what verifyCredentials() returned
+    string username;            // as verifyCredentials() left it
+    bool withToken = false;     // a one-frame /login, which is answered with a resume token
 };
 
 
@@ -68,53 +187,46 @@ vector<string> split(string &s, const char* key){
 }
 
 /**
- * @brief Extracts the group name from command-line arguments and assigns it to `groupName`.
- *
- * @param argv A vector of strings representing command-line arguments.
- * @param groupName A reference to a string where the extracted group name will be stored.
- * @return int Returns 1 if the group name is successfully extracted, otherwise returns -1.
+ * @brief Slices the next space-separated token off the front of `s`.
  *
- * The function checks if `argv` has at least two elements. If not, it returns -1.
- * Otherwise, it concatenates all elements from index 1 onwards (separated by spaces)
- * into a single string and assigns it to `groupName`, removing the trailing space.
+ * @param s The text still to be parsed; advanced past the token.
+ * @return string_view The token (a view into the same buffer), or an empty view if nothing is left.
  */
-int getGroupname(vector<string> &argv, string &groupName){
-    if(argv.size()<2) return -1;
-    string temp = "";
-    for(long unsigned int i=1;i<argv.size();i++){
-        temp += (argv[i] + " ");
+string_view nextToken(string_view &s){
+    size_t begin = s.find_first_not_of(' ');
+    if(begin == string_view::npos){
+        s = string_view();
+        return s;
     }
-    temp.pop_back();
-    groupName = temp;
-    return 1;
+    s.remove_prefix(begin);
+    size_t end = s.find(' ');
+    string_view token = s.substr(0, end);
+    s.remove_prefix(end == string_view::npos ? s.size() : end);
+    return token;
+}
+
+/**
+ * @brief Drops the separator spaces at the front of `s`; everything after them is kept verbatim.
+ */
+string_view skipSpaces(string_view s){
+    size_t begin = s.find_first_not_of(' ');
+    return begin == string_view::npos ? string_view() : s.substr(begin);
 }
 
 /**
- * @brief Reads a file containing user credentials and stores them in a global map.
+ * @brief Extracts the group name from the command arguments and assigns it to `groupName`.
  *
- * @param fileName The name of the file containing user credentials.
- * @return int Returns 1 if the file is successfully read, otherwise returns 2 if the file cannot be opened.
+ * @param args The command arguments after the command name.
+ * @param groupName Set to a view of the group name inside `args`.
+ * @return int Returns 1 if the group name is successfully extracted, otherwise returns -1.
  *
- * The function attempts to open the specified file. If it fails, it prints an error message and returns 2.
- * It reads each line from the file, splits it using ':' as a delimiter, and stores the extracted key-value pairs
- * in the global `Users` map, where the first part (username) is the key and the second part (password) is the value.
- * Finally, it closes the file and returns 1.
+ * The group name is the whole argument text with the surrounding spaces removed, so names may contain spaces.
  */
-int getUsers(string &fileName){
-    ifstream f(fileName);
-
-    if (!f.is_open()) {
-        cerr << "Error opening the file!";
-        return 2;
-    }
-    string s;
-
-    while (getline(f, s)){
-        vector<string> creds = split(s, ":");
-        Users[creds[0]] = creds[1];
-    }
-
-    f.close();
+int getGroupname(string_view args, string_view &groupName){
+    args = skipSpaces(args);
+    size_t end = args.find_last_not_of(' ');
+    if(end == string_view::npos) return -1;
+    groupName = args.substr(0, end + 1);
     return 1;
 }
 
@@ -123,650 +235,3557 @@ int getUsers(string &fileName){
 */
 
 /*
-    helper functions for race condition handling : start
+    outbound queues : start
 */
 
-
-
-
+/*
+*  Every connection owns a bounded queue of encoded frames. Senders only ever
+*  append to it (never touching the peer's socket), and the reactor writes the
+*  queue out when the socket is writable. Once a queue grows past the high
+*  watermark the slow-consumer policy decides what happens; a sender paused by
+*  PAUSE_SENDER is released when the queue drains back under the low watermark.
+*
+*  Queued frames are immutable and reference counted (SharedFrame): a fan-out
+*  encodes its message once and every recipient's queue points at that same
+*  buffer, which goes out through scatter/gather sendmsg calls. Frames live in
+*  size-classed blocks of the BufferPool, so building one is a free-list pop
+*  and the last queue to write it pushes the block back.
+*/
 
 /**
- * @brief Adds a new client to the sockets map in a thread-safe manner.
- *
- * @param client_fd A reference to the client's file descriptor.
- * @param username A reference to the client's username.
- *
- * The function locks `client_mutex` to ensure thread safety, then adds 
- * the client's file descriptor to the `sockets` map using the username as the key.
+ * @brief Encodes `payload` once into an immutable frame that any number of queues can share.
  */
-void addNewClient(int &client_fd, string &username){
-    lock_guard<mutex> lock(client_mutex);
-
-    sockets[username] = client_fd;
+SharedFrame makeSharedFrame(string_view payload){
+    char *out;
+    SharedFrame frame = SharedFrame::allocate(FRAME_HEADER_SIZE + payload.size(), out);
+    encodeFrameHeader((uint32_t)payload.size(), out);
+    memcpy(out + FRAME_HEADER_SIZE, payload.data(), payload.size());
+    return frame;
 }
 
-
 /**
- * @brief Retrieves the username associated with a given client file descriptor.
- *
- * @param client_fd A reference to the client's file descriptor.
- * @param username A reference to a string where the retrieved username will be stored.
- * @return int Returns 1 if the username is found, otherwise returns -1.
- *
- * The function iterates over the `sockets` map to find the client file descriptor. 
- * If a match is found, the corresponding username is assigned to `username`, and the function returns 1. 
- * If no match is found, it returns -1.
+ * @brief Encodes the concatenation of `parts` as one frame, writing each part straight into the frame buffer.
  */
-int getUsernameFromFD(int &client_fd, string &username){
-    lock_guard<mutex> lock(client_mutex);
-
-    for(auto it: sockets){
-        if(it.second == client_fd) {
-            username = it.first; 
-            return 1;
-        }
+SharedFrame makeSharedFrame(initializer_list<string_view> parts){
+    size_t len = 0;
+    for(auto &part : parts) len += part.size();
+
+    char *out;
+    SharedFrame frame = SharedFrame::allocate(FRAME_HEADER_SIZE + len, out);
+    encodeFrameHeader((uint32_t)len, out);
+    out += FRAME_HEADER_SIZE;
+    for(auto &part : parts){
+        memcpy(out, part.data(), part.size());
+        out += part.size();
     }
-
-    return -1;
+    return frame;
 }
 
-/**
- * @brief Retrieves the client file descriptor associated with a given username.
- *
- * @param username A reference to the username.
- * @param client_fd A reference to an integer where the retrieved file descriptor will be stored.
- * @return int Returns 1 if the file descriptor is found, otherwise returns -1.
- *
- * The function checks if the username exists in the `sockets` map. If not, it returns -1. 
- * If the username is found, it retrieves the associated file descriptor and assigns it to `client_fd`, 
- * then returns 1.
- */
-int getFDFromUsername(string &username, int &client_fd){
-    lock_guard<mutex> lock(client_mutex);
-
-    if(sockets.find(username)==sockets.end()) return -1;
-
-    client_fd = sockets[username];
+enum class SlowConsumerPolicy{
+    DROP_OLDEST = 0,
+    DISCONNECT = 1,
+    PAUSE_SENDER = 2
+};
+SlowConsumerPolicy slowConsumerPolicy = SlowConsumerPolicy::DISCONNECT;
+size_t outqHighWatermark = 1024 * 1024;
+size_t outqLowWatermark = 256 * 1024;
 
-    return 1;
-}
+/*
+*  Write coalescing: everything queued for a connection during one pass of
+*  its reactor's loop already goes out in one sendmsg. With --flush-us a
+*  queue holding less than FLUSH_BYTES is held back for up to that many
+*  microseconds, so a subscriber of several busy groups gets a few large
+*  writes instead of one per pass. Sockets run with TCP_NODELAY (the server
+*  does its own batching, so Nagle only adds delay) unless --nagle is given.
+*/
+#define FLUSH_BYTES (16 * 1024)     // a held-back queue this full is written out right away
+long flushDelayUs = 0;              // --flush-us; 0 writes every queue at the end of the pass that filled it
+bool tcpNoDelay = true;             // --nagle clears it
 
+struct Reactor;
 
-/**
- * @brief Checks if a command is valid and retrieves its corresponding `Commands` object.
- *
- * @param s A reference to the command string.
- * @param command A reference to a `Commands` object where the retrieved command will be stored.
- * @return int Returns 1 if the command is valid, otherwise returns -1.
- *
- * The function checks if the command string `s` exists in the `commandMap`. If not, it returns -1. 
- * If the command is found, it assigns the corresponding `Commands` object to the `command` parameter and returns 1.
- */
-int checkCommandValidity(string &s, Commands &command){
-    lock_guard<mutex> lock(client_mutex);
+// A download in progress: the spool file and the offset of the next chunk to relay from it
+struct FileStream{
+    shared_ptr<const FileTransfer> file;
+    uint64_t offset;
+};
 
-    if(commandMap.find(s) == commandMap.end()) return -1;
+struct Outbox{
+    int fd;
+    Reactor *owner;                 // the reactor that writes this queue out
+    mutex m;
+    condition_variable resumed;     // threaded mode: a paused sender waits here
+    deque<SharedFrame> frames;      // encoded frames waiting for the socket
+    size_t offset = 0;              // bytes of frames.front() already written
+    size_t bytes = 0;               // bytes still queued
+    size_t sending = 0;             // io_uring reactors: frames at the front owned by an in-flight send
+    uint64_t binding = 0;           // bumped whenever the queue leaves its socket; sends for an older binding are void
+    bool closed = false;
+    bool parked = false;            // the session waits for a resume: frames are kept but nothing is written
+    bool dirty = false;             // already on the owner's dirty queue (or its deferred list)
+    int64_t flushAt = 0;            // while held back by --flush-us: the steady-clock deadline in ns, otherwise 0
+    vector<int> blockedSenders;     // senders paused because this queue is full
+    atomic<int> pauseCount{0};      // number of full queues currently pausing this connection
+    uint32_t frameLimit = DEFAULT_MAX_FRAME;    // negotiated with the client; bounds the file chunks sent to it
+    deque<FileStream> downloads;    // files relayed to this connection a chunk at a time (see relayFiles())
+    shared_ptr<const FileTransfer> chunkFile;   // sendfile relay: the file of the chunk being written
+    char chunkHead[FILE_CHUNK_OVERHEAD];        // that chunk's frame header and "/file_data ID OFFSET " prefix
+    size_t chunkHeadLen = 0;
+    size_t chunkHeadSent = 0;
+    uint64_t chunkAt = 0;           // spool offset of the chunk's next byte
+    size_t chunkLeft = 0;           // file bytes of the chunk still to be written
+    bool streaming = false;         // on the owner's streaming list, to relay more file data next pass
+};
+#define OUTBOX_SHARDS 64
+struct OutboxShard{
+    mutex m;
+    unordered_map<int, shared_ptr<Outbox>> boxes;
+};
+OutboxShard outboxShards[OUTBOX_SHARDS];    // fd -> queue, split by fd so lookups rarely contend
 
-    command = commandMap[s];
+/*
+*  Each reactor thread owns its own epoll instance, listening socket and
+*  connections. Work for a reactor that comes from another thread (a queue
+*  that needs writing, a sender to resume) is handed over through lock-free
+*  MPSC queues, and the reactor is woken through its eventfd; `wakePending`
+*  folds a burst of handovers into a single eventfd write.
+*/
+struct Reactor{
+    int id = 0;
+    int epoll_fd = -1;
+    int wake_fd = -1;
+    int listen_fd = -1;                         // -1 for the flush-only reactor of threaded mode
+    unordered_map<int, Connection> connections; // only touched by this reactor's thread
+    MpscQueue<shared_ptr<Outbox>> dirty;        // queues with frames this reactor has not tried to write yet
+    MpscQueue<int> resumed;                     // paused connections whose reads can continue
+    MpscQueue<LoginVerdict> verified;           // password checks the verifier pool has finished
+    uint64_t nextTicket = 0;
+    deque<pair<int64_t, shared_ptr<Outbox>>> deferred;  // queues held back by --flush-us; FIFO is deadline order
+    vector<shared_ptr<Outbox>> streaming;       // queues with file data left after their relay burst, served next pass
+    atomic<bool> wakePending{false};
+    bool acceptPending = false;                 // the listening socket has connections left over from the last batch
+    TimerWheel timers;                          // one timer per connection, keyed by fd (see checkConnectionTimer())
+    int64_t nowMs = 0;                          // steady clock when the current pass of the loop started
+#ifdef USE_IO_URING
+    unique_ptr<Uring> ring;                     // set while this reactor runs on io_uring instead of epoll
+    uint32_t nextTag = 0;
+#endif
+};
+vector<unique_ptr<Reactor>> reactors;
+int reactorCount = 0;                           // --reactors; 0 means one per core
+bool useIoUring = false;                        // --io-uring; reactors fall back to epoll if it is unavailable
 
-    return 1;
-}
+thread_local Reactor *currentReactor = nullptr;
+thread_local int currentSender = -1;   // connection whose command is being handled on this thread
+thread_local uint64_t currentFanout = 0;    // recipients queued by the command being handled on this thread
+thread_local uint64_t currentOversize = 0;  // frames of that command left out for exceeding a recipient's frame limit
 
 /*
-    helper functions: end
+*  Admission control. The listen backlog (--backlog), the number of open
+*  connections (--max-conns) and the number per client address
+*  (--max-conns-per-ip) are capped; 0 leaves a cap off. A connection is
+*  admitted right after accept() and released when its outbound queue is
+*  taken down, so sockets that have not logged in yet count too.
+*  A refused connection gets HELLO and a "busy" frame, and is closed before
+*  any per-connection state exists.
 */
+int listenBacklog = SOMAXCONN;
+size_t maxConnections = 0;
+size_t maxConnectionsPerIp = 0;
+atomic<size_t> admittedConnections{0};
+#define PEER_SHARDS 16
+struct PeerShard{
+    mutex m;
+    unordered_map<uint32_t, uint32_t> open;     // IPv4 address -> admitted connections from it
+};
+PeerShard peerShards[PEER_SHARDS];
+unique_ptr<atomic<uint32_t>[]> peerOf;          // fd -> address it was admitted for, sized to the open-file limit
+size_t peerSlots = 0;
 
 /**
- * @brief Disconnects a client by closing the file descriptor and cleaning up associated data.
- *
- * @param client_fd The file descriptor of the client to be disconnected.
+ * @brief Counts a freshly accepted connection against the caps.
  *
- * The function closes the connection by calling `close()` on the client's file descriptor.
- * The username associated with the client is found and removed from the `sockets` map. 
- * The client is also removed from any groups they belong to. Finally, the entry in `sockets` for that username is erased.
+ * @param client_fd The accepted socket.
+ * @param address The peer's IPv4 address, in network byte order.
+ * @return int Returns 1 if the connection may stay, otherwise returns -1 and counts nothing.
  */
-void disconnect(int client_fd){
-    close(client_fd);
-
-    lock_guard<mutex> lock(client_mutex);
-
-    remove(threads.begin(), threads.end(), client_fd);
-
-    string usernameToRemove = "";
-    for(auto &it: sockets){
-        if(it.second == client_fd){
-            usernameToRemove = it.first;
+int admitConnection(int client_fd, uint32_t address){
+    size_t open = admittedConnections.fetch_add(1, memory_order_relaxed);
+    if(maxConnections > 0 && open >= maxConnections){
+        admittedConnections.fetch_sub(1, memory_order_relaxed);
+        return -1;
+    }
+    if(maxConnectionsPerIp > 0 && (size_t)client_fd < peerSlots){
+        PeerShard &shard = peerShards[address % PEER_SHARDS];
+        lock_guard<mutex> lock(shard.m);
+        uint32_t &count = shard.open[address];
+        if(count >= maxConnectionsPerIp){
+            admittedConnections.fetch_sub(1, memory_order_relaxed);
+            return -1;
         }
+        count++;
+        peerOf[client_fd].store(address, memory_order_relaxed);
     }
+    return 1;
+}
 
-    if(sockets.find(usernameToRemove)==sockets.end()) return;
-    sockets.erase(usernameToRemove);
+/**
+ * @brief Gives back what `admitConnection()` counted; called once per connection, before its fd is closed.
+ */
+void releaseConnection(int client_fd){
+    admittedConnections.fetch_sub(1, memory_order_relaxed);
+    if(maxConnectionsPerIp == 0 || (size_t)client_fd >= peerSlots) return;
+    uint32_t address = peerOf[client_fd].load(memory_order_relaxed);
+    PeerShard &shard = peerShards[address % PEER_SHARDS];
+    lock_guard<mutex> lock(shard.m);
+    auto it = shard.open.find(address);
+    if(it != shard.open.end() && --it->second == 0) shard.open.erase(it);
+}
 
-    //removes from all groups
-    for(auto &it: groups){
-        it.second.erase(client_fd);
-    }
+/**
+ * @brief Turns away a connection over a cap: one non-blocking write of HELLO plus the reason, then close.
+ */
+void refuseConnection(int client_fd){
+    bump(metrics.refused);
+    string frames = encodeFrame(helloPayload(maxFrameSize)) + encodeFrame("Error: Server is busy, try again later.");
+    if(send(client_fd, frames.data(), frames.size(), MSG_DONTWAIT | MSG_NOSIGNAL)<0) logger.write(LogLevel::DEBUG, "refusal not sent fd=%d: %s", client_fd, strerror(errno));
+    close(client_fd);
 }
 
 /**
- * @brief (Abstraction) Sends a message to a client through the given file descriptor.
+ * @brief Creates the outbound queue for a new connection.
  *
- * @param clientFd A reference to the client's file descriptor.
- * @param message A reference to the message string to be sent.
+ * @param client_fd The connection's file descriptor.
+ * @param owner The reactor that will write the queue out.
+ */
+void openOutbox(int client_fd, Reactor &owner){
+    int noDelay = tcpNoDelay;
+    if(setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &noDelay, sizeof(noDelay))<0) logger.write(LogLevel::WARN, "TCP_NODELAY failed fd=%d: %s", client_fd, strerror(errno));
+
+    auto box = make_shared<Outbox>();
+    box->fd = client_fd;
+    box->owner = &owner;
+    metrics.connections.fetch_add(1, memory_order_relaxed);
+    bump(metrics.accepted);
+    OutboxShard &shard = outboxShards[client_fd % OUTBOX_SHARDS];
+    lock_guard<mutex> lock(shard.m);
+    shard.boxes[client_fd] = box;
+}
+
+/**
+ * @brief Looks up the outbound queue of a connection.
  *
- * The function sends the `message` to the client associated with the `clientFd` using the `send()` system call.
+ * @param client_fd The connection's file descriptor.
+ * @return shared_ptr<Outbox> The queue, or nullptr if the connection is gone.
  */
-void sendMessage(int &clientFd, string &message){
-    send(clientFd, message.c_str(), message.size(), 0);
+shared_ptr<Outbox> getOutbox(int client_fd){
+    OutboxShard &shard = outboxShards[client_fd % OUTBOX_SHARDS];
+    lock_guard<mutex> lock(shard.m);
+    auto it = shard.boxes.find(client_fd);
+    if(it == shard.boxes.end()) return nullptr;
+    return it->second;
+}
+
+/**
+ * @brief Wakes a reactor through its eventfd, unless we are running on it or a wakeup is already pending.
+ */
+void wakeReactor(Reactor &reactor){
+    if(currentReactor == &reactor || reactor.wake_fd < 0) return;
+    if(reactor.wakePending.exchange(true, memory_order_acq_rel)) return;
+    uint64_t one = 1;
+    if(write(reactor.wake_fd, &one, sizeof(one))<0 && errno != EAGAIN) logger.write(LogLevel::ERROR, "eventfd write failed: %s", strerror(errno));
 }
 
+#define WRITE_BATCH 64      // frames per sendmsg
 
 /**
- * @brief Receives a message from a client and stores it in the `message` string.
- *
- * @param client_fd A reference to the client's file descriptor.
- * @param message A reference to the string where the received message will be stored.
- * @return int Returns 1 if the message is successfully received, otherwise returns -1 if the client disconnects or an error occurs.
+ * @brief Drops the first `n` written bytes from a queue.
  *
- * The function attempts to receive a message from the client using the `recv()` system call. 
- * If no data is received (indicating the client disconnected), it calls the `disconnect()` function and returns -1.
- * If an error occurs during reception, it prints an error message and disconnects the client, returning -1.
- * If the message is successfully received, it stores the message in `message` and returns 1.
+ * @param box The queue; the caller holds `box.m`.
+ * @param n The number of bytes the socket accepted.
  */
-int recvMessage(int &client_fd, string &message) {
-    char buff[BUFFER_SIZE] = {0};
-    int bytesReceived = recv(client_fd, buff, sizeof(buff) - 1, 0);
-
-    //check for abrupt disconnection of the client
-    if (bytesReceived == 0) {
-        disconnect(client_fd);
-        cout<<"client disconnected"<<endl;
-        return -1;
-    } else if (bytesReceived < 0) { //If the recv function gives any error
-        perror("recv failed");
-        disconnect(client_fd);
-        return -1;
+void consumeQueued(Outbox &box, size_t n){
+    box.bytes -= n;
+    bump(metrics.bytesOut, n);
+    while(n > 0){
+        size_t left = box.frames.front()->size() - box.offset;
+        if(n < left){
+            box.offset += n;
+            break;
+        }
+        n -= left;
+        box.frames.pop_front();
+        box.offset = 0;
+        bump(metrics.framesOut);
     }
-
-    buff[bytesReceived] = '\0';
-    message.assign(buff, bytesReceived);
-    cout<<message<<endl;
-    return 1;
 }
 
 /**
- * @brief Validates whether the given argument represents a valid integer port number.
- *
- * @param arg A pointer to a string representing the port number to be validated.
- * @return bool Returns true if the port number is valid (contains only digits), otherwise returns false.
+ * @brief Writes the rest of the chunk being relayed with sendfile: its header from memory, its bytes straight from the spool file.
  *
- * The function checks if every character in the string `arg` is a digit. If any character is not a digit,
- * the function returns false. If all characters are digits, it returns true, indicating a valid port number.
+ * @param box The queue; the caller holds `box.m`.
+ * @return int Returns 1 once the chunk is out, 0 if the socket is full, and -1 on a socket error.
  */
-bool validatePort(char *arg){
-    int n = strlen(arg);
-
-    for(int i=0;i<n;i++){
-        if(!(arg[i]<='9' && arg[i]>='0')) return false;
+int continueChunk(Outbox &box){
+    while(box.chunkHeadSent < box.chunkHeadLen){
+        ssize_t n = send(box.fd, box.chunkHead + box.chunkHeadSent, box.chunkHeadLen - box.chunkHeadSent, MSG_DONTWAIT | MSG_NOSIGNAL | MSG_MORE);
+        if(n < 0){
+            if(errno == EINTR) continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+        box.chunkHeadSent += n;
+        bump(metrics.bytesOut, n);
     }
-    return true;
+    while(box.chunkLeft > 0){
+        off_t at = (off_t)box.chunkAt;
+        ssize_t n = sendfile(box.fd, box.chunkFile->fd, &at, box.chunkLeft);
+        if(n < 0){
+            if(errno == EINTR) continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+        // the spool file never shrinks while it is open, so running short means the descriptor is broken
+        if(n == 0) return -1;
+        box.chunkAt += n;
+        box.chunkLeft -= n;
+        bump(metrics.bytesOut, n);
+        bump(metrics.fileBytesOut, n);
+    }
+    box.chunkFile.reset();
+    box.chunkHeadLen = box.chunkHeadSent = 0;
+    bump(metrics.framesOut);
+    return 1;
 }
 
-
 /**
- * @brief Authenticates a client by verifying their username and password.
+ * @brief Writes as much of a queue as the socket accepts without blocking.
  *
- * @param client_fd The file descriptor of the client attempting to authenticate.
- * @param username A reference to a string where the authenticated username will be stored.
- * @return int Returns 1 if authentication is successful, otherwise returns -1.
+ * @param box The queue to write out; the caller holds `box.m`.
+ * @return int Returns 1 if the socket took everything or would block, otherwise returns -1 on a socket error.
  *
- * The function sends the prompts to the client to enter a username and password. It then receives the inputs and 
- * checks whether the username exists in the `Users` map and if the password matches. If authentication fails, 
- * it sends an error message and returns -1. Additionally, it checks if the username is already in use, and if so, 
- * returns -1. If authentication succeeds, it returns 1.
+ * While an io_uring send is in flight the socket belongs to it, and a parked queue has no socket; both do nothing.
+ * A queue longer than WRITE_BATCH frames takes several sendmsg calls; all but the last carry MSG_MORE (a TCP_CORK
+ * for that one call), so the kernel packs them into full segments instead of pushing a short one at every call.
  */
-int Authenticate(int client_fd, string &username){
-    string password;
-
-    string authPrompts = "Enter username: ";
-    sendMessage(client_fd, authPrompts );
-    if(recvMessage(client_fd,username)<0){
-        perror("Error recieving the username");
-        return -1;
-    }
-
-    authPrompts = "Enter password: ";
-    sendMessage(client_fd, authPrompts);
-    if(recvMessage(client_fd,password)<0){
-        perror("Error: recieving the password");
-        return -1;
+int writeQueued(Outbox &box){
+    if(box.sending || box.parked) return 1;
+    // a chunk relayed with sendfile is a frame already begun on the wire, nothing may be written in between
+    if(box.chunkHeadSent < box.chunkHeadLen || box.chunkLeft > 0){
+        int r = continueChunk(box);
+        if(r <= 0) return r < 0 ? -1 : 1;
     }
+    while(!box.frames.empty()){
+        iovec iov[WRITE_BATCH];
+        int iovcnt = 0;
+        for(auto it = box.frames.begin(); it != box.frames.end() && iovcnt < WRITE_BATCH; ++it, ++iovcnt){
+            size_t skip = iovcnt == 0 ? box.offset : 0;
+            iov[iovcnt].iov_base = (void*)((*it)->data() + skip);
+            iov[iovcnt].iov_len = (*it)->size() - skip;
+        }
 
-    //Just a check to remove the spaces in the back
-    username = split(username, " ")[0];
-    password = split(password, " ")[0];
-    if(Users.find(username)==Users.end() || Users[username]!= password){
-        authPrompts = "Authentication failed. \n";
-        sendMessage(client_fd, authPrompts);
-        return -1;
+        msghdr msg{};
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovcnt;
+        int flags = MSG_DONTWAIT | MSG_NOSIGNAL | ((size_t)iovcnt < box.frames.size() ? MSG_MORE : 0);
+        bump(metrics.sendCalls);
+        ssize_t n = sendmsg(box.fd, &msg, flags);
+        if(n < 0){
+            if(errno == EINTR) continue;
+            if(errno == EAGAIN || errno == EWOULDBLOCK) return 1;
+            return -1;
+        }
+        consumeQueued(box, n);
     }
-    if(sockets.find(username)!=sockets.end()) return -1;
-
     return 1;
 }
 
-/*
-    Command execution functions: start
-*/
-
+#define FILE_BURST_BYTES (256 * 1024)   // file bytes relayed to one connection per pass of its reactor
 
 /**
- * @brief Sends a private message from one client to another.
+ * @brief Relays the next chunks of a queue's downloads, but only while no frame is waiting in front of them.
  *
- * @param sender_fd A reference to the sender's file descriptor.
- * @param argv A reference to a vector of strings containing the command and message components.
- * @return int Returns 1 if the message is successfully sent, otherwise returns -1.
+ * @param box The queue; the caller holds `box.m` and has just written out its frames.
+ * @return int Returns 1 if there is nothing more to relay for now, 2 if FILE_BURST_BYTES went out and more is
+ *             left for the next pass, 0 if the socket is full, and -1 on a socket error.
  *
- * The function retrieves the recipient's file descriptor using their username. It constructs the message by
- * concatenating the components of `argv` starting from index 2. It checks that the sender and recipient are not the same,
- * and that both the sender and recipient are valid. The message is prefixed with the sender's username and then sent to the recipient.
+ * Chat frames always go first, and a connection gets at most FILE_BURST_BYTES of file data per pass, so a large
+ * download neither delays messages to the same client nor starves the other connections of its reactor.
+ * Several downloads to one connection take turns chunk by chunk. On epoll reactors each chunk is written
+ * with sendfile straight from the spool file, so the bytes never pass through user space. The io_uring reactors
+ * and --threaded mode write from blocking sockets, which sendfile would stall, so they read the chunk into a
+ * pooled frame instead and queue it like any other; an io_uring reactor stages one such chunk per send.
  */
-int sendIndividualMessage(int &sender_fd, vector<string> &argv){
-    if(argv.size()<3) return -1;
-
-    string recvUsername = argv[1], message = "";
-    int recv_fd;
-    if(getFDFromUsername(recvUsername, recv_fd)<0) return -1;
+int relayFiles(Outbox &box){
+    bool zeroCopy = !threadedMode;
+#ifdef USE_IO_URING
+    if(box.owner->ring) zeroCopy = false;
+#endif
+    size_t budget = FILE_BURST_BYTES;
+    while(!box.downloads.empty() && box.frames.empty() && !box.sending && !box.parked && box.chunkLeft == 0){
+        if(budget == 0) return 2;
+
+        FileStream stream = move(box.downloads.front());
+        box.downloads.pop_front();
+        shared_ptr<const FileTransfer> file = stream.file;
+        uint64_t at = stream.offset;
+        size_t room = box.frameLimit > FILE_CHUNK_OVERHEAD ? box.frameLimit - FILE_CHUNK_OVERHEAD : 0;
+        size_t len = (size_t)min<uint64_t>({FILE_CHUNK_SIZE, room, file->size - min(at, file->size)});
+        if(len == 0) continue;
+        stream.offset += len;
+        if(stream.offset < file->size) box.downloads.push_back(move(stream));
+        budget -= min(budget, len);
+
+        char prefix[FILE_CHUNK_OVERHEAD];
+        size_t prefixLen = (size_t)snprintf(prefix, sizeof(prefix), "/file_data %llu %llu ", (unsigned long long)file->id, (unsigned long long)at);
+        if(zeroCopy){
+            encodeFrameHeader((uint32_t)(prefixLen + len), box.chunkHead);
+            memcpy(box.chunkHead + FRAME_HEADER_SIZE, prefix, min(prefixLen, sizeof(box.chunkHead) - FRAME_HEADER_SIZE));
+            box.chunkHeadLen = FRAME_HEADER_SIZE + prefixLen;
+            box.chunkHeadSent = 0;
+            box.chunkFile = file;
+            box.chunkAt = at;
+            box.chunkLeft = len;
+            int r = continueChunk(box);
+            if(r <= 0) return r;
+            continue;
+        }
 
-    for(long unsigned int i=2;i<argv.size();i++){
-        message += (argv[i] + " ");
+        char *out;
+        SharedFrame frame = SharedFrame::allocate(FRAME_HEADER_SIZE + prefixLen + len, out);
+        encodeFrameHeader((uint32_t)(prefixLen + len), out);
+        memcpy(out + FRAME_HEADER_SIZE, prefix, prefixLen);
+        char *data = out + FRAME_HEADER_SIZE + prefixLen;
+        size_t done = 0;
+        while(done < len){
+            ssize_t n = pread(file->fd, data + done, len - done, (off_t)(at + done));
+            if(n < 0 && errno == EINTR) continue;
+            if(n <= 0) break;
+            done += n;
+        }
+        if(done < len){
+            logger.write(LogLevel::WARN, "spool read failed for file %llu: %s", (unsigned long long)file->id, strerror(errno));
+            box.downloads.erase(remove_if(box.downloads.begin(), box.downloads.end(), [&](const FileStream &s){ return s.file == file; }), box.downloads.end());
+            continue;
+        }
+        box.frames.push_back(move(frame));
+        box.bytes += FRAME_HEADER_SIZE + prefixLen + len;
+        bump(metrics.fileBytesOut, len);
+#ifdef USE_IO_URING
+        if(box.owner->ring) return 1;
+#endif
+        if(writeQueued(box)<0) return -1;
+        if(!box.frames.empty()) return 0;
     }
-
-    string senderUsername;
-    if(getUsernameFromFD(sender_fd, senderUsername)<0) return -1;
-    if(sender_fd == recv_fd) return -1;
-
-    message = "[" + senderUsername + "]: " + message;
-
-    sendMessage(recv_fd, message);
-
-    return 1;
+    return box.chunkLeft > 0 ? 0 : 1;
 }
-/*
-*  Functional Overloading for the broadcast function, first is the
-*  main function that is called when command is called,
-*  the second is for commond messages such as 'x joined the chat'
-*  There is no requirement for the two to be different but we just 
-*  felt like it does the same thing so we named them the same.
-*/
 
 /**
- * @brief Broadcasts a message to all clients except the sender.
+ * @brief Releases senders that were paused by a queue which has drained (or gone away).
  *
- * @param neglectClient The file descriptor of the client whose message should be excluded from the broadcast.
- * @param argv A reference to a vector of strings containing the broadcast message components.
- * @return int Returns 1 if the message is successfully broadcasted, otherwise returns -1.
+ * @param senders The file descriptors of the paused senders.
  *
- * The function constructs the broadcast message by concatenating the components of `argv` starting from index 1.
- * It retrieves the username associated with the sender's file descriptor and sends the message to all clients in the `sockets` map, 
- * excluding the sender. The message is prefixed with the sender's username.
+ * In threaded mode the sender's thread is woken from its condition variable; in reactor mode the
+ * sender is handed back to the reactor that owns it, which resumes reading its buffered frames.
  */
-int broadcast(int neglectClient, vector<string> &argv){
-    if(argv.size()<2) return -1;
-    lock_guard<mutex> lock(client_mutex);
-
-    string message = "";
-    for(long unsigned int i=1;i<argv.size();i++){
-        message += (argv[i] + " ");
-    }
-
-    string username = "";
-    for(auto &it: sockets){
-        if(it.second == neglectClient){
-            username = it.first;
+void resumeSenders(vector<int> &senders){
+    for(int sender : senders){
+        auto box = getOutbox(sender);
+        if(!box || --box->pauseCount > 0) continue;
+
+        if(threadedMode){
+            lock_guard<mutex> lock(box->m);
+            box->resumed.notify_all();
+        }
+        else{
+            box->owner->resumed.push(sender);
+            wakeReactor(*box->owner);
         }
     }
-
-    for(auto &it : sockets){
-        if(it.second == neglectClient) continue;
-
-        int client_fd = it.second;
-
-        string s = "[Broadcast from " + username + "]: " + message;
-
-        sendMessage(client_fd, s);
-    }
-
-    return 1;
 }
 
-
 /**
- * @brief Broadcasts a message to all clients except the sender.
+ * @brief Appends encoded frames to a connection's outbound queue without touching its socket.
  *
- * @param message A reference to the message string to be broadcasted.
- * @param neglectClient A reference to the file descriptor of the client whose message should be excluded from the broadcast.
- * @return int Returns 1 if the message is successfully broadcasted, otherwise returns -1.
+ * @param box The recipient's queue.
+ * @param frames The encoded frames; the queue keeps references, the bytes are not copied.
+ * @param count The number of frames.
+ * @return int Returns 1 if the frames were queued, 0 if every one of them was over the recipient's frame limit,
+ *             otherwise returns -1 (connection gone or evicted as a slow consumer).
  *
- * The function retrieves the username associated with the sender's file descriptor and sends the provided 
- * `message` to all clients in the `sockets` map, excluding the sender. The message is prefixed with the sender's username.
+ * A frame larger than the limit the recipient negotiated would make its reader drop the connection, so it is
+ * left out (and counted) instead; the rest of the batch is queued as usual.
+ * The frames are queued together under one lock, so the reactor writes them out in one scatter/gather call.
+ * If they would push the queue past `outqHighWatermark`, one non-blocking write is tried first;
+ * if the queue is still too full, `slowConsumerPolicy` applies:
+ * DROP_OLDEST discards queued frames that have not started going out, DISCONNECT shuts the
+ * connection down, and PAUSE_SENDER queues the frame but stops reading from `currentSender`
+ * until the queue drains below `outqLowWatermark`.
+ * A parked queue (its session waits for a resume) just collects frames and always drops the oldest.
  */
-int broadcast(string &message, int &neglectClient){
-    lock_guard<mutex> lock(client_mutex);
-
-    string username = "";
-    for(auto &it: sockets){
-        if(it.second == neglectClient){
-            username = it.first;
-        }
+int enqueueFitting(const shared_ptr<Outbox> &box, const SharedFrame *frames, size_t count, uint32_t limit);
+
+int enqueueFrames(const shared_ptr<Outbox> &box, const SharedFrame *frames, size_t count){
+    if(!box) return -1;
+    size_t size = 0, largest = 0;
+    for(size_t i = 0; i < count; i++){
+        size += frames[i]->size();
+        largest = max(largest, frames[i]->size());
     }
 
-    for(auto it : sockets){
-        if(it.second == neglectClient) continue;
-
-        int client_fd = it.second;
+    Reactor *owner = nullptr;
+    {
+        unique_lock<mutex> lock(box->m);
+        if(box->closed) return -1;
+        if(largest > (size_t)box->frameLimit + FRAME_HEADER_SIZE){
+            uint32_t limit = box->frameLimit;
+            lock.unlock();
+            return enqueueFitting(box, frames, count, limit);
+        }
 
-        string s = username + " " + message;
+        // a fast reader may simply not have been flushed yet during a long burst
+        if(box->bytes + size > outqHighWatermark) writeQueued(*box);
+
+        if(box->bytes + size > outqHighWatermark){
+            switch(box->parked ? SlowConsumerPolicy::DROP_OLDEST : slowConsumerPolicy){
+                case SlowConsumerPolicy::DROP_OLDEST:
+                    while(box->bytes + size > outqHighWatermark){
+                        // the head may be half written, it has to go out whole, and frames in flight are already gone
+                        size_t victim = box->sending ? box->sending : (box->offset > 0 ? 1 : 0);
+                        if(victim >= box->frames.size()) break;
+                        box->bytes -= box->frames[victim]->size();
+                        box->frames.erase(box->frames.begin() + victim);
+                        bump(metrics.framesDropped);
+                    }
+                    break;
+                case SlowConsumerPolicy::DISCONNECT:
+                    // the owner of the connection notices the shutdown and runs the normal cleanup
+                    shutdown(box->fd, SHUT_RDWR);
+                    bump(metrics.slowConsumers);
+                    return -1;
+                case SlowConsumerPolicy::PAUSE_SENDER:
+                    // counted before it is published, so a drain that releases the entry always finds the pause in place
+                    if(currentSender >= 0){
+                        if(auto senderBox = getOutbox(currentSender)){
+                            senderBox->pauseCount++;
+                            box->blockedSenders.push_back(currentSender);
+                        }
+                    }
+                    break;
+            }
+        }
 
-        sendMessage(client_fd, s);
+        box->bytes += size;
+        box->frames.insert(box->frames.end(), frames, frames + count);
+        // a queue held back by --flush-us goes back on the dirty queue (to be written at once) when it fills up
+        bool held = box->flushAt != 0 && box->bytes >= FLUSH_BYTES;
+        if((!box->dirty || held) && !box->parked){
+            box->dirty = true;
+            box->flushAt = 0;
+            box->owner->dirty.push(box);
+            owner = box->owner;
+        }
     }
 
+    if(owner) wakeReactor(*owner);
     return 1;
 }
 
-
 /**
- * @brief Creates a new group.
- *
- * @param client_fd A reference to the file descriptor of the client creating the group.
- * @param argv A reference to a vector of strings containing the group name.
- * @return int Returns 1 if the group is successfully created, otherwise returns -1.
+ * @brief Queues the frames of a batch that fit in `limit` and leaves out the rest.
  *
- * The function extracts the group name from `argv` and checks if it already exists in the `groups` map.
- * If the group does not exist, it creates a new entry with the creator's file descriptor as the first member.
- * A confirmation message is then sent to the creator.
+ * @return int Returns what enqueueFrames() returns for the frames that fit, or 0 if none did.
  */
-int createGroup(int &client_fd, vector<string> &argv){
-    lock_guard<mutex> lock(client_mutex);
-
-    string groupName; 
-    if(getGroupname(argv, groupName)<0) return -1;
-    if(groups.find(groupName)!=groups.end()) return -1;
-
-    set<int> st;
-    st.insert(client_fd);
-    
-    groups[groupName] = st;
+int enqueueFitting(const shared_ptr<Outbox> &box, const SharedFrame *frames, size_t count, uint32_t limit){
+    vector<SharedFrame> fitting;
+    for(size_t i = 0; i < count; i++){
+        if(frames[i]->size() <= (size_t)limit + FRAME_HEADER_SIZE) fitting.push_back(frames[i]);
+        else{
+            bump(metrics.framesOversize);
+            currentOversize++;
+        }
+    }
+    if(fitting.empty()) return 0;
+    return enqueueFrames(box, fitting.data(), fitting.size());
+}
 
-    string finalMessage = "Group " + groupName + " Created.";
-    sendMessage(client_fd, finalMessage);
+/**
+ * @brief Appends one encoded frame to a connection's outbound queue.
+ */
+int enqueueFrame(const shared_ptr<Outbox> &box, const SharedFrame &frame){
+    return enqueueFrames(box, &frame, 1);
+}
 
-    return 1;
+/**
+ * @brief Appends an encoded frame to the outbound queue of the connection on `client_fd`.
+ */
+int enqueueFrame(int client_fd, const SharedFrame &frame){
+    return enqueueFrame(getOutbox(client_fd), frame);
 }
 
+#ifdef USE_IO_URING
+int submitRingSend(Reactor &reactor, const shared_ptr<Outbox> &box);
+void cancelRingRecv(Reactor &reactor, Connection &conn);
+#endif
 
 /**
- * @brief Adds a client to an existing group.
+ * @brief Writes out a connection's queue; called by its owning reactor when the socket becomes writable or the queue is dirty.
  *
- * @param client_fd A reference to the file descriptor of the client joining the group.
- * @param argv A reference to a vector of strings containing the group name.
- * @return int Returns 1 if the client successfully joins the group, otherwise returns -1.
+ * @param box The queue to write out.
+ * @return int Returns 1 on success, otherwise returns -1.
  *
- * The function extracts the group name from `argv` and checks if the group exists.
- * If the group exists and the client is not already a member, the client's file descriptor is added to the group.
- * A confirmation message is then sent to the client.
+ * On an io_uring reactor the write is only queued as a send SQE; the reactor submits all of them at once.
+ * A queue that was moved to another reactor by a resume is left to that reactor.
  */
-int joinGroup(int &client_fd, vector<string> &argv){
-    lock_guard<mutex> lock(client_mutex);
-
-    string groupName; 
-    if(getGroupname(argv, groupName)<0) return -1;
-
-    if(groups.find(groupName)==groups.end()) return -1;
-    if(groups[groupName].find(client_fd)!=groups[groupName].end()) return -1;
-
-    groups[groupName].insert(client_fd);
-
-    string finalMessage = "You joined the group " + groupName + ".";
-    sendMessage(client_fd, finalMessage);
-
-    return 1;
+int flushOutbox(const shared_ptr<Outbox> &box){
+    if(!box) return -1;
+
+    vector<int> toResume;
+    int r;
+    {
+        lock_guard<mutex> lock(box->m);
+        if(box->closed) return -1;
+        if(currentReactor && box->owner != currentReactor) return 1;
+        box->dirty = false;
+        box->flushAt = 0;
+        int relayed;
+#ifdef USE_IO_URING
+        if(box->owner->ring){
+            relayed = relayFiles(*box);
+            r = submitRingSend(*box->owner, box);
+        }
+        else
+#endif
+        {
+            r = writeQueued(*box);
+            relayed = r > 0 ? relayFiles(*box) : 1;
+            if(relayed < 0) r = -1;
+        }
+        if(relayed == 2 && !box->streaming){
+            box->streaming = true;
+            box->owner->streaming.push_back(box);
+        }
+        if(box->bytes <= outqLowWatermark) swap(toResume, box->blockedSenders);
+    }
+    resumeSenders(toResume);
+    return r;
+}
+
+/**
+ * @brief Returns the steady clock in nanoseconds; the time base of `Outbox::flushAt`.
+ */
+int64_t steadyNowNs(){
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/**
+ * @brief With --flush-us, holds a small queue back on the reactor's deferred list instead of writing it now.
+ *
+ * @return bool Returns true if the queue was held back, false if it should be written right away.
+ */
+bool deferFlush(Reactor &reactor, const shared_ptr<Outbox> &box, int64_t now){
+    lock_guard<mutex> lock(box->m);
+    // a queue that was already held back once (or was refilled past FLUSH_BYTES) is not held again
+    if(box->closed || box->parked || box->owner != &reactor || box->flushAt != 0 || box->bytes >= FLUSH_BYTES) return false;
+    box->flushAt = now + flushDelayUs * 1000;
+    reactor.deferred.emplace_back(box->flushAt, box);
+    return true;
+}
+
+/**
+ * @brief Flushes every queue handed to this reactor since the last pass, and every held-back queue that is due.
+ *
+ * @return int64_t The deadline of the next held-back queue in steady-clock ns, or -1 if there is none.
+ */
+int64_t flushDirtyOutboxes(Reactor &reactor){
+    int64_t now = flushDelayUs > 0 ? steadyNowNs() : 0;
+    // downloads that used up their burst last pass; a queue that does so again is listed for the pass after
+    vector<shared_ptr<Outbox>> streaming;
+    streaming.swap(reactor.streaming);
+    for(auto &box : streaming){
+        {
+            lock_guard<mutex> lock(box->m);
+            box->streaming = false;
+        }
+        flushOutbox(box);
+    }
+
+    shared_ptr<Outbox> box;
+    while(reactor.dirty.pop(box)){
+        if(flushDelayUs > 0 && deferFlush(reactor, box, now)) continue;
+        flushOutbox(box);
+    }
+
+    while(!reactor.deferred.empty() && reactor.deferred.front().first <= now){
+        auto entry = move(reactor.deferred.front());
+        reactor.deferred.pop_front();
+        // entries for queues that were written out early since are stale
+        bool due;
+        {
+            lock_guard<mutex> lock(entry.second->m);
+            due = entry.second->flushAt == entry.first;
+        }
+        if(due) flushOutbox(entry.second);
+    }
+    return reactor.deferred.empty() ? -1 : reactor.deferred.front().first;
+}
+
+/**
+ * @brief Unlinks a connection's queue from its fd.
+ *
+ * @return shared_ptr<Outbox> The queue, or nullptr if the fd has none.
+ */
+shared_ptr<Outbox> takeOutbox(int client_fd){
+    OutboxShard &shard = outboxShards[client_fd % OUTBOX_SHARDS];
+    lock_guard<mutex> lock(shard.m);
+    auto it = shard.boxes.find(client_fd);
+    if(it == shard.boxes.end()) return nullptr;
+    shared_ptr<Outbox> box = std::move(it->second);
+    shard.boxes.erase(it);
+    return box;
+}
+
+/**
+ * @brief Marks a queue closed and releases the senders it paused; the queue must already be unlinked from its fd.
+ */
+void closeOutbox(const shared_ptr<Outbox> &box){
+    vector<int> toResume;
+    {
+        lock_guard<mutex> lock(box->m);
+        writeQueued(*box);
+        box->closed = true;
+        box->frames.clear();
+        box->bytes = 0;
+        box->downloads.clear();
+        box->chunkFile.reset();
+        swap(toResume, box->blockedSenders);
+        box->resumed.notify_all();
+    }
+    resumeSenders(toResume);
+}
+
+/**
+ * @brief Removes a connection's queue before its fd is closed.
+ *
+ * @param client_fd The connection's file descriptor.
+ *
+ * Whatever is still queued gets one last non-blocking write attempt (so e.g. "Authentication failed"
+ * still reaches the client), the queue is marked closed so no flush can touch the fd after it is
+ * reused, and senders paused by this queue are released.
+ */
+void closeOutbox(int client_fd){
+    shared_ptr<Outbox> box = takeOutbox(client_fd);
+    if(!box) return;
+    metrics.connections.fetch_sub(1, memory_order_relaxed);
+    releaseConnection(client_fd);
+    closeOutbox(box);
+}
+
+/**
+ * @brief Unlinks the queue of a connection whose session is being parked, keeping the frames for a resume.
+ *
+ * @param client_fd The connection's file descriptor, which the caller closes next.
+ *
+ * A frame that was half written, or that an io_uring send still has in flight, went to the old socket and
+ * cannot be finished on a new one, so it is dropped; bumping `binding` voids that send's completion.
+ */
+void parkOutbox(int client_fd){
+    shared_ptr<Outbox> box = takeOutbox(client_fd);
+    if(!box) return;
+    metrics.connections.fetch_sub(1, memory_order_relaxed);
+    releaseConnection(client_fd);
+
+    vector<int> toResume;
+    {
+        lock_guard<mutex> lock(box->m);
+        writeQueued(*box);
+        size_t stale = box->sending ? box->sending : (box->offset > 0 ? 1 : 0);
+        for(size_t i = 0; i < stale && !box->frames.empty(); i++){
+            box->bytes -= box->frames.front()->size() - (i == 0 ? box->offset : 0);
+            box->frames.pop_front();
+        }
+        box->offset = 0;
+        box->sending = 0;
+        // the same goes for a chunk relayed with sendfile; the client asks for the missing bytes again
+        box->chunkFile.reset();
+        box->chunkHeadLen = box->chunkHeadSent = box->chunkLeft = 0;
+        box->binding++;
+        box->fd = -1;
+        box->parked = true;
+        box->pauseCount = 0;
+        swap(toResume, box->blockedSenders);
+        box->resumed.notify_all();
+    }
+    resumeSenders(toResume);
+}
+
+/**
+ * @brief Moves a parked queue onto the connection that resumed its session.
+ *
+ * @param box The parked queue; it takes over the connection's fd, reactor and place in the fd map.
+ * @param fresh The queue the connection was given on accept, which is retired.
+ *
+ * Frames still waiting in `fresh` (e.g. the welcome) go out first, followed by everything that was
+ * kept while the session was parked. Frames of an io_uring send already in flight on `fresh` stay with it.
+ */
+void rebindOutbox(const shared_ptr<Outbox> &box, const shared_ptr<Outbox> &fresh){
+    Reactor *owner;
+    int client_fd;
+    {
+        // no other code path holds two queue locks at once, so taking both cannot deadlock
+        lock_guard<mutex> freshLock(fresh->m);
+        lock_guard<mutex> lock(box->m);
+        size_t skip = min(fresh->sending, fresh->frames.size());
+        size_t moved = fresh->bytes;
+        for(size_t i = 0; i < skip; i++) moved -= fresh->frames[i]->size() - (i == 0 ? fresh->offset : 0);
+        box->frames.insert(box->frames.begin(), fresh->frames.begin() + skip, fresh->frames.end());
+        box->offset = skip ? 0 : fresh->offset;
+        box->bytes += moved;
+        box->fd = client_fd = fresh->fd;
+        box->owner = owner = fresh->owner;
+        box->frameLimit = fresh->frameLimit;
+        box->parked = false;
+        // a stale entry on the old reactor's dirty queue is skipped by flushOutbox, so always hand it over again
+        box->dirty = true;
+        owner->dirty.push(box);
+
+        fresh->frames.clear();
+        fresh->bytes = fresh->offset = 0;
+        fresh->binding++;
+        fresh->closed = true;
+    }
+    {
+        OutboxShard &shard = outboxShards[client_fd % OUTBOX_SHARDS];
+        lock_guard<mutex> lock(shard.m);
+        shard.boxes[client_fd] = box;
+    }
+    wakeReactor(*owner);
+}
+
+/**
+ * @brief Threaded mode: blocks the calling client thread while its reads are paused by a full queue.
+ *
+ * @param client_fd The sender's file descriptor.
+ */
+void waitUntilResumed(int client_fd){
+    auto box = getOutbox(client_fd);
+    if(!box) return;
+    unique_lock<mutex> lock(box->m);
+    box->resumed.wait(lock, [&]{ return box->pauseCount <= 0 || box->closed; });
+}
+
+/*
+    outbound queues : end
+*/
+
+/*
+    helper functions for race condition handling : start
+*/
+
+
+
+
+
+/**
+ * @brief Adds a new client to the session table in a thread-safe manner.
+ *
+ * @param client_fd A reference to the client's file descriptor.
+ * @param username A reference to the client's username.
+ * @return int Returns 1 if the session was created, otherwise returns -1 (the username is already online).
+ *
+ * The function creates a session for the username in the registry (which only locks the username's shard),
+ * making it reachable both by name and by file descriptor. The session keeps a reference to the
+ * connection's outbound queue so that deliveries never need to look the fd up again.
+ */
+int addNewClient(int &client_fd, string &username){
+    auto box = getOutbox(client_fd);
+    if(!box) return -1;
+
+    if(!sessions.add(username, client_fd, box).valid()) return -1;
+    presence.online(username);
+    return 1;
+}
+
+
+/**
+ * @brief Retrieves the username associated with a given client file descriptor.
+ *
+ * @param client_fd A reference to the client's file descriptor.
+ * @param username A reference to a string where the retrieved username will be stored.
+ * @return int Returns 1 if the username is found, otherwise returns -1.
+ *
+ * The function resolves the fd through the registry's lock-free fd index in O(1), then reads the session
+ * under its shard's shared lock.
+ * If a live session is found, the corresponding username is assigned to `username`, and the function returns 1. 
+ * If no session owns the fd, it returns -1.
+ */
+int getUsernameFromFD(int &client_fd, string &username){
+    if(!sessions.read(sessions.byFd(client_fd), [&](const Session &session){ username = session.username; })) return -1;
+    return 1;
+}
+
+/**
+ * @brief Retrieves the client file descriptor associated with a given username.
+ *
+ * @param username A reference to the username.
+ * @param client_fd A reference to an integer where the retrieved file descriptor will be stored.
+ * @return int Returns 1 if the file descriptor is found, otherwise returns -1.
+ *
+ * The function checks if the username has a live session. If not, it returns -1. 
+ * If the username is found, it retrieves the associated file descriptor and assigns it to `client_fd`, 
+ * then returns 1.
+ */
+int getFDFromUsername(string &username, int &client_fd){
+    if(!sessions.read(sessions.byName(username), [&](const Session &session){ client_fd = session.fd; })) return -1;
+
+    return 1;
+}
+
+
+/*
+    helper functions: end
+*/
+
+
+/**
+ * @brief Milliseconds on the steady clock, used to time parked sessions.
+ */
+int64_t steadyNowMs(){
+    return chrono::duration_cast<chrono::milliseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/**
+ * @brief Disconnects a client by closing the file descriptor and cleaning up associated data.
+ *
+ * @param client_fd The file descriptor of the client to be disconnected.
+ *
+ * The function closes the connection by calling `close()` on the client's file descriptor.
+ * The client's session is looked up by fd and removed from the groups it belongs to.
+ * Finally the session is released, which bumps its slot's generation so that
+ * no leftover handle (or a reused fd) can reach the next occupant of the slot.
+ * A session that was given a resume token is parked instead: it keeps its groups and queue for
+ * `resumeTtlSeconds`, and only `endParkedSession()` releases it if nobody resumes it in time.
+ */
+void disconnect(int client_fd){
+    // drop the session before the fd can be handed out again by accept()
+    SessionHandle handle = sessions.byFd(client_fd);
+    string username;
+    if(sessions.read(handle, [&](const Session &session){ username = session.username; })){
+        // from here on DMs to this user are kept in the log for their next login
+        if(messageLog.isOpen()) messageLog.setOffline(username);
+        if(trafficCapture.isOpen()) trafficCapture.end(username, steadyNowNs());
+        presence.offline(username);
+    }
+
+    int64_t now = steadyNowMs();
+    if(resumeTtlSeconds > 0 && sessions.park(handle, now)){
+        parkOutbox(client_fd);
+        close(client_fd);
+        lock_guard<mutex> lock(parkedMutex);
+        parkedSessions.push_back(ParkedSession{handle, now});
+        return;
+    }
+
+    vector<string> memberOf;
+    if(sessions.remove(handle, memberOf)){
+        //removes from the groups the client was part of
+        for(auto &groupName: memberOf) groups.leave(groupName, handle);
+    }
+
+    if(auto box = getOutbox(client_fd)) presence.unwatch(box.get());
+    closeOutbox(client_fd);
+    close(client_fd);
+}
+
+/**
+ * @brief Releases a parked session that was not resumed within the TTL, like `disconnect()` would have.
+ */
+void endParkedSession(const ParkedSession &parked){
+    vector<string> memberOf;
+    shared_ptr<Outbox> box;
+    // a session resumed (or parked again) since then has a different parkedAt and stays
+    if(!sessions.expire(parked.handle, parked.parkedAt, memberOf, box)) return;
+    for(auto &groupName: memberOf) groups.leave(groupName, parked.handle);
+    if(box){
+        presence.unwatch(box.get());
+        closeOutbox(box);
+    }
+}
+
+/**
+ * @brief Expiry loop for parked sessions: once a second every session parked longer than the TTL is released.
+ */
+void runParkedExpiry(){
+    while(true){
+        this_thread::sleep_for(chrono::seconds(1));
+        int64_t cutoff = steadyNowMs() - (int64_t)resumeTtlSeconds * 1000;
+        vector<ParkedSession> expired;
+        {
+            lock_guard<mutex> lock(parkedMutex);
+            while(!parkedSessions.empty() && parkedSessions.front().parkedAt <= cutoff){
+                expired.push_back(parkedSessions.front());
+                parkedSessions.pop_front();
+            }
+        }
+        for(auto &parked : expired) endParkedSession(parked);
+    }
+}
+
+/**
+ * @brief (Abstraction) Sends a message to a client through the given file descriptor.
+ *
+ * @param clientFd A reference to the client's file descriptor.
+ * @param message A reference to the message string to be sent.
+ *
+ * The function wraps `message` in a length-prefixed frame and appends it to the client's outbound
+ * queue; the reactor writes it out once the socket is writable, so this never blocks on a slow peer.
+ */
+void sendMessage(int &clientFd, string &message){
+    enqueueFrame(clientFd, makeSharedFrame(message));
+}
+
+/**
+ * @brief Sends a message straight to a known outbound queue (used when the queue was already resolved).
+ */
+void sendMessage(const shared_ptr<Outbox> &box, string &message){
+    enqueueFrame(box, makeSharedFrame(message));
+}
+
+/**
+ * @brief Decides whether a connection has run out of time, and when it next needs looking at.
+ *
+ * @param live The connection's timestamps; `pingedAt` is set when the verdict is PING.
+ * @param active True once the connection has logged in.
+ * @param now The steady clock, in ms.
+ * @param due Set to when this should run again (ms), or -1 if no timeout applies.
+ * @return LivenessVerdict KEEP or PING while the connection may stay, otherwise why it has to go.
+ *
+ * Before login only `--auth-timeout` applies. Afterwards a connection that has been silent for
+ * `--ping-interval` is pinged, and dropped if still nothing arrives within `--pong-timeout`; any frame
+ * counts as an answer. `--idle-timeout` looks at commands only, so answering pings does not keep a session.
+ */
+LivenessVerdict checkLiveness(Liveness &live, bool active, int64_t now, int64_t &due){
+    due = -1;
+    auto until = [&](int64_t at){ if(due < 0 || at < due) due = at; };
+    if(!active){
+        if(authTimeoutSeconds <= 0) return LivenessVerdict::KEEP;
+        int64_t deadline = live.openedAt + authTimeoutSeconds * 1000LL;
+        if(now >= deadline) return LivenessVerdict::AUTH_TIMEOUT;
+        until(deadline);
+        return LivenessVerdict::KEEP;
+    }
+
+    LivenessVerdict verdict = LivenessVerdict::KEEP;
+    if(pingIntervalSeconds > 0){
+        if(live.pingedAt > live.heardAt){
+            int64_t deadline = live.pingedAt + pongTimeoutSeconds * 1000LL;
+            if(now >= deadline) return LivenessVerdict::NO_HEARTBEAT;
+            until(deadline);
+        }
+        else if(now >= live.heardAt + pingIntervalSeconds * 1000LL){
+            live.pingedAt = now;
+            until(now + pongTimeoutSeconds * 1000LL);
+            verdict = LivenessVerdict::PING;
+        }
+        else until(live.heardAt + pingIntervalSeconds * 1000LL);
+    }
+    if(idleTimeoutSeconds > 0){
+        int64_t deadline = live.commandAt + idleTimeoutSeconds * 1000LL;
+        if(now >= deadline) return LivenessVerdict::IDLE;
+        until(deadline);
+    }
+    return verdict;
+}
+
+/**
+ * @brief Carries out a `checkLiveness()` verdict on a connection.
+ *
+ * @return int Returns 1 if the connection stays, otherwise returns -1 and the caller closes it.
+ *
+ * A connection that missed its heartbeat is closed like any dropped connection, so a session with a resume
+ * token is parked. An idle session is told why and ended for good, as if it had sent `/exit`.
+ */
+int applyLiveness(int client_fd, LivenessVerdict verdict){
+    string notice;
+    switch(verdict){
+        case LivenessVerdict::KEEP:
+            return 1;
+        case LivenessVerdict::PING:
+            notice = "/ping";
+            sendMessage(client_fd, notice);
+            return 1;
+        case LivenessVerdict::AUTH_TIMEOUT:
+            bump(metrics.authTimeouts);
+            logger.write(LogLevel::INFO, "login timed out fd=%d", client_fd);
+            notice = "Error: Authentication timed out.";
+            sendMessage(client_fd, notice);
+            return -1;
+        case LivenessVerdict::NO_HEARTBEAT:
+            bump(metrics.heartbeatTimeouts);
+            logger.write(LogLevel::INFO, "no heartbeat from fd=%d, dropping it", client_fd);
+            return -1;
+        case LivenessVerdict::IDLE:
+            bump(metrics.idleTimeouts);
+            logger.write(LogLevel::INFO, "session idle too long fd=%d", client_fd);
+            sessions.write(sessions.byFd(client_fd), [](Session &session){ session.resumeSecret[0] = session.resumeSecret[1] = 0; });
+            notice = "Disconnected: idle for too long.";
+            sendMessage(client_fd, notice);
+            return -1;
+    }
+    return -1;
+}
+
+
+/**
+ * @brief Logs a received frame at DEBUG level, sampled by `--log-sample`, with credentials masked.
+ *
+ * @param client_fd The connection the frame arrived on.
+ * @param frame The frame's payload.
+ * @param secret True if the whole frame is a secret (the answer to the password prompt).
+ *
+ * The password of `/login` and the token of `/resume` are replaced by "***", so no credential ever reaches the log.
+ */
+void logIncoming(int client_fd, string_view frame, bool secret){
+    if(!logger.enabled(LogLevel::DEBUG) || !logger.sampled()) return;
+    if(secret){
+        logger.write(LogLevel::DEBUG, "recv fd=%d <password>", client_fd);
+        return;
+    }
+    string_view args = frame;
+    string_view command = nextToken(args);
+    if(command == "/login"){
+        string_view name = nextToken(args);
+        logger.write(LogLevel::DEBUG, "recv fd=%d /login %.*s ***", client_fd, (int)name.size(), name.data());
+    }
+    else if(command == "/resume") logger.write(LogLevel::DEBUG, "recv fd=%d /resume ***", client_fd);
+    // file contents are not text, only their size is logged
+    else if(command == "/file_chunk") logger.write(LogLevel::DEBUG, "recv fd=%d /file_chunk (%zu bytes)", client_fd, frame.size());
+    else logger.write(LogLevel::DEBUG, "recv fd=%d %.*s", client_fd, (int)frame.size(), frame.data());
+}
+
+/**
+ * @brief Receives one message (frame) from a client and stores it in the `message` string.
+ *
+ * @param client_fd A reference to the client's file descriptor.
+ * @param reader A reference to the connection's frame reassembly buffer.
+ * @param message A reference to the string where the received message will be stored.
+ * @return int Returns 1 if the message is successfully received, 0 if the socket's receive timeout ran out first,
+ *             otherwise returns -1 if the client disconnects or an error occurs.
+ *
+ * The function keeps reading from the socket until `reader` holds a complete frame, so coalesced or
+ * split TCP segments no longer change message boundaries.
+ * If the client disconnected, or an error occurs during reception or the frame exceeds the negotiated size,
+ * it prints a message and returns -1; the caller runs `disconnect()` exactly once so a reused fd is never closed twice.
+ * If the message is successfully received, it stores the message in `message` and returns 1.
+ * The message is logged through `logIncoming()`; `secret` marks a password answer, whose text is never logged.
+ */
+int recvMessage(int &client_fd, FrameReader &reader, string &message, bool secret = false) {
+    int r = recvFrame(client_fd, reader, message);
+
+    //check for abrupt disconnection of the client
+    if (r == 0) {
+        logger.write(LogLevel::INFO, "client disconnected fd=%d", client_fd);
+        return -1;
+    } else if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) { //SO_RCVTIMEO ran out, see handle_client()
+        return 0;
+    } else if (r < 0) { //If the recv function gives any error or the frame is too large
+        logger.write(LogLevel::WARN, "recv failed fd=%d: %s", client_fd, strerror(errno));
+        return -1;
+    }
+
+    bump(metrics.framesIn);
+    bump(metrics.bytesIn, FRAME_HEADER_SIZE + message.size());
+    logIncoming(client_fd, message, secret);
+    return 1;
+}
+
+/**
+ * @brief Applies a client's HELLO frame to its connection.
+ *
+ * @param client_fd The connection; its outbound queue keeps the limit to size the file chunks sent to it.
+ * @param hello A reference to the received handshake payload.
+ * @param reader A reference to the connection's frame reader whose limit is updated.
+ * @return int Returns 1 if the handshake is valid, otherwise returns -1.
+ *
+ * The negotiated maximum frame size is the smaller of the server's `maxFrameSize` and the client's advertised limit.
+ * A client advertising less than MIN_FRAME_LIMIT is refused, as the server's own frames could not reach it.
+ */
+int negotiateFrameSize(int client_fd, string &hello, FrameReader &reader){
+    uint32_t clientMax;
+    if(parseHello(hello, clientMax)<0) return -1;
+    uint32_t limit = min(clientMax, maxFrameSize);
+    reader.setMaxFrame(limit);
+    if(auto box = getOutbox(client_fd)){
+        lock_guard<mutex> lock(box->m);
+        box->frameLimit = limit;
+    }
+    return 1;
+}
+
+/**
+ * @brief Validates whether the given argument represents a valid integer port number.
+ *
+ * @param arg A pointer to a string representing the port number to be validated.
+ * @return bool Returns true if the port number is valid (contains only digits), otherwise returns false.
+ *
+ * The function checks if every character in the string `arg` is a digit. If any character is not a digit,
+ * the function returns false. If all characters are digits, it returns true, indicating a valid port number.
+ */
+bool validatePort(char *arg){
+    int n = strlen(arg);
+
+    for(int i=0;i<n;i++){
+        if(!(arg[i]<='9' && arg[i]>='0')) return false;
+    }
+    return true;
+}
+
+
+/**
+ * @brief Checks a username/password pair against the credential store.
+ *
+ * @param username A reference to the received username; trailing spaces are stripped in place.
+ * @param password A reference to the received password; trailing spaces are stripped in place.
+ * @return int Returns 1 if the credentials are valid, -1 if they are wrong, and -2 if the user is already logged in.
+ *         A user whose session is only parked counts as logged out; `startSession()` picks that session up.
+ *
+ * Shared by the threaded `Authenticate()` and the reactor's authentication state machine so that
+ * both modes accept exactly the same inputs. With a binary user database this runs the PBKDF2 hash,
+ * whose round count was chosen when the database was built.
+ */
+int verifyCredentials(string &username, string &password){
+    //Just a check to remove the spaces in the back
+    vector<string> u = split(username, " "), p = split(password, " ");
+    if(u.empty() || p.empty()) return -1;
+    username = u[0];
+    password = p[0];
+
+    if(!credentials.verify(username, password)){
+        bump(metrics.authFailures);
+        return -1;
+    }
+
+    bool online = false;
+    sessions.read(sessions.byName(username), [&](const Session &session){ online = !session.parked; });
+    if(online) return -2;
+
+    return 1;
+}
+
+int quickLogin(int client_fd, string &frame, string &username);
+
+/**
+ * @brief Authenticates a client by verifying their username and password.
+ *
+ * @param client_fd The file descriptor of the client attempting to authenticate.
+ * @param reader A reference to the connection's frame reader.
+ * @param username A reference to a string where the authenticated username will be stored.
+ * @return int Returns 1 if authentication is successful, 2 if a one-frame login or resume already started
+ *             the session, otherwise returns -1.
+ *
+ * The function sends the prompts to the client to enter a username and password. It then receives the inputs and 
+ * checks the credentials with `verifyCredentials()`. If authentication fails, 
+ * it sends an error message and returns -1. Additionally, it checks if the username is already in use, and if so, 
+ * returns -1. If authentication succeeds, it returns 1.
+ * Instead of the username the client may answer with `/login` or `/resume` (see `quickLogin()`); a refused
+ * resume leaves it at the username prompt.
+ */
+int Authenticate(int client_fd, FrameReader &reader, string &username){
+    string password;
+
+    string authPrompts = "Enter username: ";
+    sendMessage(client_fd, authPrompts );
+    while(true){
+        int r = recvMessage(client_fd,reader,username);
+        if(r == 0) applyLiveness(client_fd, LivenessVerdict::AUTH_TIMEOUT);
+        if(r <= 0){
+            logger.write(LogLevel::INFO, "no username from fd=%d", client_fd);
+            return -1;
+        }
+        int quick = quickLogin(client_fd, username, username);
+        if(quick == 1) return 2;
+        if(quick < 0) return -1;
+        if(quick == 0) break;
+    }
+
+    authPrompts = "Enter password: ";
+    sendMessage(client_fd, authPrompts);
+    int r = recvMessage(client_fd,reader,password,true);
+    if(r == 0) applyLiveness(client_fd, LivenessVerdict::AUTH_TIMEOUT);
+    if(r <= 0){
+        logger.write(LogLevel::INFO, "no password from fd=%d", client_fd);
+        return -1;
+    }
+
+    int verdict = verifyCredentials(username, password);
+    if(verdict == -1){
+        authPrompts = "Authentication failed. \n";
+        sendMessage(client_fd, authPrompts);
+    }
+    if(verdict < 0) return -1;
+
+    return 1;
+}
+
+/*
+    Command execution functions: start
+*/
+
+
+/**
+ * @brief Checks that a relayed message still fits in the frame size its sender negotiated.
+ *
+ * The sender may send a body of the full size, but the relay puts a prefix such as "[Broadcast from X]: " in
+ * front of it. A message that outgrew the limit that way is refused up front, before it is logged or kept in
+ * a group's history, rather than being left out for every recipient by enqueueFrames().
+ */
+bool fitsFrameLimit(int client_fd, const SharedFrame &frame){
+    auto box = getOutbox(client_fd);
+    if(!box) return false;
+    lock_guard<mutex> lock(box->m);
+    return frame->size() <= (size_t)box->frameLimit + FRAME_HEADER_SIZE;
+}
+
+/**
+ * @brief Sends a private message from one client to another.
+ *
+ * @param sender_fd A reference to the sender's file descriptor.
+ * @param args The command arguments: the recipient's username followed by the message.
+ * @return int Returns 1 if the message is successfully sent, otherwise returns -1.
+ *
+ * The function retrieves the recipient's outbound queue using their username. The message body is
+ * everything after the recipient name, with its whitespace kept exactly as typed. It checks that the sender and recipient are not the same,
+ * and that both the sender and recipient are valid. The message is prefixed with the sender's username and then sent to the recipient.
+ * Only the recipient's and the sender's session shards are touched, so DMs between disjoint pairs of users do not contend.
+ * With the message log open every DM is also appended to it, and a DM to a registered user who is offline is kept
+ * there and delivered when they next log in instead of being rejected.
+ */
+int sendIndividualMessage(int &sender_fd, string_view args){
+    string_view recvUsername = nextToken(args);
+    string_view body = skipSpaces(args);
+    if(recvUsername.empty() || body.empty()) return -1;
+
+    SharedFrame frame;
+    if(!sessions.read(sessions.byFd(sender_fd), [&](const Session &session){
+        if(session.username == recvUsername) return;
+        frame = makeSharedFrame({"[", session.username, "]: ", body});
+    }) || !frame || !fitsFrameLimit(sender_fd, frame)) return -1;
+
+    SessionHandle recvHandle = sessions.byName(recvUsername);
+    if(messageLog.isOpen()){
+        // an offline recipient is fine as long as they are a real user, the log keeps the DM for their next login
+        if(!recvHandle.valid() && !credentials.exists(recvUsername)) return -1;
+        int online = messageLog.appendDirect(recvUsername, string_view(*frame).substr(FRAME_HEADER_SIZE));
+        if(online < 0) return -1;
+        if(online == 0) return 1;
+        if(!recvHandle.valid()) recvHandle = sessions.byName(recvUsername);
+    }
+
+    shared_ptr<Outbox> recvBox;
+    if(!sessions.read(recvHandle, [&](const Session &session){ recvBox = session.outbox; })) return -1;
+
+    if(enqueueFrame(recvBox, frame)>0) currentFanout++;
+
+    return 1;
+}
+
+/**
+ * @brief Queues `frame` for every live session except the one on `neglectClient`.
+ *
+ * @return uint64_t The number of queues the frame went into.
+ *
+ * Up to `fanoutPartition` sessions are walked inline on the calling thread. Past that every shard's slot array is
+ * cut into ranges of `fanoutPartition` slots, and the ranges are spread over the fan-out pool, each holding only
+ * its own shard's shared lock while it runs. The call returns once every range is done, so a broadcast is
+ * queued everywhere before the sender's next command, as it would be inline.
+ */
+uint64_t fanOutToAll(const SharedFrame &frame, int neglectClient){
+    uint64_t queued = 0;
+    if(fanoutPool.size() == 0 || sessions.size() <= fanoutPartition){
+        sessions.forEach([&](SessionHandle, const Session &session){
+            if(session.fd != neglectClient && enqueueFrame(session.outbox, frame)>0) queued++;
+        });
+        return queued;
+    }
+
+    struct Range{
+        uint32_t shard;
+        uint32_t begin;
+    };
+    vector<Range> ranges;
+    for(uint32_t shard = 0; shard < SESSION_SHARDS; shard++){
+        uint32_t slots = sessions.slotCount(shard);
+        for(uint32_t begin = 0; begin < slots; begin += fanoutPartition) ranges.push_back(Range{shard, begin});
+    }
+
+    atomic<uint64_t> total{0}, oversize{0};
+    int sender = currentSender;
+    fanoutPool.run((uint32_t)ranges.size(), [&](uint32_t part){
+        // a worker stands in for the sender, so PAUSE_SENDER still pauses the right connection
+        int saved = currentSender;
+        uint64_t savedOversize = currentOversize;
+        currentSender = sender;
+        currentOversize = 0;
+        uint64_t n = 0;
+        const Range &range = ranges[part];
+        sessions.forEachIn(range.shard, range.begin, range.begin + fanoutPartition, [&](SessionHandle, const Session &session){
+            if(session.fd != neglectClient && enqueueFrame(session.outbox, frame)>0) n++;
+        });
+        oversize.fetch_add(currentOversize, memory_order_relaxed);
+        currentSender = saved;
+        currentOversize = savedOversize;
+        total.fetch_add(n, memory_order_relaxed);
+    });
+    currentOversize += oversize.load(memory_order_relaxed);
+    return total.load(memory_order_relaxed);
+}
+
+/*
+*  Functional Overloading for the broadcast function, first is the
+*  main function that is called when command is called,
+*  the second is for commond messages such as 'x joined the chat'
+*  There is no requirement for the two to be different but we just 
+*  felt like it does the same thing so we named them the same.
+*/
+
+/**
+ * @brief Broadcasts a message to all clients except the sender.
+ *
+ * @param neglectClient The file descriptor of the client whose message should be excluded from the broadcast.
+ * @param args The command arguments, i.e. the message to broadcast.
+ * @return int Returns 1 if the message is successfully broadcasted, otherwise returns -1.
+ *
+ * It retrieves the username associated with the sender's file descriptor and sends the message to every live session, 
+ * excluding the sender. The message is prefixed with the sender's username and encoded once; all recipients share that frame.
+ */
+int broadcast(int neglectClient, string_view args){
+    string_view body = skipSpaces(args);
+    if(body.empty()) return -1;
+
+    // encoded once, every recipient's queue shares the same buffer
+    SharedFrame frame;
+    if(!sessions.read(sessions.byFd(neglectClient), [&](const Session &session){
+        frame = makeSharedFrame({"[Broadcast from ", session.username, "]: ", body});
+    }) || !fitsFrameLimit(neglectClient, frame)) return -1;
+
+    currentFanout += fanOutToAll(frame, neglectClient);
+    return 1;
+}
+
+
+/**
+ * @brief Broadcasts a message to all clients except the sender.
+ *
+ * @param message A reference to the message string to be broadcasted.
+ * @param neglectClient A reference to the file descriptor of the client whose message should be excluded from the broadcast.
+ * @return int Returns 1 if the message is successfully broadcasted, otherwise returns -1.
+ *
+ * The function retrieves the username associated with the sender's file descriptor and sends the provided 
+ * `message` to every live session, excluding the sender. The message is prefixed with the sender's username.
+ */
+int broadcast(string &message, int &neglectClient){
+    string username = "";
+    getUsernameFromFD(neglectClient, username);
+
+    SharedFrame frame = makeSharedFrame(username + " " + message);
+
+    fanOutToAll(frame, neglectClient);
+    return 1;
+}
+
+
+/**
+ * @brief Creates a new group.
+ *
+ * @param client_fd A reference to the file descriptor of the client creating the group.
+ * @param args The command arguments, i.e. the group name.
+ * @return int Returns 1 if the group is successfully created, otherwise returns -1.
+ *
+ * The function extracts the group name from `args` and checks if it already exists in the group registry.
+ * If the group does not exist, it creates a new entry with the creator's session handle as the first member
+ * and records the group on the creator's session. Only the group's shard and the creator's session shard are locked.
+ * A confirmation message is then sent to the creator.
+ */
+int createGroup(int &client_fd, string_view args){
+    string_view groupName; 
+    if(getGroupname(args, groupName)<0) return -1;
+
+    SessionHandle handle = sessions.byFd(client_fd);
+    shared_ptr<Outbox> box;
+    if(!sessions.read(handle, [&](const Session &session){ box = session.outbox; })) return -1;
+
+    if(!groups.create(groupName, handle, box)) return -1;
+    if(!sessions.write(handle, [&](Session &session){ session.groups.emplace_back(groupName); })){
+        // disconnected meanwhile; don't leave a dead member behind
+        groups.leave(groupName, handle);
+        return -1;
+    }
+
+    enqueueFrame(client_fd, makeSharedFrame({"Group ", groupName, " Created."}));
+
+    return 1;
+}
+
+
+/**
+ * @brief Adds a client to an existing group.
+ *
+ * @param client_fd A reference to the file descriptor of the client joining the group.
+ * @param args The command arguments, i.e. the group name.
+ * @return int Returns 1 if the client successfully joins the group, otherwise returns -1.
+ *
+ * The function extracts the group name from `args` and checks if the group exists.
+ * If the group exists and the client is not already a member, the client's session handle is added to the group.
+ * A confirmation message is then sent to the client, followed by the group's recent history as one batch,
+ * both queued while the group is still locked so no live message can overtake the catch-up.
+ */
+int joinGroup(int &client_fd, string_view args){
+    string_view groupName; 
+    if(getGroupname(args, groupName)<0) return -1;
+
+    SessionHandle handle = sessions.byFd(client_fd);
+    shared_ptr<Outbox> box;
+    if(!sessions.read(handle, [&](const Session &session){ box = session.outbox; })) return -1;
+
+    if(groups.join(groupName, handle, box, [&](const Group &group){
+        pmr::vector<SharedFrame> catchUp(ScratchArena::local().resource());
+        catchUp.push_back(makeSharedFrame({"You joined the group ", groupName, "."}));
+        group.history.last(0, catchUp);
+        enqueueFrames(box, catchUp.data(), catchUp.size());
+    })<0) return -1;
+    if(!sessions.write(handle, [&](Session &session){ session.groups.emplace_back(groupName); })){
+        groups.leave(groupName, handle);
+        return -1;
+    }
+
+    return 1;
 }
 
 /**
  * @brief Removes a client from a specified group.
  *
- * @param client_fd A reference to the file descriptor of the client leaving the group.
- * @param argv A reference to a vector of strings containing the group name.
- * @return int Returns 1 if the client successfully leaves the group, otherwise returns -1.
+ * @param client_fd A reference to the file descriptor of the client leaving the group.
+ * @param args The command arguments, i.e. the group name.
+ * @return int Returns 1 if the client successfully leaves the group, otherwise returns -1.
+ *
+ * The function extracts the group name from `args` and checks if the group exists.
+ * If the group exists and the client is a member, the client's session handle is removed from the group.
+ * A confirmation message is then sent to the client.
+ */
+int leaveGroup(int &client_fd, string_view args){
+    string_view groupName; 
+    if(getGroupname(args, groupName)<0) return -1;
+
+    SessionHandle handle = sessions.byFd(client_fd);
+    if(!groups.leave(groupName, handle)) return -1;
+    sessions.write(handle, [&](Session &session){
+        auto it = find(session.groups.begin(), session.groups.end(), groupName);
+        if(it != session.groups.end()) session.groups.erase(it);
+    });
+
+    enqueueFrame(client_fd, makeSharedFrame({"You left the group ", groupName, "."}));
+
+    return 1;
+}
+
+
+/**
+ * @brief Sends a message to all members of a specified group except the sender.
+ *
+ * @param sender_fd A reference to the file descriptor of the client sending the message.
+ * @param args The command arguments: the group name followed by the message.
+ * @return int Returns 1 if the message is successfully sent, otherwise returns -1.
+ *
+ * The function extracts the group name from `args` and checks if the group exists; the rest is the message body,
+ * with its whitespace kept as typed.
+ * If the sender is a member of the group, the message is prefixed with the group name, encoded once into a shared frame,
+ * and queued to all group members except the sender.
+ * Members are stored with their outbound queues, so the fan-out only holds the group's shard lock (shared) and
+ * never resolves an fd; a member whose connection has closed has a closed queue and is skipped.
+ * The same frame is then kept in the group's history ring for `/history` and for members who join later.
+ */
+int groupMessage(int &sender_fd, string_view args){
+    string_view groupName = nextToken(args);
+    string_view body = skipSpaces(args);
+    if(groupName.empty() || body.empty()) return -1;
+
+    SessionHandle senderHandle = sessions.byFd(sender_fd);
+    SharedFrame frame = makeSharedFrame({"[Group ", groupName, "]: ", body});
+    if(!fitsFrameLimit(sender_fd, frame)) return -1;
+
+    bool isMember = false;
+    if(!groups.read(groupName, [&](const Group &group){
+        if(group.members.find(senderHandle)==group.members.end()) return;
+        isMember = true;
+
+        for(auto &member: group.members){
+            if(member.first == senderHandle) continue;
+            if(enqueueFrame(member.second, frame)>0) currentFanout++;
+        }
+        group.history.push(frame, historyMaxCount, historyMaxBytes);
+    })) return -1;
+    if(!isMember) return -1;
+
+    if(messageLog.isOpen()) messageLog.appendGroup(groupName, string_view(*frame).substr(FRAME_HEADER_SIZE));
+
+    return 1; 
+}
+
+/**
+ * @brief Sends a group member the group's recent messages.
+ *
+ * @param client_fd A reference to the file descriptor of the client asking for the history.
+ * @param args The command arguments: the group name, optionally followed by how many messages to send.
+ * @return int Returns 1 if the history was sent, otherwise returns -1 (no such group, or the client is not a member).
+ *
+ * A trailing number is taken as the count, so `/history g 10` sends the last 10 messages of group "g"; without it
+ * the whole history is sent. The messages are queued as one batch, which the reactor writes with a single call.
+ */
+int showHistory(int &client_fd, string_view args){
+    string_view groupName;
+    if(getGroupname(args, groupName)<0) return -1;
+
+    size_t n = 0;
+    size_t split = groupName.find_last_of(' ');
+    if(split != string_view::npos){
+        string_view count = groupName.substr(split + 1);
+        if(count.find_first_not_of("0123456789") == string_view::npos){
+            n = strtoul(string(count).c_str(), nullptr, 10);
+            groupName = groupName.substr(0, groupName.find_last_not_of(' ', split) + 1);
+            if(n == 0) return -1;
+        }
+    }
+
+    SessionHandle handle = sessions.byFd(client_fd);
+    pmr::vector<SharedFrame> frames(ScratchArena::local().resource());
+    bool isMember = false;
+    if(!groups.read(groupName, [&](const Group &group){
+        isMember = group.members.find(handle) != group.members.end();
+        if(isMember) group.history.last(n, frames);
+    }) || !isMember) return -1;
+
+    if(frames.empty()) frames.push_back(makeSharedFrame({"No messages in group ", groupName, " yet."}));
+    enqueueFrames(getOutbox(client_fd), frames.data(), frames.size());
+    return 1;
+}
+
+/**
+ * @brief Handles `/who`: lists the users online, and with `watch` or `unwatch` starts or stops presence updates.
+ *
+ * @param client_fd A reference to the file descriptor of the client asking.
+ * @param args Empty, `watch` or `unwatch`.
+ * @return int Returns 1 on success, otherwise returns -1 (an unknown argument, or unwatching without watching).
+ *
+ * The listing is the presence board's cached snapshot, shared as is with everyone who asks until someone
+ * logs in or out. `/who watch` also sends it, as the starting point for the "Presence: +a -b" updates
+ * that follow every PRESENCE_BATCH_MS while anything changes. The updates only hold changes made after that
+ * listing, so nothing is reported twice; a resumed session keeps watching.
+ */
+int whoCommand(int &client_fd, string_view args){
+    string_view mode = nextToken(args);
+    shared_ptr<Outbox> box = getOutbox(client_fd);
+    if(!box) return -1;
+
+    if(mode == "unwatch"){
+        if(!presence.unwatch(box.get())) return -1;
+        enqueueFrame(box, makeSharedFrame("Stopped watching presence."));
+        return 1;
+    }
+    if(mode == "watch"){
+        // queued under the board's lock, so no update can overtake it
+        presence.watch(box, [&](const Listing &listing){ enqueueFrames(box, listing->data(), listing->size()); });
+        return 1;
+    }
+    if(!mode.empty()) return -1;
+
+    Listing listing = presence.snapshot();
+    enqueueFrames(box, listing->data(), listing->size());
+    return 1;
+}
+
+/**
+ * @brief Handles `/members <group>`: lists a group's members to one of them.
+ *
+ * @param client_fd A reference to the file descriptor of the client asking.
+ * @param args The group name.
+ * @return int Returns 1 if the list was sent, otherwise returns -1 (no such group, or the client is not a member).
+ *
+ * The group keeps the listing it last built together with the membership version it was built for, so only
+ * the first `/members` after a join or leave resolves the member names; the rest share the same frames.
+ */
+int showMembers(int &client_fd, string_view args){
+    string_view groupName;
+    if(getGroupname(args, groupName)<0) return -1;
+
+    SessionHandle handle = sessions.byFd(client_fd);
+    Listing listing;
+    if(!groups.read(groupName, [&](const Group &group){
+        if(group.members.find(handle) == group.members.end()) return;
+        lock_guard<mutex> lock(group.roster.m);
+        if(!group.roster.frames || group.roster.version != group.version){
+            pmr::vector<pmr::string> names(ScratchArena::local().resource());
+            names.reserve(group.members.size());
+            for(auto &member : group.members)
+                sessions.read(member.first, [&](const Session &session){ names.emplace_back(session.username); });
+            sort(names.begin(), names.end());
+            group.roster.frames = buildListing("Members of " + string(groupName) + " (" + to_string(names.size()) + "): ", names);
+            group.roster.version = group.version;
+        }
+        listing = group.roster.frames;
+    }) || !listing) return -1;
+
+    enqueueFrames(getOutbox(client_fd), listing->data(), listing->size());
+    return 1;
+}
+
+/**
+ * @brief Parses a whole token as an unsigned decimal number.
+ *
+ * @return bool Returns true if `token` is nothing but digits and fits in 64 bits.
+ */
+bool parseNumber(string_view token, uint64_t &value){
+    if(token.empty()) return false;
+    auto [end, ec] = from_chars(token.data(), token.data() + token.size(), value);
+    return ec == errc() && end == token.data() + token.size();
+}
+
+/**
+ * @brief Starts (or resumes) an upload to a user or a group.
+ *
+ * @param client_fd A reference to the file descriptor of the sender.
+ * @param args The command arguments: the recipient (a username or a group name), the file name and its size in bytes.
+ * @return int Returns 1 if the upload was accepted, otherwise returns -1 (no spool, unknown recipient,
+ *             not a member of the group, a bad name, or a file over `--max-file-size`).
+ *
+ * The sender is told `/file_accept ID OFFSET CHUNK WINDOW TARGET NAME` and then sends the file as
+ * `/file_chunk ID OFFSET <bytes>` frames of at most CHUNK bytes, starting at OFFSET, with no more than WINDOW chunks
+ * unacknowledged. Asking again for the same recipient, name and size after a reconnect resumes the upload, so
+ * OFFSET is where the spool left off. A username wins over a group of the same name.
+ */
+int sendFile(int &client_fd, string_view args){
+    string_view target = nextToken(args);
+    string_view name = nextToken(args);
+    uint64_t size;
+    if(!fileSpool.isOpen() || !parseNumber(nextToken(args), size) || !skipSpaces(args).empty()) return -1;
+    if(target.empty() || name.empty() || name.find('/') != string_view::npos || name == "." || name == "..") return -1;
+
+    SessionHandle handle = sessions.byFd(client_fd);
+    string sender;
+    if(!sessions.read(handle, [&](const Session &session){ sender = session.username; })) return -1;
+
+    bool toGroup = !credentials.exists(target);
+    if(!toGroup && target == sender) return -1;
+    if(toGroup){
+        bool isMember = false;
+        if(!groups.read(target, [&](const Group &group){ isMember = group.members.find(handle) != group.members.end(); }) || !isMember) return -1;
+    }
+
+    shared_ptr<Outbox> box = getOutbox(client_fd);
+    if(!box) return -1;
+    uint32_t frameLimit;
+    {
+        lock_guard<mutex> lock(box->m);
+        frameLimit = box->frameLimit;
+    }
+    // the handshake guarantees at least MIN_FRAME_LIMIT, so there is always room for file bytes next to the command
+    size_t chunk = min<size_t>(FILE_CHUNK_SIZE, frameLimit - FILE_CHUNK_OVERHEAD);
+
+    shared_ptr<FileTransfer> transfer = fileSpool.begin(sender, target, toGroup, name, size, steadyNowMs());
+    if(!transfer) return -1;
+    uint64_t received;
+    {
+        lock_guard<mutex> lock(transfer->m);
+        received = transfer->received;
+    }
+
+    char head[FILE_CHUNK_OVERHEAD];
+    snprintf(head, sizeof(head), "/file_accept %llu %llu %zu %d ", (unsigned long long)transfer->id, (unsigned long long)received, chunk, FILE_WINDOW_CHUNKS);
+    enqueueFrame(box, makeSharedFrame({head, target, " ", name}));
+    return 1;
+}
+
+/**
+ * @brief Tells the recipient of a completed upload that the file is ready to download.
+ *
+ * A user gets `/file_offer ID SENDER SIZE NAME` like a DM, kept in the message log for later if they are offline;
+ * a group's members (other than the sender) get it if they are online.
+ */
+void offerFile(const FileTransfer &transfer){
+    char head[FILE_CHUNK_OVERHEAD];
+    snprintf(head, sizeof(head), "/file_offer %llu ", (unsigned long long)transfer.id);
+    char size[24];
+    snprintf(size, sizeof(size), " %llu ", (unsigned long long)transfer.size);
+    SharedFrame frame = makeSharedFrame({head, transfer.sender, size, transfer.name});
+
+    if(transfer.toGroup){
+        SessionHandle senderHandle = sessions.byName(transfer.sender);
+        groups.read(transfer.target, [&](const Group &group){
+            for(auto &member: group.members){
+                if(member.first == senderHandle) continue;
+                if(enqueueFrame(member.second, frame)>0) currentFanout++;
+            }
+        });
+        return;
+    }
+
+    if(messageLog.isOpen() && messageLog.appendDirect(transfer.target, string_view(*frame).substr(FRAME_HEADER_SIZE)) == 0) return;
+    shared_ptr<Outbox> recvBox;
+    sessions.read(sessions.byName(transfer.target), [&](const Session &session){ recvBox = session.outbox; });
+    if(enqueueFrame(recvBox, frame)>0) currentFanout++;
+}
+
+/**
+ * @brief Stores one chunk of an upload and acknowledges it.
+ *
+ * @param client_fd A reference to the file descriptor of the sender.
+ * @param args The command arguments: the transfer id, the chunk's offset, one space and the raw bytes.
+ * @return int Returns 1 if the chunk was stored or skipped as a repeat, otherwise returns -1.
+ *
+ * The sender is told `/file_ack ID RECEIVED` either way, so after a repeat or a gap it knows where to continue.
+ * The chunk that completes the file sends the recipients their offer.
+ */
+int fileChunk(int &client_fd, string_view args){
+    uint64_t id, offset;
+    if(!parseNumber(nextToken(args), id) || !parseNumber(nextToken(args), offset) || args.size() < 2) return -1;
+    string_view data = args.substr(1);
+
+    string sender;
+    if(!sessions.read(sessions.byFd(client_fd), [&](const Session &session){ sender = session.username; })) return -1;
+
+    uint64_t received;
+    shared_ptr<FileTransfer> transfer;
+    int r = fileSpool.write(id, sender, offset, data, steadyNowMs(), received, transfer);
+    if(r < 0) return -1;
+    if(r > 0) bump(metrics.fileBytesIn, data.size());
+
+    char ack[FILE_CHUNK_OVERHEAD];
+    snprintf(ack, sizeof(ack), "/file_ack %llu %llu", (unsigned long long)id, (unsigned long long)received);
+    enqueueFrame(client_fd, makeSharedFrame(string_view(ack)));
+    if(r < 2) return 1;
+
+    bump(metrics.filesUploaded);
+    offerFile(*transfer);
+    enqueueFrame(client_fd, makeSharedFrame({"File ", transfer->name, " sent to ", transfer->target, "."}));
+    return 1;
+}
+
+/**
+ * @brief Starts relaying a completed upload to a client that may see it.
+ *
+ * @param client_fd A reference to the file descriptor of the client asking for the file.
+ * @param args The command arguments: the transfer id, optionally followed by the offset to start from.
+ * @return int Returns 1 if the download started, otherwise returns -1 (unknown or unfinished transfer, or not
+ *             the sender, the recipient or a member of the recipient group).
+ *
+ * The client is told `/file_start ID SIZE OFFSET NAME`, and the file follows as `/file_data ID OFFSET <bytes>`
+ * frames, relayed by the client's reactor behind its chat traffic (see relayFiles()). Asking for a file that is
+ * already downloading restarts it from the new offset, which is how a client continues after a gap or a reconnect.
+ */
+int getFile(int &client_fd, string_view args){
+    uint64_t id, offset = 0;
+    if(!parseNumber(nextToken(args), id)) return -1;
+    string_view from = nextToken(args);
+    if((!from.empty() && !parseNumber(from, offset)) || !skipSpaces(args).empty()) return -1;
+
+    shared_ptr<FileTransfer> transfer = fileSpool.find(id);
+    if(!transfer || offset > transfer->size) return -1;
+
+    SessionHandle handle = sessions.byFd(client_fd);
+    string username;
+    if(!sessions.read(handle, [&](const Session &session){ username = session.username; })) return -1;
+    bool allowed = username == transfer->sender || (!transfer->toGroup && username == transfer->target);
+    if(!allowed && transfer->toGroup){
+        groups.read(transfer->target, [&](const Group &group){ allowed = group.members.find(handle) != group.members.end(); });
+    }
+    if(!allowed) return -1;
+    {
+        lock_guard<mutex> lock(transfer->m);
+        if(!transfer->complete) return -1;
+        transfer->touchedAt = steadyNowMs();
+    }
+
+    shared_ptr<Outbox> box = getOutbox(client_fd);
+    char head[FILE_CHUNK_OVERHEAD];
+    snprintf(head, sizeof(head), "/file_start %llu %llu %llu ", (unsigned long long)id, (unsigned long long)transfer->size, (unsigned long long)offset);
+    if(enqueueFrame(box, makeSharedFrame({head, transfer->name}))<0) return -1;
+
+    Reactor *owner = nullptr;
+    {
+        lock_guard<mutex> lock(box->m);
+        if(box->closed) return -1;
+        auto it = find_if(box->downloads.begin(), box->downloads.end(), [&](const FileStream &s){ return s.file == transfer; });
+        if(offset == transfer->size){
+            if(it != box->downloads.end()) box->downloads.erase(it);
+            return 1;
+        }
+        if(it != box->downloads.end()) it->offset = offset;
+        else box->downloads.push_back({transfer, offset});
+        if(!box->dirty && !box->parked){
+            box->dirty = true;
+            box->flushAt = 0;
+            box->owner->dirty.push(box);
+            owner = box->owner;
+        }
+    }
+    if(owner) wakeReactor(*owner);
+    return 1;
+}
+
+/*
+    Command execution functions: end
+*/
+
+
+/**
+ * @brief Handles errors by sending an error message to the client if a command fails.
+ *
+ * @param client_fd A reference to the file descriptor of the client receiving the error message.
+ * @param returnValue The return value of the executed command.
+ * @param errMessage A constant character pointer to the error message to be sent.
+ *
+ * If `returnValue` is negative, the function converts `errMessage` to a string and sends it to the client.
+ * Otherwise, it does nothing.
+ */
+void handleCommandFunctions(int &client_fd, int returnValue, const char* errMessage){
+    if(returnValue>=0) return;
+    string err = errMessage;
+    sendMessage(client_fd, err);
+    return;
+}
+
+/*
+*  Per-user rate limits, one token bucket per command class (see
+*  `TokenBucket`). A message costs one token per recipient it was queued
+*  for, so with `--rate-limit message 200` a user can reach 200 inboxes a
+*  second whether that takes 200 DMs or one broadcast to 200 users. Other
+*  classes cost one token per command. A rate of 0 leaves a class unlimited.
+*/
+enum class RateClass{
+    MESSAGE = 0,        // /msg, /broadcast, /group_msg, /send_file
+    MEMBERSHIP = 1,     // /create_group, /join_group, /leave_group
+    QUERY = 2,          // /stats, /history, /get_file, /who, /members
+    UNLIMITED = 3       // /exit, /file_chunk (an upload is paced by its window instead)
+};
+static_assert((int)RateClass::UNLIMITED == RATE_CLASSES, "every limited RateClass needs a bucket in Session");
+
+struct RateLimit{
+    double rate = 0;        // tokens per second
+    double burst = 0;       // bucket size
+};
+RateLimit rateLimits[RATE_CLASSES];
+
+/*
+*  The command table is the single list of every command the server knows:
+*  its name, enum value, handler, the error sent back when the handler
+*  fails and the rate limit class it is charged to. The lookup index below
+*  is a perfect hash generated from this list at compile time, so adding a
+*  command only means adding a row here.
+*/
+struct CommandDescriptor{
+    string_view name;
+    Commands command;
+    int (*handler)(int &client_fd, string_view args);
+    const char *errMessage;
+    RateClass rateClass;
+};
+
+/**
+ * @brief Adapts the `/broadcast` command to the handler signature used by the command table.
+ */
+int broadcastCommand(int &client_fd, string_view args){
+    return broadcast(client_fd, args);
+}
+
+/**
+ * @brief Handles `/exit`: drops the session's resume token, so the disconnect that follows ends the session instead of parking it.
+ */
+int exitCommand(int &client_fd, string_view args){
+    (void)args;
+    sessions.write(sessions.byFd(client_fd), [](Session &session){ session.resumeSecret[0] = session.resumeSecret[1] = 0; });
+    return 1;
+}
+
+int showStats(int &client_fd, string_view args);
+
+constexpr CommandDescriptor commandTable[] = {
+    {"/msg", Commands::MESSAGE, sendIndividualMessage, "Error: Check reciever name or message and try again", RateClass::MESSAGE},
+    {"/broadcast", Commands::BROADCAST, broadcastCommand, "Error: Check message and try again", RateClass::MESSAGE},
+    {"/create_group", Commands::CREATE_GROUP, createGroup, "Error: Check if group already exists and try again", RateClass::MEMBERSHIP},
+    {"/join_group", Commands::JOIN_GROUP, joinGroup, "Error: Check if group name already exist and try again", RateClass::MEMBERSHIP},
+    {"/group_msg", Commands::MESSAGE_GROUP, groupMessage, "Error: Check group name or message and try again", RateClass::MESSAGE},
+    {"/leave_group", Commands::LEAVE_GROUP, leaveGroup, "Error: Check if group name exists and try again", RateClass::MEMBERSHIP},
+    {"/stats", Commands::STATS, showStats, "Error: /stats is only available to admins", RateClass::QUERY},
+    {"/history", Commands::HISTORY, showHistory, "Error: Check group name or count and try again", RateClass::QUERY},
+    {"/exit", Commands::EXIT, exitCommand, "Error: Could not end the session", RateClass::UNLIMITED},
+    {"/send_file", Commands::SEND_FILE, sendFile, "Error: Could not send the file: check the receiver, file name and size and try again", RateClass::MESSAGE},
+    {"/file_chunk", Commands::FILE_CHUNK, fileChunk, "Error: Unknown file transfer or bad chunk", RateClass::UNLIMITED},
+    {"/get_file", Commands::GET_FILE, getFile, "Error: Check the file id and try again", RateClass::QUERY},
+    {"/who", Commands::WHO, whoCommand, "Error: Use /who, /who watch or /who unwatch", RateClass::QUERY},
+    {"/members", Commands::MEMBERS, showMembers, "Error: Check group name and try again", RateClass::QUERY}
+};
+constexpr size_t COMMAND_COUNT = sizeof(commandTable) / sizeof(commandTable[0]);
+static_assert(COMMAND_COUNT == COMMAND_KINDS, "every Commands value needs exactly one row in commandTable");
+#define COMMAND_SLOTS 64
+
+/**
+ * @brief Seeded FNV-1a hash of a command name, usable at compile time.
+ */
+constexpr uint32_t commandHash(string_view name, uint32_t seed){
+    uint32_t h = 2166136261u ^ seed;
+    for(char c : name){
+        h ^= (unsigned char)c;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/**
+ * @brief Finds (at compile time) a seed under which every command lands in its own slot.
+ */
+constexpr uint32_t findCommandSeed(){
+    for(uint32_t seed = 0; seed < 4096; seed++){
+        bool used[COMMAND_SLOTS] = {};
+        bool collision = false;
+        for(size_t i = 0; i < COMMAND_COUNT && !collision; i++){
+            uint32_t slot = commandHash(commandTable[i].name, seed) % COMMAND_SLOTS;
+            collision = used[slot];
+            used[slot] = true;
+        }
+        if(!collision) return seed;
+    }
+    return UINT32_MAX;
+}
+constexpr uint32_t commandSeed = findCommandSeed();
+static_assert(commandSeed != UINT32_MAX, "no perfect hash found for the command table, raise COMMAND_SLOTS");
+
+/**
+ * @brief Builds the slot -> command table index for `commandSeed`; empty slots hold -1.
+ */
+constexpr array<int8_t, COMMAND_SLOTS> buildCommandIndex(){
+    array<int8_t, COMMAND_SLOTS> index{};
+    for(auto &slot : index) slot = -1;
+    for(size_t i = 0; i < COMMAND_COUNT; i++) index[commandHash(commandTable[i].name, commandSeed) % COMMAND_SLOTS] = (int8_t)i;
+    return index;
+}
+constexpr array<int8_t, COMMAND_SLOTS> commandIndex = buildCommandIndex();
+
+/**
+ * @brief Checks if a command is valid and retrieves its descriptor.
+ *
+ * @param s The command name, e.g. "/msg".
+ * @param command Set to the command's descriptor.
+ * @return int Returns 1 if the command is valid, otherwise returns -1.
+ *
+ * One hash, one table probe and one string comparison; the table is immutable, so no lock is needed.
+ */
+int checkCommandValidity(string_view s, const CommandDescriptor* &command){
+    int8_t i = commandIndex[commandHash(s, commandSeed) % COMMAND_SLOTS];
+    if(i < 0 || commandTable[i].name != s) return -1;
+
+    command = &commandTable[i];
+
+    return 1;
+}
+
+/**
+ * @brief Routes incoming commands from the client to the appropriate handler function.
+ *
+ * @param client_fd A reference to the file descriptor of the client sending the command.
+ * @param incoming A reference to the string containing the client's command.
+ * @return int Returns 1 if the command is successfully processed, otherwise returns -1.
+ *
+ * The function slices the command name off the front of `incoming` (no copies), looks it up in the
+ * command table and calls its handler with the rest of the frame. If the command is invalid,
+ * or the sender's bucket for its rate class is empty, an error message is sent back to the client.
+ * With --capture every frame is first recorded, for replay_grp to play back.
+ */
+int handleCommandRouting(int &client_fd, string &incoming){
+    if(incoming.size()<1) return -1;
+    if(trafficCapture.isOpen()){
+        // taken as it arrived, so the trace holds invalid and rate-limited commands as well
+        string username;
+        if(sessions.read(sessions.byFd(client_fd), [&](const Session &session){ username = session.username; })) trafficCapture.frame(username, incoming, steadyNowNs());
+    }
+    string_view args = incoming;
+    string_view name = nextToken(args);
+    const CommandDescriptor *command;
+    if(name.empty() || checkCommandValidity(name, command)<0){
+        bump(metrics.invalidCommands);
+        string err = "Error: Invalid: Check and type the valid command";
+        sendMessage(client_fd, err);
+        return -1;
+    }
+
+    int rateClass = (int)command->rateClass;
+    bool limited = rateClass < RATE_CLASSES && rateLimits[rateClass].rate > 0;
+    SessionHandle handle;
+    if(limited){
+        const RateLimit &limit = rateLimits[rateClass];
+        bool allowed = true;
+        int64_t now = steadyNowNs();
+        handle = sessions.byFd(client_fd);
+        sessions.write(handle, [&](Session &session){ allowed = session.rateBuckets[rateClass].ready(limit.rate, limit.burst, now); });
+        if(!allowed){
+            bump(metrics.rateLimited);
+            string err = "Error: Rate limit exceeded, slow down and try again";
+            sendMessage(client_fd, err);
+            return -1;
+        }
+    }
+
+    CommandMetrics &stats = commandMetrics[(int)command->command];
+    currentFanout = 0;
+    currentOversize = 0;
+    auto started = chrono::steady_clock::now();
+    int result = command->handler(client_fd, args);
+    stats.latencyNs.record((uint64_t)chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - started).count());
+    bump(stats.requests);
+    if(result < 0) bump(stats.errors);
+    stats.fanout.record(currentFanout);
+    ScratchArena::local().rewind();
+
+    if(limited){
+        // the fan-out is only known now, so a wide broadcast is charged after the fact and leaves the bucket in debt
+        double cost = command->rateClass == RateClass::MESSAGE ? (double)max<uint64_t>(1, currentFanout) : 1;
+        sessions.write(handle, [&](Session &session){ session.rateBuckets[rateClass].charge(cost); });
+    }
+
+    handleCommandFunctions(client_fd, result, command->errMessage);
+    // only the sender of a message is told; a history catch-up just skips what the reader cannot take
+    if(currentOversize > 0 && command->rateClass == RateClass::MESSAGE){
+        string err = "Error: Message too large for " + to_string(currentOversize) + " recipient(s), not delivered to them";
+        sendMessage(client_fd, err);
+    }
+
+    return 1;
+}
+
+/**
+ * @brief Renders every counter and histogram as plaintext, one `name value` pair per line.
+ *
+ * @return string The report; used by both `/stats` and the admin port.
+ *
+ * All values are relaxed atomic loads, so the report is cheap and never blocks the data path,
+ * at the cost of counters being a few events apart from each other.
+ */
+string renderStats(){
+    ostringstream out;
+    auto uptime = chrono::duration_cast<chrono::seconds>(chrono::steady_clock::now() - metrics.started).count();
+    out << "uptime_seconds " << uptime << "\n";
+    out << "sessions " << sessions.size() << "\n";
+    out << "connections " << metrics.connections.load(memory_order_relaxed) << "\n";
+    out << "connections_accepted " << metrics.accepted.load(memory_order_relaxed) << "\n";
+    out << "connections_refused " << metrics.refused.load(memory_order_relaxed) << "\n";
+    out << "groups " << groups.size() << "\n";
+    out << "buffer_pool_bytes " << BufferPool::reservedBytes() << "\n";
+    out << "frames_in " << metrics.framesIn.load(memory_order_relaxed) << "\n";
+    out << "bytes_in " << metrics.bytesIn.load(memory_order_relaxed) << "\n";
+    out << "frames_out " << metrics.framesOut.load(memory_order_relaxed) << "\n";
+    out << "bytes_out " << metrics.bytesOut.load(memory_order_relaxed) << "\n";
+    out << "send_calls " << metrics.sendCalls.load(memory_order_relaxed) << "\n";
+    out << "frames_dropped " << metrics.framesDropped.load(memory_order_relaxed) << "\n";
+    out << "frames_oversize " << metrics.framesOversize.load(memory_order_relaxed) << "\n";
+    out << "slow_consumer_disconnects " << metrics.slowConsumers.load(memory_order_relaxed) << "\n";
+    out << "auth_failures " << metrics.authFailures.load(memory_order_relaxed) << "\n";
+    out << "invalid_commands " << metrics.invalidCommands.load(memory_order_relaxed) << "\n";
+    out << "rate_limited " << metrics.rateLimited.load(memory_order_relaxed) << "\n";
+    out << "auth_timeouts " << metrics.authTimeouts.load(memory_order_relaxed) << "\n";
+    out << "heartbeat_timeouts " << metrics.heartbeatTimeouts.load(memory_order_relaxed) << "\n";
+    out << "idle_timeouts " << metrics.idleTimeouts.load(memory_order_relaxed) << "\n";
+    out << "files_uploaded " << metrics.filesUploaded.load(memory_order_relaxed) << "\n";
+    out << "file_bytes_in " << metrics.fileBytesIn.load(memory_order_relaxed) << "\n";
+    out << "file_bytes_out " << metrics.fileBytesOut.load(memory_order_relaxed) << "\n";
+    if(messageLog.isOpen()) out << "log_pending_messages " << messageLog.pendingCount() << "\n";
+
+    for(auto &row : commandTable){
+        CommandMetrics &stats = commandMetrics[(int)row.command];
+        out << row.name << " requests " << stats.requests.load(memory_order_relaxed)
+            << " errors " << stats.errors.load(memory_order_relaxed)
+            << " latency_us p50 " << stats.latencyNs.percentile(0.50) / 1000
+            << " p99 " << stats.latencyNs.percentile(0.99) / 1000
+            << " p999 " << stats.latencyNs.percentile(0.999) / 1000
+            << " max " << stats.latencyNs.max() / 1000
+            << " fanout p50 " << stats.fanout.percentile(0.50)
+            << " p99 " << stats.fanout.percentile(0.99)
+            << " max " << stats.fanout.max() << "\n";
+    }
+    return out.str();
+}
+
+/**
+ * @brief Sends the stats report to an admin.
+ *
+ * @param client_fd A reference to the file descriptor of the client asking for stats.
+ * @param args Unused.
+ * @return int Returns 1 if the report was sent, otherwise returns -1 if the client is not in `admins`.
+ */
+int showStats(int &client_fd, string_view args){
+    (void)args;
+    bool isAdmin = false;
+    sessions.read(sessions.byFd(client_fd), [&](const Session &session){
+        isAdmin = admins.count(session.username) > 0;
+    });
+    if(!isAdmin) return -1;
+
+    string report = renderStats();
+    report.pop_back();
+    sendMessage(client_fd, report);
+    return 1;
+}
+
+/**
+ * @brief Serves `renderStats()` on 127.0.0.1:`port` to anything that connects, e.g. `curl` or `nc`.
+ *
+ * @param port The local admin port.
+ *
+ * Runs on its own thread with blocking sockets: the endpoint sees a handful of scrapes, not chat
+ * traffic, so it is kept off the reactor. The reply is a minimal HTTP/1.0 response, which plain
+ * `nc` shows as text as well.
+ */
+void serveAdminPort(int port){
+    int admin_fd = socket(AF_INET, SOCK_STREAM, 0);
+    int yes = 1;
+    setsockopt(admin_fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(port);
+    if(bind(admin_fd, (struct sockaddr*)&address, sizeof(address))<0 || listen(admin_fd, 4)<0){
+        logger.write(LogLevel::ERROR, "admin port %d failed: %s", port, strerror(errno));
+        close(admin_fd);
+        return;
+    }
+
+    while(true){
+        int client_fd = accept(admin_fd, nullptr, nullptr);
+        if(client_fd < 0){
+            if(errno != EINTR) logger.write(LogLevel::WARN, "admin accept failed: %s", strerror(errno));
+            continue;
+        }
+
+        // swallow the request line (if any) so closing does not reset the connection
+        timeval wait{0, 100000};
+        setsockopt(client_fd, SOL_SOCKET, SO_RCVTIMEO, &wait, sizeof(wait));
+        char request[1024];
+        if(recv(client_fd, request, sizeof(request), 0)<0 && errno != EAGAIN && errno != EWOULDBLOCK) logger.write(LogLevel::WARN, "admin recv failed: %s", strerror(errno));
+
+        string response = "HTTP/1.0 200 OK\r\nContent-Type: text/plain\r\n\r\n" + renderStats();
+        iovec iov{(void*)response.data(), response.size()};
+        writeAllv(client_fd, &iov, 1);
+        shutdown(client_fd, SHUT_WR);
+        close(client_fd);
+    }
+}
+
+/**
+ * @brief Group commit loop for the message log: every `logSyncMs` everything appended since the last pass is synced at once.
+ *
+ * A message is therefore durable at most `logSyncMs` after it was sent, while appending it costs only a memcpy.
+ */
+void runLogSync(){
+    while(true){
+        this_thread::sleep_for(chrono::milliseconds(logSyncMs));
+        messageLog.sync();
+    }
+}
+
+/**
+ * @brief Writes the traffic capture out every CAPTURE_FLUSH_MS, so a quiet server's trace is never far behind.
+ */
+void runCaptureFlush(){
+    while(true){
+        this_thread::sleep_for(chrono::milliseconds(CAPTURE_FLUSH_MS));
+        trafficCapture.flush();
+    }
+}
+
+/**
+ * @brief Sends `/who watch` subscribers the users who came online or went offline, batched every PRESENCE_BATCH_MS.
+ *
+ * A watcher whose queue turns out to be closed (or that was evicted as a slow consumer) stops watching.
+ */
+void runPresenceUpdates(){
+    vector<pair<shared_ptr<Outbox>, Listing>> updates;
+    while(true){
+        this_thread::sleep_for(chrono::milliseconds(PRESENCE_BATCH_MS));
+        if(!presence.takeUpdate(updates)) continue;
+        for(auto &[box, update] : updates)
+            if(enqueueFrames(box, update->data(), update->size())<0) presence.unwatch(box.get());
+        updates.clear();
+    }
+}
+
+
+/**
+ * @brief Gives the session on `client_fd` a fresh resume token and sends it as "Resume token: <hex>".
+ *
+ * The token is the session's handle followed by a random 128-bit secret, so a resume finds the session
+ * without any lookup table, and the handle's generation already rules out a token from an earlier session.
+ * Issuing a new token voids the previous one.
+ */
+void issueResumeToken(int client_fd){
+    if(resumeTtlSeconds <= 0) return;
+    SessionHandle handle = sessions.byFd(client_fd);
+    uint64_t secret[2];
+    if(getrandom(secret, sizeof(secret), 0) != (ssize_t)sizeof(secret)) return;
+    if(!sessions.write(handle, [&](Session &session){
+        session.resumeSecret[0] = secret[0];
+        session.resumeSecret[1] = secret[1];
+    })) return;
+
+    char token[3 * 16 + 1];
+    snprintf(token, sizeof(token), "%016llx%016llx%016llx",
+             (unsigned long long)handle.key(), (unsigned long long)secret[0], (unsigned long long)secret[1]);
+    string message = string("Resume token: ") + token;
+    sendMessage(client_fd, message);
+}
+
+/**
+ * @brief Splits a resume token into the session handle and the secret.
+ *
+ * @return int Returns 1 if `token` is well formed, otherwise returns -1.
+ */
+int parseResumeToken(string_view token, SessionHandle &handle, uint64_t secret[2]){
+    if(token.size() != 3 * 16 || token.find_first_not_of("0123456789abcdef") != string_view::npos) return -1;
+    string hex(token);
+    handle = SessionHandle::fromKey(strtoull(hex.substr(0, 16).c_str(), nullptr, 16));
+    secret[0] = strtoull(hex.substr(16, 16).c_str(), nullptr, 16);
+    secret[1] = strtoull(hex.substr(32, 16).c_str(), nullptr, 16);
+    return 1;
+}
+
+/**
+ * @brief Moves a parked session onto the connection `client_fd`.
+ *
+ * @param secret The resume token's secret, or nullptr when the user already gave their password.
+ * @param withToken Whether a new resume token is issued.
+ * @return int Returns 1 on success, otherwise returns -1 (the session is gone, not parked, or the secret is wrong).
+ *
+ * Nothing about the session is rebuilt: its groups still hold its outbound queue, which is simply rebound
+ * to the new socket with whatever was queued while the client was away. The welcome (and token) are
+ * queued on the new connection first, so the client sees them before the backlog.
+ */
+int attachSession(int client_fd, SessionHandle handle, const uint64_t *secret, bool withToken){
+    shared_ptr<Outbox> fresh = getOutbox(client_fd);
+    if(!fresh) return -1;
+    shared_ptr<Outbox> box = sessions.resume(handle, secret, client_fd);
+    if(!box) return -1;
+
+    string message = "Welcome back to the chat server !";
+    sendMessage(client_fd, message);
+    if(withToken) issueResumeToken(client_fd);
+    rebindOutbox(box, fresh);
+
+    string username;
+    sessions.read(handle, [&](const Session &session){ username = session.username; });
+    presence.online(username);
+    messageLog.drain(username, [&](string_view payload){ enqueueFrame(box, makeSharedFrame(payload)); });
+    return 1;
+}
+
+/**
+ * @brief Registers a freshly authenticated client and announces them to everyone else.
+ *
+ * @param client_fd A reference to the file descriptor of the authenticated client.
+ * @param username A reference to the authenticated username.
+ * @param withToken Whether the client is given a resume token.
+ * @return int Returns 1 on success, otherwise returns -1 if the same user logged in concurrently.
+ *
+ * Used by both the threaded `handle_client()` and the reactor once the password has been accepted.
+ * Any DMs the message log kept while the user was offline are queued right after the welcome.
+ * If the user's previous session is parked, the password is as good as its token and that session is resumed.
+ */
+int startSession(int &client_fd, string &username, bool withToken = false){
+    SessionHandle parked = sessions.byName(username);
+    if(parked.valid() && attachSession(client_fd, parked, nullptr, withToken) > 0) return 1;
+
+    if(addNewClient(client_fd, username)<0) return -1;
+
+    string message = "Welcome to the chat server !";
+    sendMessage(client_fd, message);
+    if(withToken) issueResumeToken(client_fd);
+    message = "has joined the chat.";
+    broadcast(message, client_fd);
+
+    // DMs that arrived while the user was offline, oldest first
+    messageLog.drain(username, [&](string_view payload){ enqueueFrame(client_fd, makeSharedFrame(payload)); });
+    return 1;
+}
+
+/**
+ * @brief Handles a one-frame login, sent by the client in place of the username.
+ *
+ * @param client_fd The connection the frame arrived on.
+ * @param frame The frame: `/login USER PASSWORD` or `/resume TOKEN`; anything else is a plain username.
+ * @param username Set to the logged-in user.
+ * @return int Returns 0 if the frame is a plain username, 1 if the session is running, 2 if a resume was
+ *             refused (the client may still log in on this connection), and -1 if the connection must be closed.
+ *
+ * Either form answers with the welcome and a new resume token, so a client that pipelines it behind
+ * its HELLO is logged in after a single round trip.
+ */
+int quickLogin(int client_fd, string &frame, string &username){
+    string_view args = frame;
+    string_view command = nextToken(args);
+    if(command == "/login"){
+        string name(nextToken(args)), password(nextToken(args));
+        int verdict = verifyCredentials(name, password);
+        if(verdict == -1){
+            string message = "Authentication failed. \n";
+            sendMessage(client_fd, message);
+        }
+        if(verdict < 0 || startSession(client_fd, name, true)<0) return -1;
+        username = name;
+        return 1;
+    }
+    if(command == "/resume"){
+        SessionHandle handle;
+        uint64_t secret[2];
+        if(parseResumeToken(nextToken(args), handle, secret)<0 || attachSession(client_fd, handle, secret, true)<0){
+            string message = "Resume failed.";
+            sendMessage(client_fd, message);
+            return 2;
+        }
+        sessions.read(handle, [&](const Session &session){ username = session.username; });
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * @brief Sets how long a blocking recv() on `fd` may wait (SO_RCVTIMEO); 0 waits forever.
+ */
+void setRecvTimeout(int fd, int64_t ms){
+    timeval tv{};
+    tv.tv_sec = ms / 1000;
+    tv.tv_usec = (ms % 1000) * 1000;
+    if(setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv))<0) logger.write(LogLevel::WARN, "SO_RCVTIMEO failed fd=%d: %s", fd, strerror(errno));
+}
+
+/**
+ * @brief Handles communication with a connected client.
+ *
+ * @param client_fd The file descriptor for the client connection.
+ *
+ * The function first exchanges HELLO frames to agree on the maximum frame size, then authenticates the client, adds them to the active client list, and sends a welcome message.
+ * It then continuously listens for incoming messages and processes them by routing commands or broadcasting messages.
+ * If the client disconnects or encounters an error, the function ensures proper cleanup.
+ */
+void handle_client(int client_fd) {
+    // the single flush-only reactor writes every threaded connection's queue
+    Reactor &flusher = *reactors[0];
+    openOutbox(client_fd, flusher);
+    epoll_event ev{};
+    ev.events = EPOLLOUT | EPOLLET;
+    ev.data.fd = client_fd;
+    if(epoll_ctl(flusher.epoll_fd, EPOLL_CTL_ADD, client_fd, &ev)<0) logger.write(LogLevel::ERROR, "epoll_ctl failed fd=%d: %s", client_fd, strerror(errno));
+
+    // no timer wheel here: the client's own thread waits with a receive timeout instead
+    setRecvTimeout(client_fd, authTimeoutSeconds * 1000LL);
+    FrameReader reader(maxFrameSize);
+    string hello = helloPayload(maxFrameSize);
+    sendMessage(client_fd, hello);
+    if(recvMessage(client_fd, reader, hello)<=0 || negotiateFrameSize(client_fd, hello, reader)<0){
+        disconnect(client_fd);
+        return;
+    }
+
+    string username = "";
+    int authenticated = Authenticate(client_fd, reader, username);
+    if(authenticated == -1){
+        disconnect(client_fd);
+        return;
+    }
+
+    if(authenticated == 1 && startSession(client_fd, username)<0){
+        disconnect(client_fd);
+        return;
+    }
+
+    // timeouts are checked whenever recv() wakes up, which is at least once per the shortest of them
+    int64_t now = steadyNowMs();
+    Liveness live{now, now, now, 0};
+    int64_t checkEvery = 0;
+    for(int seconds : {pingIntervalSeconds, pongTimeoutSeconds, idleTimeoutSeconds}){
+        if(seconds > 0 && (checkEvery == 0 || seconds < checkEvery)) checkEvery = seconds;
+    }
+    setRecvTimeout(client_fd, pingIntervalSeconds > 0 || idleTimeoutSeconds > 0 ? checkEvery * 1000 : 0);
+
+    currentSender = client_fd;
+    string incoming;
+    while(true){
+        int64_t due;
+        if(applyLiveness(client_fd, checkLiveness(live, true, steadyNowMs(), due))<0){
+            disconnect(client_fd);
+            return;
+        }
+        int r = recvMessage(client_fd, reader, incoming);
+        if(r < 0) {
+            disconnect(client_fd);
+            return;
+        }
+        if(r == 0) continue;
+
+        live.heardAt = steadyNowMs();
+        if(incoming == "/pong") continue;
+        live.commandAt = live.heardAt;
+        handleCommandRouting(client_fd, incoming);
+        waitUntilResumed(client_fd);
+    }
+}
+
+/*
+    epoll reactor: start
+*/
+
+/**
+ * @brief Puts a file descriptor into non-blocking mode.
+ *
+ * @param fd The file descriptor to modify.
+ * @return int Returns 1 on success, otherwise returns -1.
+ */
+int setNonBlocking(int fd){
+    int flags = fcntl(fd, F_GETFL, 0);
+    if(flags<0) return -1;
+    if(fcntl(fd, F_SETFL, flags | O_NONBLOCK)<0) return -1;
+    return 1;
+}
+
+/**
+ * @brief Raises the soft open-file limit to the hard limit so the reactor can hold tens of thousands of sockets.
+ *
+ * @return size_t The open-file limit now in effect, which bounds every fd the server will see.
+ */
+size_t raiseFileLimit(){
+    rlimit rl;
+    if(getrlimit(RLIMIT_NOFILE, &rl)<0) return 1024;
+    rl.rlim_cur = rl.rlim_max;
+    if(setrlimit(RLIMIT_NOFILE, &rl)<0){
+        logger.write(LogLevel::WARN, "setrlimit failed: %s", strerror(errno));
+        getrlimit(RLIMIT_NOFILE, &rl);
+    }
+    return rl.rlim_cur == RLIM_INFINITY ? 1 << 20 : rl.rlim_cur;
+}
+
+/**
+ * @brief Drops the reactor's state for a connection and runs the usual `disconnect()` cleanup.
+ *
+ * @param client_fd The file descriptor of the connection to close.
+ *
+ * Closing the fd also removes it from the epoll interest list. On an io_uring reactor the outstanding
+ * recv holds its own reference to the socket, so it is cancelled as well or the socket would stay open.
+ * The connection's timer is cancelled, so it cannot fire for whoever gets the fd next.
+ */
+void closeConnection(int client_fd){
+    auto it = currentReactor->connections.find(client_fd);
+    if(it != currentReactor->connections.end()){
+        currentReactor->timers.cancel(it->second.timer);
+#ifdef USE_IO_URING
+        if(it->second.recv == RecvState::ARMED) cancelRingRecv(*currentReactor, it->second);
+#endif
+        currentReactor->connections.erase(it);
+    }
+    disconnect(client_fd);
+}
+
+/**
+ * @brief Runs a connection's timeouts and re-arms its timer for the next one.
+ *
+ * @param reactor The reactor that owns the connection.
+ * @param conn The connection; it is erased if it ran out of time.
+ * @return int Returns 1 if the connection stays open, otherwise returns -1.
+ *
+ * Each connection has at most one timer, set to the earliest of its deadlines. Frames only update
+ * `conn.live`; nothing is re-armed per frame, and a timer that fires early just finds a later deadline.
+ */
+int checkConnectionTimer(Reactor &reactor, Connection &conn){
+    int client_fd = conn.fd;
+    reactor.timers.cancel(conn.timer);
+    int64_t due;
+    LivenessVerdict verdict = checkLiveness(conn.live, conn.state == ConnState::ACTIVE, reactor.nowMs, due);
+    if(applyLiveness(client_fd, verdict)<0){
+        closeConnection(client_fd);
+        return -1;
+    }
+    if(due >= 0) conn.timer = reactor.timers.arm(due, (uint64_t)client_fd);
+    return 1;
+}
+
+/**
+ * @brief Runs a reactor's timer wheel up to the start of the current pass and checks every connection that fell due.
+ */
+void runConnectionTimers(Reactor &reactor){
+    reactor.timers.advance(reactor.nowMs, [&](uint64_t key){
+        auto it = reactor.connections.find((int)key);
+        if(it == reactor.connections.end()) return;
+        it->second.timer = TimerHandle{};
+        checkConnectionTimer(reactor, it->second);
+    });
+}
+
+/**
+ * @brief How long a reactor may block: until its earliest held-back queue or timer, 0 while it still has
+ *        connections to accept, or -1 for no limit (ns).
+ */
+int64_t reactorWaitNs(Reactor &reactor, int64_t nextFlush){
+    if(reactor.acceptPending || !reactor.streaming.empty()) return 0;
+    int64_t due = nextFlush;
+    int64_t timer = reactor.timers.nextDueMs();
+    if(timer >= 0 && (due < 0 || timer * 1000000 < due)) due = timer * 1000000;
+    if(due < 0) return -1;
+    return max<int64_t>(0, due - steadyNowNs());
+}
+
+/**
+ * @brief Hands a connection's credentials to the verifier pool and holds its frames until the verdict is in.
+ *
+ * @param conn The connection; it is VERIFYING until `finishLogin()` runs on its reactor.
+ * @param withToken Whether the login came as a one-frame `/login`, which is answered with a resume token.
+ *
+ * The PBKDF2 hash takes milliseconds, so it runs on a worker and the verdict comes back through the
+ * reactor's `verified` queue, the same way a resumed sender does through `resumed`.
+ */
+void requestVerification(Connection &conn, string username, string password, bool withToken){
+    Reactor &reactor = *currentReactor;
+    conn.state = ConnState::VERIFYING;
+    conn.ticket = ++reactor.nextTicket;
+    LoginVerdict result;
+    result.fd = conn.fd;
+    result.ticket = conn.ticket;
+    result.username = move(username);
+    result.withToken = withToken;
+    verifierPool.submit([&reactor, result = move(result), password = move(password)]() mutable {
+        result.verdict = verifyCredentials(result.username, password);
+        reactor.verified.push(move(result));
+        wakeReactor(reactor);
+    });
+}
+
+/**
+ * @brief Finishes a login once its password check is back on the connection's reactor.
+ *
+ * @param reactor The reactor that owns the connection.
+ * @param result The verdict; it is dropped if the connection was closed in the meantime (the fd may be reused).
+ * @return int Returns 1 if the connection is logged in and its buffered frames can be dispatched, otherwise -1.
+ */
+int finishLogin(Reactor &reactor, LoginVerdict &result){
+    auto it = reactor.connections.find(result.fd);
+    if(it == reactor.connections.end() || it->second.state != ConnState::VERIFYING || it->second.ticket != result.ticket) return -1;
+    Connection &conn = it->second;
+    int client_fd = conn.fd;
+    currentSender = client_fd;
+    if(result.verdict == -1){
+        string message = "Authentication failed. \n";
+        sendMessage(client_fd, message);
+    }
+    if(result.verdict < 0 || startSession(client_fd, result.username, result.withToken)<0){
+        closeConnection(client_fd);
+        return -1;
+    }
+    conn.username = result.username;
+    conn.state = ConnState::ACTIVE;
+    // the login deadline is over; heartbeats and the idle timeout start
+    return checkConnectionTimer(reactor, conn);
+}
+
+/**
+ * @brief Advances a connection's state machine by one received message.
+ *
+ * @param conn A reference to the connection the message arrived on.
+ * @param incoming A reference to the received message.
+ * @return int Returns 1 if the connection should stay open, otherwise returns -1.
+ *
+ * The first message must be the client's HELLO. While authenticating, the message is treated as the username or password answer, mirroring the prompts
+ * of `Authenticate()`; a `/login` or `/resume` frame in place of the username logs in directly (see `quickLogin()`). Once the connection is ACTIVE the message is handed to `handleCommandRouting()`.
+ * Passwords, including the one in `/login`, are checked by the verifier pool; the login is finished by `finishLogin()`.
+ */
+int handleConnectionMessage(Connection &conn, string &incoming){
+    string prompt;
+    currentSender = conn.fd;
+    switch(conn.state){
+        case ConnState::HANDSHAKE:
+            if(negotiateFrameSize(conn.fd, incoming, conn.reader)<0) return -1;
+            conn.state = ConnState::AUTH_USERNAME;
+            return 1;
+        case ConnState::AUTH_USERNAME:{
+            string_view args = incoming;
+            if(nextToken(args) == "/login"){
+                string name(nextToken(args)), password(nextToken(args));
+                requestVerification(conn, name, password, true);
+                return 1;
+            }
+            int quick = quickLogin(conn.fd, incoming, conn.username);
+            if(quick == 1) conn.state = ConnState::ACTIVE;
+            if(quick != 0) return quick < 0 ? -1 : 1;
+            conn.username = incoming;
+            prompt = "Enter password: ";
+            sendMessage(conn.fd, prompt);
+            conn.state = ConnState::AUTH_PASSWORD;
+            return 1;
+        }
+        case ConnState::AUTH_PASSWORD:
+            requestVerification(conn, conn.username, incoming, false);
+            return 1;
+        case ConnState::VERIFYING:
+            // dispatchFrames() holds frames back until the verdict is in
+            return 1;
+        case ConnState::ACTIVE:
+            // a pong only proves the connection is alive, which dispatchFrames() has already noted
+            if(incoming == "/pong") return 1;
+            conn.live.commandAt = currentReactor->nowMs;
+            handleCommandRouting(conn.fd, incoming);
+            return 1;
+    }
+    return -1;
+}
+
+/**
+ * @brief Dispatches every complete frame in a connection's reassembly buffer, one by one.
+ *
+ * @param conn The connection; it is erased if this closes it.
+ * @param box The connection's outbound queue.
+ * @return int Returns 1 once no complete frame is left, 0 if a command left the connection paused by a
+ *             full recipient queue or waiting for its password check (the remaining frames stay buffered),
+ *             and -1 if the connection was closed.
+ */
+int dispatchFrames(Connection &conn, Outbox &box){
+    int client_fd = conn.fd;
+    // one payload buffer per reactor thread, reused for every frame so its capacity is only ever grown once
+    thread_local string incoming;
+    int r = 0;
+    while(box.pauseCount <= 0 && conn.state != ConnState::VERIFYING && (r = conn.reader.next(incoming)) == 1){
+        bump(metrics.framesIn);
+        bump(metrics.bytesIn, FRAME_HEADER_SIZE + incoming.size());
+        logIncoming(client_fd, incoming, conn.state == ConnState::AUTH_PASSWORD);
+        conn.live.heardAt = currentReactor->nowMs;
+        bool loggedIn = conn.state == ConnState::ACTIVE;
+        if(handleConnectionMessage(conn, incoming)<0){
+            closeConnection(client_fd);
+            return -1;
+        }
+        // the login deadline is over; heartbeats and the idle timeout start
+        if(!loggedIn && conn.state == ConnState::ACTIVE && checkConnectionTimer(*currentReactor, conn)<0) return -1;
+    }
+    if(box.pauseCount > 0 || conn.state == ConnState::VERIFYING) return 0;
+    if(r < 0){
+        logger.write(LogLevel::WARN, "frame exceeds the negotiated size, dropping fd=%d", client_fd);
+        closeConnection(client_fd);
+        return -1;
+    }
+    return 1;
+}
+
+/**
+ * @brief Drains a readable connection until the kernel reports EAGAIN.
+ *
+ * @param client_fd The file descriptor that became readable.
  *
- * The function extracts the group name from `argv` and checks if the group exists.
- * If the group exists and the client is a member, the client's file descriptor is removed from the group.
- * A confirmation message is then sent to the client.
+ * Because the sockets are registered edge-triggered, every readiness notification must be consumed
+ * completely. Bytes go into the connection's reassembly buffer and every complete frame is dispatched,
+ * so several pipelined commands in one segment are handled one by one.
+ * If a command leaves the connection paused by a full recipient queue, reading stops with the
+ * remaining frames left buffered; the reactor calls this again once the sender is resumed.
  */
-int leaveGroup(int &client_fd, vector<string> &argv){
-    lock_guard<mutex> lock(client_mutex);
+void readConnection(int client_fd){
+    auto it = currentReactor->connections.find(client_fd);
+    if(it == currentReactor->connections.end()) return;
+    Connection &conn = it->second;
+    auto box = getOutbox(client_fd);
+    if(!box) return;
 
-    string groupName; 
-    if(getGroupname(argv, groupName)<0) return -1;
-    if(groups.find(groupName)==groups.end()) return -1;
-    if(groups[groupName].find(client_fd)==groups[groupName].end()) return -1;
+    while(true){
+        if(dispatchFrames(conn, *box) <= 0) return;
 
-    groups[groupName].erase(client_fd);
+        ssize_t bytesReceived = conn.reader.readFrom(client_fd);
+        if(bytesReceived == 0){
+            logger.write(LogLevel::INFO, "client disconnected fd=%d", client_fd);
+            closeConnection(client_fd);
+            return;
+        }
+        if(bytesReceived < 0){
+            if(errno == EAGAIN || errno == EWOULDBLOCK) return;
+            if(errno == EINTR) continue;
+            logger.write(LogLevel::WARN, "recv failed fd=%d: %s", client_fd, strerror(errno));
+            closeConnection(client_fd);
+            return;
+        }
+    }
+}
 
-    string finalMessage = "You left the group " + groupName + ".";
-    sendMessage(client_fd, finalMessage);
+/**
+ * @brief Adopts a freshly accepted socket into a reactor.
+ *
+ * @param reactor The reactor that accepted it.
+ * @param client_fd The new socket.
+ * @return Connection* The connection's state, or nullptr if it could not be registered (the fd is closed).
+ *
+ * The socket gets an outbound queue, is registered edge-triggered for both reads and writes on an
+ * epoll reactor, and is sent the HELLO frame followed by the username prompt.
+ * The connection stays on this reactor for its whole life.
+ */
+Connection* registerConnection(Reactor &reactor, int client_fd){
+    openOutbox(client_fd, reactor);
+#ifdef USE_IO_URING
+    if(!reactor.ring)
+#endif
+    {
+        epoll_event ev{};
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.fd = client_fd;
+        if(epoll_ctl(reactor.epoll_fd, EPOLL_CTL_ADD, client_fd, &ev)<0){
+            logger.write(LogLevel::ERROR, "epoll_ctl failed fd=%d: %s", client_fd, strerror(errno));
+            closeOutbox(client_fd);
+            close(client_fd);
+            return nullptr;
+        }
+    }
 
-    return 1;
+    Connection &conn = reactor.connections[client_fd];
+    conn = Connection{client_fd, ConnState::HANDSHAKE, "", FrameReader(maxFrameSize), Liveness{reactor.nowMs, reactor.nowMs, reactor.nowMs, 0}, TimerHandle{}};
+    string prompt = helloPayload(maxFrameSize);
+    sendMessage(client_fd, prompt);
+    prompt = "Enter username: ";
+    sendMessage(client_fd, prompt);
+    if(checkConnectionTimer(reactor, conn)<0) return nullptr;
+    return &conn;
 }
 
-
 /**
- * @brief Sends a message to all members of a specified group except the sender.
+ * @brief Accepts up to ACCEPT_BATCH pending connections on a reactor's listening socket and registers them with that reactor.
  *
- * @param sender_fd A reference to the file descriptor of the client sending the message.
- * @param argv A reference to a vector of strings containing the group name and the message.
- * @return int Returns 1 if the message is successfully sent, otherwise returns -1.
+ * @param reactor The reactor whose (non-blocking, SO_REUSEPORT) listening socket is readable.
+ * @return bool Returns true if the batch ran out before the accept queue did.
  *
- * The function extracts the group name from `argv` and checks if the group exists.
- * If the sender is a member of the group, the message is prefixed with the group name and broadcasted to all group members except the sender.
+ * The listening socket is edge-triggered, so the reactor keeps calling this once per pass of its loop
+ * until accept4() runs dry; in between it serves its connections, so a connect flood cannot starve them.
+ * A connection over one of the admission caps is refused on the spot.
  */
-int groupMessage(int &sender_fd, vector<string> &argv){
-    if(argv.size()<3) return -1;
-
-    lock_guard<mutex> lock(client_mutex);
+bool acceptConnections(Reactor &reactor){
+    for(int accepted = 0; accepted < ACCEPT_BATCH; accepted++){
+        sockaddr_in clientAddr;
+        socklen_t client_addr_len = sizeof(clientAddr);
+        int client_fd = accept4(reactor.listen_fd, (struct sockaddr*)&clientAddr, &client_addr_len, SOCK_NONBLOCK);
+        if(client_fd < 0){
+            if(errno == EAGAIN || errno == EWOULDBLOCK) return false;
+            if(errno == EINTR || errno == ECONNABORTED) continue;
+            logger.write(LogLevel::WARN, "accept failed: %s", strerror(errno));
+            return false;
+        }
+        if(admitConnection(client_fd, clientAddr.sin_addr.s_addr)<0){
+            refuseConnection(client_fd);
+            continue;
+        }
+        registerConnection(reactor, client_fd);
+    }
+    return true;
+}
 
-    string groupName = argv[1];
-    if(groups.find(groupName)==groups.end()) return -1;
-    if(groups[groupName].find(sender_fd)==groups[groupName].end()) return -1;
+/**
+ * @brief Opens a listening socket on `port` that other reactors can bind too (SO_REUSEPORT).
+ *
+ * @return int The listening socket, or -1 on failure.
+ *
+ * With one such socket per reactor the kernel spreads incoming connections over the reactors,
+ * so accepting never funnels through a single thread.
+ */
+int createListener(int port){
+    int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if(listen_fd < 0){
+        perror("Socket failed");
+        return -1;
+    }
+    int yes = 1;
+    if(setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes))<0 ||
+       setsockopt(listen_fd, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes))<0){
+        perror("setsockopt failed");
+        close(listen_fd);
+        return -1;
+    }
 
-    string message = "";
-    for(long unsigned int i=2;i<argv.size();i++){
-        message += (argv[i] + " ");
+    sockaddr_in address{};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = INADDR_ANY;
+    address.sin_port = htons(port);
+    if(bind(listen_fd, (struct sockaddr*)&address, sizeof(address))<0){
+        perror("Bind failed");
+        close(listen_fd);
+        return -1;
     }
-    message = "[Group " + groupName + "]: " + message;
+    if(listen(listen_fd, listenBacklog)<0){
+        perror("Listen failed");
+        close(listen_fd);
+        return -1;
+    }
+    return listen_fd;
+}
 
+/**
+ * @brief Creates a reactor's epoll instance and the eventfd other threads use to wake it.
+ *
+ * @param reactor The reactor to set up; its `listen_fd` (if any) is registered too.
+ * @return int Returns 1 on success, otherwise returns -1.
+ */
+int setupReactor(Reactor &reactor){
+    reactor.nowMs = steadyNowMs();
+    reactor.timers.start(reactor.nowMs);
+    reactor.epoll_fd = epoll_create1(0);
+    reactor.wake_fd = eventfd(0, EFD_NONBLOCK);
+    if(reactor.epoll_fd < 0 || reactor.wake_fd < 0){
+        perror("reactor setup failed");
+        return -1;
+    }
 
-    for(auto recv_fd: groups[groupName]){
-        if(recv_fd == sender_fd) continue;
-        sendMessage(recv_fd, message);
+    epoll_event ev{};
+    ev.events = EPOLLIN;
+    ev.data.fd = reactor.wake_fd;
+    if(epoll_ctl(reactor.epoll_fd, EPOLL_CTL_ADD, reactor.wake_fd, &ev)<0){
+        perror("epoll_ctl failed");
+        return -1;
     }
 
-    return 1; 
+    if(reactor.listen_fd >= 0){
+        if(setNonBlocking(reactor.listen_fd)<0){
+            perror("fcntl failed");
+            return -1;
+        }
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.fd = reactor.listen_fd;
+        if(epoll_ctl(reactor.epoll_fd, EPOLL_CTL_ADD, reactor.listen_fd, &ev)<0){
+            perror("epoll_ctl failed");
+            return -1;
+        }
+    }
+    return 1;
 }
 
+#ifdef USE_IO_URING
 /*
-    Command execution functions: end
+    io_uring reactor: start
 */
 
+/*
+*  With --io-uring a reactor drives its sockets through one io_uring instead
+*  of epoll: a multishot accept on its listening socket, a multishot recv per
+*  connection that takes a buffer from the reactor's provided-buffer ring only
+*  when data arrives, and one SENDMSG per queue with frames to write. A fan-out
+*  to thousands of connections therefore only fills the submission queue; the
+*  loop submits the whole batch, and waits for the next completions, in a
+*  single io_uring_enter(). Wakeups and MPSC handovers work as on epoll.
+*/
+#define URING_ENTRIES 4096
+#define URING_BUFFER_GROUP 0
+#define URING_BUFFERS 256               // provided receive buffers per reactor, READ_CHUNK_SIZE bytes each
+#define RING_OP_BITS 3
+#define RECV_TAG_MASK ((1u << 29) - 1)  // a recv's user_data holds the op, the fd and this much of the tag
+
+enum class RingOp : uint64_t{
+    WAKE = 0,
+    ACCEPT = 1,
+    RECV = 2,
+    SEND = 3,
+    CANCEL = 4
+};
+
+uint64_t ringData(RingOp op, uint64_t value){
+    return value << RING_OP_BITS | (uint64_t)op;
+}
+
+uint64_t recvData(const Connection &conn){
+    return ringData(RingOp::RECV, (uint64_t)conn.tag << 32 | (uint32_t)conn.fd);
+}
+
+// One in-flight SENDMSG; it holds the queue and the frames until the kernel is done with them
+struct RingSend : Pooled{
+    shared_ptr<Outbox> box;
+    uint64_t binding;                   // the queue's binding when submitted; a different one means another socket
+    SharedFrame frames[WRITE_BATCH];
+    iovec iov[WRITE_BATCH];
+    msghdr msg{};
+};
 
 /**
- * @brief Handles errors by sending an error message to the client if a command fails.
+ * @brief Queues a multishot accept on the reactor's listening socket.
  *
- * @param client_fd A reference to the file descriptor of the client receiving the error message.
- * @param returnValue The return value of the executed command.
- * @param errMessage A constant character pointer to the error message to be sent.
+ * @return int Returns 1 on success, otherwise returns -1 (submission queue full).
+ */
+int armRingAccept(Reactor &reactor){
+    io_uring_sqe *sqe = reactor.ring->getSqe();
+    if(!sqe) return -1;
+    Uring::prepMultishotAccept(sqe, reactor.listen_fd);
+    sqe->user_data = ringData(RingOp::ACCEPT, 0);
+    return 1;
+}
+
+/**
+ * @brief Queues a multishot poll on the reactor's eventfd, so wakeups from other threads end the wait.
  *
- * If `returnValue` is negative, the function converts `errMessage` to a string and sends it to the client.
- * Otherwise, it does nothing.
+ * @return int Returns 1 on success, otherwise returns -1 (submission queue full).
  */
-void handleCommandFunctions(int &client_fd, int returnValue, const char* errMessage){
-    if(returnValue>=0) return;
-    string err = errMessage;
-    sendMessage(client_fd, err);
-    return;
+int armRingWake(Reactor &reactor){
+    io_uring_sqe *sqe = reactor.ring->getSqe();
+    if(!sqe) return -1;
+    Uring::prepMultishotPoll(sqe, reactor.wake_fd, POLLIN);
+    sqe->user_data = ringData(RingOp::WAKE, 0);
+    return 1;
 }
 
 /**
- * @brief Routes incoming commands from the client to the appropriate handler function.
+ * @brief Queues a multishot recv for a connection.
  *
- * @param client_fd A reference to the file descriptor of the client sending the command.
- * @param incoming A reference to the string containing the client's command.
- * @return int Returns 1 if the command is successfully processed, otherwise returns -1.
+ * @return int Returns 1 on success, otherwise returns -1 (submission queue full).
+ */
+int armRingRecv(Reactor &reactor, Connection &conn){
+    io_uring_sqe *sqe = reactor.ring->getSqe();
+    if(!sqe) return -1;
+    Uring::prepMultishotRecv(sqe, conn.fd, URING_BUFFER_GROUP);
+    sqe->user_data = recvData(conn);
+    conn.recv = RecvState::ARMED;
+    return 1;
+}
+
+/**
+ * @brief Cancels a connection's outstanding recv; its final completion arrives with -ECANCELED.
  *
- * The function parses the incoming command string, checks if it's valid, and calls the corresponding handler function.
- * If the command is invalid, an error message is sent back to the client.
- * The function handles different types of commands such as direct messages, broadcasting, group creation, group joining, 
- * leaving a group, and sending group messages.
+ * If not even a cancel fits in the submission queue, the read side of the socket is shut down instead,
+ * which also ends the recv.
  */
-int handleCommandRouting(int &client_fd, string &incoming){
-    if(incoming.size()<1) return -1;
-    vector<string> parsedString = split(incoming, " ");
-    Commands command;
-    if(parsedString.size()<1 || checkCommandValidity(parsedString[0],command)<0){
-        string err = "Error: Invalid: Check and type the valid command";
-        sendMessage(client_fd, err);
-        return -1;
+void cancelRingRecv(Reactor &reactor, Connection &conn){
+    conn.recv = RecvState::CANCELLING;
+    io_uring_sqe *sqe = reactor.ring->getSqe();
+    if(!sqe){
+        shutdown(conn.fd, SHUT_RD);
+        return;
     }
+    Uring::prepCancel(sqe, recvData(conn));
+    sqe->user_data = ringData(RingOp::CANCEL, 0);
+}
 
-    switch(command){
-        case Commands::MESSAGE:
-            handleCommandFunctions(
-                client_fd,
-                sendIndividualMessage(client_fd, parsedString),
-                "Error: Check reciever name or message and try again"
-            );
-            break;
-        case Commands::BROADCAST:
-            handleCommandFunctions(
-                client_fd,
-                broadcast(client_fd, parsedString),
-                "Error: Check message and try again"
-            );
-            break;
-        case Commands::CREATE_GROUP:
-            handleCommandFunctions(
-                client_fd,
-                createGroup(client_fd, parsedString),
-                "Error: Check if group already exists and try again"
-            );
-            break;
-        case Commands::JOIN_GROUP:
-            handleCommandFunctions(
-                client_fd,
-                joinGroup(client_fd, parsedString),
-                "Error: Check if group name already exist and try again"
-            );
-            break;
-        case Commands::LEAVE_GROUP:
-            handleCommandFunctions(
-                client_fd,
-                leaveGroup(client_fd, parsedString),
-                "Error: Check if group name exists and try again"
-            );
-            break;
-        case Commands::MESSAGE_GROUP:
-            handleCommandFunctions(
-                client_fd,
-                groupMessage(client_fd, parsedString),
-                "Error: Check group name or message and try again"
-            );
-            break;
-        default:
-            break;
+/**
+ * @brief Queues one SENDMSG covering the front of a queue, unless one is already in flight.
+ *
+ * @param box The queue to write out; the caller holds its lock.
+ * @return int Returns 1 on success, otherwise whatever the direct write returns when the ring is full.
+ *
+ * The completion consumes what was sent and queues the next send, so each queue has at most one
+ * send in flight and its frames go out in order.
+ */
+int submitRingSend(Reactor &reactor, const shared_ptr<Outbox> &box){
+    Outbox &out = *box;
+    if(out.sending || out.parked || out.frames.empty()) return 1;
+    io_uring_sqe *sqe = reactor.ring->getSqe();
+    if(!sqe) return writeQueued(out);
+
+    RingSend *send = new RingSend();
+    send->box = box;
+    send->binding = out.binding;
+    size_t count = 0;
+    for(auto it = out.frames.begin(); it != out.frames.end() && count < WRITE_BATCH; ++it, ++count){
+        size_t skip = count == 0 ? out.offset : 0;
+        send->frames[count] = *it;
+        send->iov[count].iov_base = (void*)((*it)->data() + skip);
+        send->iov[count].iov_len = (*it)->size() - skip;
     }
-
+    send->msg.msg_iov = send->iov;
+    send->msg.msg_iovlen = count;
+
+    // like writeQueued(): a send that leaves frames behind corks itself with MSG_MORE
+    Uring::prepSendmsg(sqe, out.fd, &send->msg, MSG_NOSIGNAL | (count < out.frames.size() ? MSG_MORE : 0));
+    bump(metrics.sendCalls);
+    sqe->user_data = ringData(RingOp::SEND, (uintptr_t)send >> RING_OP_BITS);
+    out.sending = count;
     return 1;
 }
 
+/**
+ * @brief Accounts for a finished send and queues the next one if frames are waiting.
+ */
+void handleRingSend(Reactor &reactor, const io_uring_cqe &cqe){
+    unique_ptr<RingSend> send((RingSend*)(uintptr_t)(cqe.user_data >> RING_OP_BITS << RING_OP_BITS));
+    Outbox &box = *send->box;
+
+    vector<int> toResume;
+    {
+        lock_guard<mutex> lock(box.m);
+        // the queue was parked or retired by a resume since; its frames were already dealt with then
+        if(send->binding != box.binding) return;
+        box.sending = 0;
+        if(box.closed) return;
+        // on a hard error the recv side sees the broken connection and closes it
+        if(cqe.res < 0 && cqe.res != -EAGAIN && cqe.res != -EINTR) return;
+        if(cqe.res > 0) consumeQueued(box, cqe.res);
+        relayFiles(box);
+        submitRingSend(reactor, send->box);
+        if(box.bytes <= outqLowWatermark) swap(toResume, box.blockedSenders);
+    }
+    resumeSenders(toResume);
+}
 
 /**
- * @brief Handles communication with a connected client.
+ * @brief Dispatches a connection's buffered frames and keeps its recv armed only while it is not paused.
  *
- * @param client_fd The file descriptor for the client connection.
+ * @param client_fd The connection's file descriptor.
  *
- * The function first authenticates the client, adds them to the active client list, and sends a welcome message.
- * It then continuously listens for incoming messages and processes them by routing commands or broadcasting messages.
- * If the client disconnects or encounters an error, the function ensures proper cleanup.
+ * A paused sender must not be read from, or the kernel would keep filling its buffer; its multishot
+ * recv is cancelled, and armed again once the reactor is told the sender was resumed.
  */
-void handle_client(int client_fd) {
-    string username = "";
-    if(Authenticate(client_fd, username) == -1){
-        disconnect(client_fd);
+void continueRingConnection(Reactor &reactor, int client_fd){
+    auto it = reactor.connections.find(client_fd);
+    if(it == reactor.connections.end()) return;
+    Connection &conn = it->second;
+    auto box = getOutbox(client_fd);
+    if(!box) return;
+
+    int r = dispatchFrames(conn, *box);
+    if(r < 0) return;
+    if(r == 0){
+        if(conn.recv == RecvState::ARMED) cancelRingRecv(reactor, conn);
         return;
     }
+    if(conn.recv == RecvState::IDLE && armRingRecv(reactor, conn)<0){
+        logger.write(LogLevel::WARN, "io_uring submission queue full, dropping fd=%d", client_fd);
+        closeConnection(client_fd);
+    }
+}
 
-    addNewClient(client_fd, username);
+/**
+ * @brief Feeds a recv completion into its connection's reassembly buffer and hands the buffer back.
+ *
+ * Completions left over from a connection that was already closed (the fd may have been reused since)
+ * carry an older tag and are dropped.
+ */
+void handleRingRecv(Reactor &reactor, const io_uring_cqe &cqe){
+    uint64_t value = cqe.user_data >> RING_OP_BITS;
+    int client_fd = (int)(uint32_t)value;
+    auto it = reactor.connections.find(client_fd);
+    Connection *conn = it != reactor.connections.end() && it->second.tag == (uint32_t)(value >> 32) ? &it->second : nullptr;
+
+    if(cqe.flags & IORING_CQE_F_BUFFER){
+        uint16_t id = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+        if(conn && cqe.res > 0) conn->reader.append(reactor.ring->bufferData(id), cqe.res);
+        reactor.ring->recycleBuffer(id);
+    }
+    if(!conn) return;
 
-    string message = "Welcome to the chat server !";
-    sendMessage(client_fd, message);
-    message = "has joined the chat.";
-    broadcast(message, client_fd);
+    bool more = cqe.flags & IORING_CQE_F_MORE;
+    if(!more) conn->recv = RecvState::IDLE;
+    if(cqe.res == 0){
+        logger.write(LogLevel::INFO, "client disconnected fd=%d", client_fd);
+        closeConnection(client_fd);
+        return;
+    }
+    // -ENOBUFS only means every provided buffer was busy; the recv is simply armed again
+    if(cqe.res < 0 && cqe.res != -ENOBUFS && cqe.res != -ECANCELED){
+        logger.write(LogLevel::WARN, "recv failed fd=%d: %s", client_fd, strerror(-cqe.res));
+        closeConnection(client_fd);
+        return;
+    }
+    if(cqe.res > 0 || !more) continueRingConnection(reactor, client_fd);
+}
 
-    string incoming;
+/**
+ * @brief Adopts a connection from the multishot accept and arms its recv.
+ */
+void handleRingAccept(Reactor &reactor, const io_uring_cqe &cqe){
+    if(cqe.res >= 0){
+        // the multishot accept does not report the peer, so its address is asked for separately
+        sockaddr_in peer{};
+        socklen_t peerLen = sizeof(peer);
+        if(getpeername(cqe.res, (struct sockaddr*)&peer, &peerLen)<0) close(cqe.res);
+        else if(admitConnection(cqe.res, peer.sin_addr.s_addr)<0) refuseConnection(cqe.res);
+        else if(Connection *conn = registerConnection(reactor, cqe.res)){
+            conn->tag = reactor.nextTag++ & RECV_TAG_MASK;
+            if(armRingRecv(reactor, *conn)<0){
+                logger.write(LogLevel::WARN, "io_uring submission queue full, dropping fd=%d", cqe.res);
+                closeConnection(cqe.res);
+            }
+        }
+    }
+    else if(cqe.res != -EINTR && cqe.res != -ECONNABORTED){
+        logger.write(LogLevel::WARN, "accept failed: %s", strerror(-cqe.res));
+    }
+    if(!(cqe.flags & IORING_CQE_F_MORE) && armRingAccept(reactor)<0) logger.write(LogLevel::ERROR, "io_uring submission queue full, cannot accept");
+}
+
+/**
+ * @brief Moves a reactor onto io_uring; runs on the reactor's own thread, which becomes the ring's only submitter.
+ *
+ * @return int Returns 1 on success, otherwise returns -1 and leaves the reactor on epoll.
+ */
+int startRing(Reactor &reactor){
+    auto ring = make_unique<Uring>();
+    if(ring->init(URING_ENTRIES)<0 || ring->setupBuffers(URING_BUFFER_GROUP, URING_BUFFERS, READ_CHUNK_SIZE)<0){
+        logger.write(LogLevel::WARN, "io_uring setup failed: %s", strerror(errno));
+        return -1;
+    }
+    reactor.ring = move(ring);
+    if(armRingWake(reactor)<0 || armRingAccept(reactor)<0){
+        reactor.ring.reset();
+        return -1;
+    }
+    return 1;
+}
+
+/**
+ * @brief Runs one reactor's io_uring event loop.
+ *
+ * @param reactor The reactor to run; startRing() has succeeded on it.
+ * @return int Returns -1 if `io_uring_enter()` fails.
+ *
+ * Each pass submits every SQE queued since the previous pass and waits for completions in the same call,
+ * handles the completions, then resumes senders and turns the dirty queues into send SQEs, like runReactor().
+ */
+int runRingReactor(Reactor &reactor){
+    Uring &ring = *reactor.ring;
+    int64_t nextFlush = -1;
     while(true){
-        if(recvMessage(client_fd, incoming)<0) {
-            disconnect(client_fd);
-            return;
+        int64_t left = reactorWaitNs(reactor, nextFlush);
+        __kernel_timespec wait{};
+        wait.tv_sec = max<int64_t>(0, left) / 1000000000;
+        wait.tv_nsec = max<int64_t>(0, left) % 1000000000;
+        if(ring.submit(1, left >= 0 ? &wait : nullptr)<0 && errno != EINTR && errno != EAGAIN && errno != EBUSY && errno != ETIME){
+            logger.write(LogLevel::ERROR, "io_uring_enter failed: %s", strerror(errno));
+            break;
+        }
+        reactor.nowMs = steadyNowMs();
+
+        ring.forEachCqe([&](const io_uring_cqe &cqe){
+            switch((RingOp)(cqe.user_data & ((1 << RING_OP_BITS) - 1))){
+                case RingOp::WAKE:{
+                    uint64_t count;
+                    if(read(reactor.wake_fd, &count, sizeof(count))<0 && errno != EAGAIN) logger.write(LogLevel::ERROR, "eventfd read failed: %s", strerror(errno));
+                    if(!(cqe.flags & IORING_CQE_F_MORE)) armRingWake(reactor);
+                    break;
+                }
+                case RingOp::ACCEPT: handleRingAccept(reactor, cqe); break;
+                case RingOp::RECV: handleRingRecv(reactor, cqe); break;
+                case RingOp::SEND: handleRingSend(reactor, cqe); break;
+                case RingOp::CANCEL: break;
+            }
+        });
+
+        // re-arm the wakeup before draining, so a handover racing with the drain still wakes us
+        reactor.wakePending.exchange(false, memory_order_acq_rel);
+        int sender;
+        while(reactor.resumed.pop(sender)) continueRingConnection(reactor, sender);
+        LoginVerdict login;
+        while(reactor.verified.pop(login)) if(finishLogin(reactor, login) > 0) continueRingConnection(reactor, login.fd);
+        runConnectionTimers(reactor);
+
+        nextFlush = flushDirtyOutboxes(reactor);
+    }
+
+    return -1;
+}
+
+/*
+    io_uring reactor: end
+*/
+#endif
+
+/**
+ * @brief Runs one reactor's edge-triggered epoll event loop.
+ *
+ * @param reactor The reactor to run; in threaded mode its loop only flushes outbound queues.
+ * @return int Returns -1 if `epoll_pwait2()` fails.
+ *
+ * After each batch of events the loop resumes senders whose pause ended and writes out every queue
+ * that was handed to it, whether by its own connections or by other reactors' fan-outs.
+ */
+int runReactor(Reactor &reactor){
+    currentReactor = &reactor;
+#ifdef USE_IO_URING
+    if(useIoUring && reactor.listen_fd >= 0){
+        if(startRing(reactor) > 0) return runRingReactor(reactor);
+        logger.write(LogLevel::WARN, "reactor %d falls back to epoll", reactor.id);
+    }
+#endif
+
+    vector<epoll_event> events(MAX_EVENTS);
+    int64_t nextFlush = -1;
+    while(true){
+        // held-back queues and timers need the loop to wake up by their deadline; epoll_pwait2 takes it to the microsecond
+        int64_t left = reactorWaitNs(reactor, nextFlush);
+        timespec wait{};
+        wait.tv_sec = max<int64_t>(0, left) / 1000000000;
+        wait.tv_nsec = max<int64_t>(0, left) % 1000000000;
+        int n = epoll_pwait2(reactor.epoll_fd, events.data(), MAX_EVENTS, left >= 0 ? &wait : nullptr, nullptr);
+        if(n < 0){
+            if(errno == EINTR) continue;
+            logger.write(LogLevel::ERROR, "epoll_pwait2 failed: %s", strerror(errno));
+            break;
+        }
+        reactor.nowMs = steadyNowMs();
+
+        for(int i=0;i<n;i++){
+            int fd = events[i].data.fd;
+            if(fd == reactor.wake_fd){
+                uint64_t count;
+                if(read(reactor.wake_fd, &count, sizeof(count))<0 && errno != EAGAIN) logger.write(LogLevel::ERROR, "eventfd read failed: %s", strerror(errno));
+                continue;
+            }
+            if(fd == reactor.listen_fd){
+                reactor.acceptPending = true;
+                continue;
+            }
+            if(events[i].events & EPOLLOUT){
+                flushOutbox(getOutbox(fd));
+            }
+            // in threaded mode the client's own thread does the reading and the cleanup
+            if(reactor.connections.find(fd) == reactor.connections.end()) continue;
+            if(events[i].events & (EPOLLIN | EPOLLRDHUP)){
+                readConnection(fd);
+            }
+            else if(events[i].events & (EPOLLERR | EPOLLHUP)){
+                closeConnection(fd);
+            }
         }
-        
-        if(handleCommandRouting(client_fd, incoming)<0) continue; 
+
+        if(reactor.acceptPending) reactor.acceptPending = acceptConnections(reactor);
+        runConnectionTimers(reactor);
+
+        // re-arm the wakeup before draining, so a handover racing with the drain still wakes us
+        reactor.wakePending.exchange(false, memory_order_acq_rel);
+        int sender;
+        while(reactor.resumed.pop(sender)) readConnection(sender);
+        LoginVerdict login;
+        while(reactor.verified.pop(login)) if(finishLogin(reactor, login) > 0) readConnection(login.fd);
+
+        nextFlush = flushDirtyOutboxes(reactor);
     }
+
+    return -1;
 }
 
+/*
+    epoll reactor: end
+*/
+
 int main(int argc, char *argv[]) {
 
+    if(argc>=4 && strcmp(argv[1], "--build-users")==0){
+        uint32_t iterations = argc>=5 ? (uint32_t)strtoul(argv[4], nullptr, 10) : USERDB_DEFAULT_ITERATIONS;
+        return buildUserDb(argv[2], argv[3], iterations)<0 ? 2 : 0;
+    }
+
     if(argc==1 || !validatePort(argv[1])){
         cout<<"Error: PORT number not mentioned or Invalid Port";
         return 2;
     }
 
     PORT = atoi(argv[1]);
-
     string usersFilePath = "users.txt";
-    if(getUsers(usersFilePath)==2){
-        perror("Cannot convert users");
+    string logDir;
+    string spoolDir;
+    string captureFile;
+
+    for(int i=2;i<argc;i++){
+        if(strcmp(argv[i], "--threaded")==0) threadedMode = true;
+        else if(strcmp(argv[i], "--io-uring")==0) useIoUring = true;
+        else if(strcmp(argv[i], "--reactors")==0 && i+1<argc && validatePort(argv[i+1])){
+            reactorCount = atoi(argv[++i]);
+        }
+        else if(strcmp(argv[i], "--max-frame")==0 && i+1<argc && validatePort(argv[i+1]) && atol(argv[i+1]) >= MIN_FRAME_LIMIT){
+            maxFrameSize = (uint32_t)min(atol(argv[++i]), (long)MAX_FRAME_LIMIT);
+        }
+        else if(strcmp(argv[i], "--outq-high")==0 && i+1<argc && validatePort(argv[i+1])){
+            outqHighWatermark = atol(argv[++i]);
+        }
+        else if(strcmp(argv[i], "--outq-low")==0 && i+1<argc && validatePort(argv[i+1])){
+            outqLowWatermark = atol(argv[++i]);
+        }
+        else if(strcmp(argv[i], "--flush-us")==0 && i+1<argc && validatePort(argv[i+1])){
+            flushDelayUs = atol(argv[++i]);
+        }
+        else if(strcmp(argv[i], "--nagle")==0) tcpNoDelay = false;
+        else if(strcmp(argv[i], "--backlog")==0 && i+1<argc && validatePort(argv[i+1])){
+            listenBacklog = max(1, atoi(argv[++i]));
+        }
+        else if(strcmp(argv[i], "--max-conns")==0 && i+1<argc && validatePort(argv[i+1])){
+            maxConnections = atol(argv[++i]);
+        }
+        else if(strcmp(argv[i], "--max-conns-per-ip")==0 && i+1<argc && validatePort(argv[i+1])){
+            maxConnectionsPerIp = atol(argv[++i]);
+        }
+        else if(strcmp(argv[i], "--rate-limit")==0 && i+2<argc){
+            static const char *classes[] = {"message", "membership", "query"};
+            int rateClass = -1;
+            for(int c = 0; c < RATE_CLASSES; c++) if(strcmp(argv[i+1], classes[c]) == 0) rateClass = c;
+            double rate = 0, burst = 0;
+            int parsed = sscanf(argv[i+2], "%lf:%lf", &rate, &burst);
+            if(rateClass < 0 || parsed < 1 || rate < 0 || (parsed == 2 && burst < 1)){
+                cout<<"Error: --rate-limit takes message|membership|query and RATE[:BURST]"<<endl;
+                return 2;
+            }
+            rateLimits[rateClass] = RateLimit{rate, parsed == 2 ? burst : max(1.0, rate)};
+            i += 2;
+        }
+        else if(strcmp(argv[i], "--admin")==0 && i+1<argc){
+            admins.insert(argv[++i]);
+        }
+        else if(strcmp(argv[i], "--admin-port")==0 && i+1<argc && validatePort(argv[i+1])){
+            adminPort = atoi(argv[++i]);
+        }
+        else if(strcmp(argv[i], "--log-dir")==0 && i+1<argc){
+            logDir = argv[++i];
+        }
+        else if(strcmp(argv[i], "--log-sync-ms")==0 && i+1<argc && validatePort(argv[i+1])){
+            logSyncMs = max(1, atoi(argv[++i]));
+        }
+        else if(strcmp(argv[i], "--capture")==0 && i+1<argc){
+            captureFile = argv[++i];
+        }
+        else if(strcmp(argv[i], "--spool-dir")==0 && i+1<argc){
+            spoolDir = argv[++i];
+        }
+        else if(strcmp(argv[i], "--max-file-size")==0 && i+1<argc && validatePort(argv[i+1])){
+            maxFileBytes = strtoull(argv[++i], nullptr, 10);
+        }
+        else if(strcmp(argv[i], "--spool-ttl")==0 && i+1<argc && validatePort(argv[i+1])){
+            spoolTtlSeconds = atoll(argv[++i]);
+        }
+        else if(strcmp(argv[i], "--fanout-threads")==0 && i+1<argc && validatePort(argv[i+1])){
+            fanoutThreads = atoi(argv[++i]);
+        }
+        else if(strcmp(argv[i], "--verify-threads")==0 && i+1<argc && validatePort(argv[i+1])){
+            verifyThreads = atoi(argv[++i]);
+        }
+        else if(strcmp(argv[i], "--fanout-partition")==0 && i+1<argc && validatePort(argv[i+1])){
+            fanoutPartition = (uint32_t)max(1L, atol(argv[++i]));
+        }
+        else if(strcmp(argv[i], "--history-count")==0 && i+1<argc && validatePort(argv[i+1])){
+            historyMaxCount = atol(argv[++i]);
+        }
+        else if(strcmp(argv[i], "--history-bytes")==0 && i+1<argc && validatePort(argv[i+1])){
+            historyMaxBytes = atol(argv[++i]);
+        }
+        else if(strcmp(argv[i], "--resume-ttl")==0 && i+1<argc && validatePort(argv[i+1])){
+            resumeTtlSeconds = atoi(argv[++i]);
+        }
+        else if(strcmp(argv[i], "--auth-timeout")==0 && i+1<argc && validatePort(argv[i+1])){
+            authTimeoutSeconds = atoi(argv[++i]);
+        }
+        else if(strcmp(argv[i], "--ping-interval")==0 && i+1<argc && validatePort(argv[i+1])){
+            pingIntervalSeconds = atoi(argv[++i]);
+        }
+        else if(strcmp(argv[i], "--pong-timeout")==0 && i+1<argc && validatePort(argv[i+1])){
+            pongTimeoutSeconds = max(1, atoi(argv[++i]));
+        }
+        else if(strcmp(argv[i], "--idle-timeout")==0 && i+1<argc && validatePort(argv[i+1])){
+            idleTimeoutSeconds = atoi(argv[++i]);
+        }
+        else if(strcmp(argv[i], "--log-level")==0 && i+1<argc){
+            LogLevel level;
+            if(Logger::parseLevel(argv[++i], level)<0){
+                cout<<"Error: --log-level must be debug, info, warn, error or off"<<endl;
+                return 2;
+            }
+            logger.setLevel(level);
+        }
+        else if(strcmp(argv[i], "--log-sample")==0 && i+1<argc && validatePort(argv[i+1])){
+            logger.setSampleEvery((uint32_t)atol(argv[++i]));
+        }
+        else if(strcmp(argv[i], "--users")==0 && i+1<argc){
+            usersFilePath = argv[++i];
+        }
+        else if(strcmp(argv[i], "--slow-policy")==0 && i+1<argc){
+            string policy = argv[++i];
+            if(policy == "drop") slowConsumerPolicy = SlowConsumerPolicy::DROP_OLDEST;
+            else if(policy == "disconnect") slowConsumerPolicy = SlowConsumerPolicy::DISCONNECT;
+            else if(policy == "pause") slowConsumerPolicy = SlowConsumerPolicy::PAUSE_SENDER;
+            else{
+                cout<<"Error: --slow-policy must be drop, disconnect or pause"<<endl;
+                return 2;
+            }
+        }
+        else{
+            cout<<"Usage: ./server_grp PORT [--threaded] [--reactors N] [--io-uring] [--max-frame BYTES] [--outq-high BYTES] [--outq-low BYTES] [--slow-policy drop|disconnect|pause] [--flush-us MICROSECONDS] [--nagle] [--backlog N] [--max-conns N] [--max-conns-per-ip N] [--rate-limit message|membership|query RATE[:BURST]]... [--users FILE] [--admin USER]... [--admin-port PORT] [--log-dir DIR] [--log-sync-ms MS] [--spool-dir DIR] [--max-file-size BYTES] [--spool-ttl SECONDS] [--capture FILE] [--fanout-threads N] [--fanout-partition N] [--verify-threads N] [--history-count N] [--history-bytes BYTES] [--resume-ttl SECONDS] [--auth-timeout SECONDS] [--ping-interval SECONDS] [--pong-timeout SECONDS] [--idle-timeout SECONDS] [--log-level debug|info|warn|error|off] [--log-sample N]"<<endl;
+            cout<<"       ./server_grp --build-users USERS.TXT USERS.DB [PBKDF2_ROUNDS]"<<endl;
+            return 2;
+        }
+    }
+    if(outqLowWatermark > outqHighWatermark){
+        cout<<"Error: --outq-low must not exceed --outq-high"<<endl;
         return 2;
     }
+#ifndef USE_IO_URING
+    if(useIoUring){
+        cout<<"Warning: built without io_uring support (make IO_URING=1), using epoll"<<endl;
+        useIoUring = false;
+    }
+#endif
+
+    // SIGHUP reloads the users file; it must be blocked before any other thread exists
+    blockReloadSignal();
+    thread logWriter(&Logger::run, &logger, STDOUT_FILENO);
+    logWriter.detach();
+    if(credentials.load(usersFilePath)<0) return 2;
+    thread usersWatcher(&CredentialStore::watch, &credentials);
+    usersWatcher.detach();
+
+    // a peer that vanished mid-send must not kill the whole server
+    signal(SIGPIPE, SIG_IGN);
+    size_t fileLimit = raiseFileLimit();
+    sessions.init(fileLimit);
+    peerSlots = fileLimit;
+    peerOf = make_unique<atomic<uint32_t>[]>(peerSlots);
+
+    if(!logDir.empty()){
+        if(messageLog.open(logDir)<0) return 2;
+        thread logSync(runLogSync);
+        logSync.detach();
+    }
+    if(!spoolDir.empty() && fileSpool.open(spoolDir, maxFileBytes, spoolTtlSeconds * 1000)<0) return 2;
+    if(!captureFile.empty()){
+        uint64_t wallNs = chrono::duration_cast<chrono::nanoseconds>(chrono::system_clock::now().time_since_epoch()).count();
+        if(trafficCapture.open(captureFile, wallNs, steadyNowNs())<0) return 2;
+        thread captureFlush(runCaptureFlush);
+        captureFlush.detach();
+    }
 
-    int server_fd;
-    struct sockaddr_in address;
-    
+    thread presenceUpdates(runPresenceUpdates);
+    presenceUpdates.detach();
+    fanoutPool.start(fanoutThreads >= 0 ? fanoutThreads : max(1u, thread::hardware_concurrency()));
+    // threaded mode checks passwords on each client's own thread
+    if(!threadedMode) verifierPool.start(verifyThreads);
 
-    if ((server_fd = socket(AF_INET, SOCK_STREAM, 0)) == 0) {
-        perror("Socket failed");
-        exit(EXIT_FAILURE);
+    if(adminPort >= 0){
+        thread admin(serveAdminPort, adminPort);
+        admin.detach();
     }
-    
 
-    address.sin_family = AF_INET;
-    address.sin_addr.s_addr = INADDR_ANY;
-    address.sin_port = htons(PORT);
-    
-    if (bind(server_fd, (struct sockaddr*)&address, sizeof(address)) < 0) {
-        perror("Bind failed");
-        exit(EXIT_FAILURE);
+    if(resumeTtlSeconds > 0){
+        thread expiry(runParkedExpiry);
+        expiry.detach();
     }
-    
 
-    if (listen(server_fd, 15) < 0) {
-        perror("Listen failed");
-        exit(EXIT_FAILURE);
+    if(!threadedMode){
+        // one reactor per core, each accepting on its own SO_REUSEPORT socket
+        int count = reactorCount > 0 ? reactorCount : max(1u, thread::hardware_concurrency());
+        for(int i=0;i<count;i++){
+            reactors.push_back(make_unique<Reactor>());
+            reactors[i]->id = i;
+            reactors[i]->listen_fd = createListener(PORT);
+            if(reactors[i]->listen_fd < 0 || setupReactor(*reactors[i])<0) return 2;
+        }
+        std::cout << "Server is listening on port " << PORT << " (" << (useIoUring ? "io_uring" : "epoll") << ", " << count << " reactors)..." << endl;
+
+        for(int i=1;i<count;i++){
+            thread worker(runReactor, ref(*reactors[i]));
+            worker.detach();
+        }
+        runReactor(*reactors[0]);
+        return 1;
     }
-    
-    std::cout << "Server is listening on port " << PORT << "...\n";
-    
-    
+
+    int server_fd = createListener(PORT);
+    if(server_fd < 0) exit(EXIT_FAILURE);
+
+    // threaded mode still needs someone to write out the outbound queues
+    reactors.push_back(make_unique<Reactor>());
+    if(setupReactor(*reactors[0])<0) return 2;
+    std::cout << "Server is listening on port " << PORT << " (threaded)..." << endl;
+
+    thread flusher(runReactor, ref(*reactors[0]));
+    flusher.detach();
     
     while (true) {
         int client_fd;
@@ -774,14 +3793,13 @@ int main(int argc, char *argv[]) {
         socklen_t client_addr_len = sizeof(clientAddr);
 
         if ((client_fd = accept(server_fd, (struct sockaddr*)&clientAddr, &client_addr_len)) < 0) {
-            perror("Accept failed");
+            logger.write(LogLevel::WARN, "accept failed: %s", strerror(errno));
             continue;
         }
-        {
-            lock_guard<mutex> lock(client_mutex);
-            threads.push_back(client_fd);
+        if(admitConnection(client_fd, clientAddr.sin_addr.s_addr)<0){
+            refuseConnection(client_fd);
+            continue;
         }
-
         thread client_thread(handle_client, client_fd);
         client_thread.detach();
     }
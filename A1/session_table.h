@@ -0,0 +1,596 @@
+// Dense session table with generational handles, and the sharded session/group registries built on it
+
+#ifndef SESSION_TABLE_H
+#define SESSION_TABLE_H
+
+#include <array>
+#include <atomic>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <cstdint>
+#include <mutex>
+#include <algorithm>
+#include <functional>
+#include <shared_mutex>
+#include <unordered_map>
+#include <memory_resource>
+#include "buffer_pool.h"
+
+struct Outbox;  // a connection's outbound queue, defined by the server
+
+/*
+*  A handle names one slot of the table plus the generation that slot had when
+*  the session was created. Releasing a slot bumps its generation, so handles
+*  (and fds) left over from an old session can never resolve to whoever gets
+*  the slot next.
+*/
+struct SessionHandle{
+    uint32_t index = UINT32_MAX;
+    uint32_t generation = 0;
+
+    bool valid() const { return index != UINT32_MAX; }
+    uint64_t key() const { return ((uint64_t)generation << 32) | index; }
+    static SessionHandle fromKey(uint64_t key){ return SessionHandle{(uint32_t)key, (uint32_t)(key >> 32)}; }
+    bool operator==(const SessionHandle &o) const { return index == o.index && generation == o.generation; }
+    bool operator!=(const SessionHandle &o) const { return !(*this == o); }
+};
+
+struct SessionHandleHash{
+    size_t operator()(const SessionHandle &h) const { return std::hash<uint64_t>()(h.key()); }
+};
+
+// Transparent string hash, so maps keyed by std::string can be probed with a string_view without building a key
+struct StringHash{
+    using is_transparent = void;
+    size_t operator()(std::string_view s) const { return std::hash<std::string_view>()(s); }
+};
+
+#define RATE_CLASSES 3  // rate-limited command classes: messages, membership changes, queries
+
+/*
+*  Token bucket for one user and one command class. It starts full, refills at
+*  `rate` tokens per second up to `burst`, and lets a command through while at
+*  least one token is left. The cost is charged afterwards and may drive the
+*  bucket below zero, so a broadcast to a thousand users is paid for in full
+*  (as debt) even though it was let in on a single token.
+*/
+struct TokenBucket{
+    double tokens = 0;
+    int64_t refilledAt = 0;             // steady clock, ns; 0 until first use
+
+    bool ready(double rate, double burst, int64_t now){
+        if(refilledAt == 0) tokens = burst;
+        else tokens = std::min(burst, tokens + rate * (double)(now - refilledAt) / 1e9);
+        refilledAt = now;
+        return tokens >= 1;
+    }
+    void charge(double cost){ tokens -= cost; }
+};
+
+struct Session{
+    uint32_t generation = 0;
+    bool live = false;
+    int fd = -1;
+    std::string username;
+    std::shared_ptr<Outbox> outbox;     // the connection's outbound queue, so delivery needs no fd lookup
+    std::vector<std::string> groups;    // groups this session belongs to, so disconnect only touches those
+    uint64_t resumeSecret[2] = {0, 0};  // secret half of the resume token; all zero until one is issued
+    bool parked = false;                // the connection is gone, but the session waits for a resume
+    int64_t parkedAt = 0;               // when it was parked (steady clock, ms), so a stale expiry can tell
+    TokenBucket rateBuckets[RATE_CLASSES];  // per-class rate limits; kept across a resume
+};
+
+/*
+*  Sessions live in one contiguous slot array; freed slots are recycled from a
+*  free list, and usernames are indexed for O(1) lookup. The table itself does
+*  no locking, callers serialise access.
+*/
+class SessionTable{
+public:
+    /**
+     * @brief Creates a session for `username` on `fd`.
+     *
+     * @return SessionHandle The new handle, or an invalid handle if the username is already online.
+     */
+    SessionHandle add(std::string_view username, int fd, std::shared_ptr<Outbox> outbox){
+        if(names.find(username) != names.end() || fd < 0) return SessionHandle{};
+
+        uint32_t index;
+        if(!freeSlots.empty()){
+            index = freeSlots.back();
+            freeSlots.pop_back();
+        }
+        else{
+            index = (uint32_t)slots.size();
+            slots.emplace_back();
+        }
+
+        Session &s = slots[index];
+        s.live = true;
+        s.fd = fd;
+        s.username = username;
+        s.outbox = std::move(outbox);
+        s.groups.clear();
+
+        SessionHandle h{index, s.generation};
+        names.emplace(std::string(username), h);
+        liveCount++;
+        return h;
+    }
+
+    /**
+     * @brief Releases a session's slot and invalidates every outstanding handle to it.
+     *
+     * @return bool Returns false if the handle was already stale.
+     */
+    bool remove(SessionHandle h){
+        Session *s = get(h);
+        if(!s) return false;
+
+        names.erase(s->username);
+        s->live = false;
+        s->fd = -1;
+        s->username.clear();
+        s->outbox.reset();
+        s->groups.clear();
+        s->resumeSecret[0] = s->resumeSecret[1] = 0;
+        s->parked = false;
+        for(auto &bucket : s->rateBuckets) bucket = TokenBucket{};
+        s->generation++;
+        freeSlots.push_back(h.index);
+        liveCount--;
+        return true;
+    }
+
+    /**
+     * @brief Resolves a handle.
+     *
+     * @return Session* The session, or nullptr if the handle is stale or invalid.
+     */
+    Session* get(SessionHandle h){
+        if(h.index >= slots.size()) return nullptr;
+        Session &s = slots[h.index];
+        if(!s.live || s.generation != h.generation) return nullptr;
+        return &s;
+    }
+
+    SessionHandle byName(std::string_view username) const {
+        auto it = names.find(username);
+        return it == names.end() ? SessionHandle{} : it->second;
+    }
+
+    size_t size() const { return liveCount; }
+
+    /**
+     * @brief Calls `f(handle, session)` for every live session, walking the slot array in order.
+     */
+    template<class F>
+    void forEach(F f){
+        forEachIn(0, (uint32_t)slots.size(), f);
+    }
+
+    /**
+     * @brief Like forEach(), but only for the slots in [begin, end); slots past the end of the array are skipped.
+     */
+    template<class F>
+    void forEachIn(uint32_t begin, uint32_t end, F &f){
+        end = std::min<uint32_t>(end, (uint32_t)slots.size());
+        for(uint32_t i = begin; i < end; i++){
+            if(slots[i].live) f(SessionHandle{i, slots[i].generation}, slots[i]);
+        }
+    }
+
+    uint32_t slotCount() const { return (uint32_t)slots.size(); }
+
+private:
+    std::vector<Session> slots;
+    std::vector<uint32_t> freeSlots;
+    std::unordered_map<std::string, SessionHandle, StringHash, std::equal_to<>> names;
+    size_t liveCount = 0;
+};
+
+#define SESSION_SHARD_BITS 4
+#define SESSION_SHARDS (1 << SESSION_SHARD_BITS)
+#define GROUP_SHARDS 16
+
+/*
+*  Thread-safe session registry. Users are spread over SESSION_SHARDS
+*  independent tables by a hash of the username, each behind its own
+*  reader/writer lock, and the shard number is folded into the low bits of
+*  the handle's index. The fd -> handle index is a flat array of atomics, so
+*  resolving the caller's own session takes no lock at all.
+*/
+class SessionRegistry{
+public:
+    /**
+     * @brief Sizes the lock-free fd index; must run before any session is added.
+     */
+    void init(size_t maxFds){
+        fdCapacity = maxFds;
+        fdIndex.reset(new std::atomic<uint64_t>[maxFds]);
+        for(size_t i = 0; i < maxFds; i++) fdIndex[i].store(SessionHandle{}.key(), std::memory_order_relaxed);
+    }
+
+    SessionHandle add(std::string_view username, int fd, std::shared_ptr<Outbox> outbox){
+        if(fd < 0 || (size_t)fd >= fdCapacity) return SessionHandle{};
+        uint32_t shard = shardOf(username);
+
+        std::unique_lock<std::shared_mutex> lock(shards[shard].m);
+        SessionHandle local = shards[shard].table.add(username, fd, std::move(outbox));
+        if(!local.valid()) return local;
+
+        SessionHandle h = toGlobal(local, shard);
+        fdIndex[fd].store(h.key(), std::memory_order_release);
+        liveCount++;
+        return h;
+    }
+
+    /**
+     * @brief Removes a session and hands back the groups it was in so the caller can clean them up.
+     *
+     * @return bool Returns false if the handle was already stale.
+     */
+    bool remove(SessionHandle h, std::vector<std::string> &groupsOut){
+        if(!h.valid()) return false;
+        Shard &shard = shards[h.index & (SESSION_SHARDS - 1)];
+
+        std::unique_lock<std::shared_mutex> lock(shard.m);
+        SessionHandle local = toLocal(h);
+        Session *s = shard.table.get(local);
+        if(!s) return false;
+
+        uint64_t expected = h.key();
+        if((size_t)s->fd < fdCapacity) fdIndex[s->fd].compare_exchange_strong(expected, SessionHandle{}.key());
+        groupsOut.swap(s->groups);
+        shard.table.remove(local);
+        liveCount--;
+        return true;
+    }
+
+    /**
+     * @brief Detaches a session from its connection but keeps its name, groups and outbound queue for a resume.
+     *
+     * @param now The time of parking, which expire() later has to match.
+     * @return bool Returns false if the handle is stale, the session is already parked or it holds no resume token.
+     */
+    bool park(SessionHandle h, int64_t now){
+        if(!h.valid()) return false;
+        Shard &shard = shards[h.index & (SESSION_SHARDS - 1)];
+
+        std::unique_lock<std::shared_mutex> lock(shard.m);
+        Session *s = shard.table.get(toLocal(h));
+        if(!s || s->parked || (s->resumeSecret[0] | s->resumeSecret[1]) == 0) return false;
+
+        uint64_t expected = h.key();
+        if((size_t)s->fd < fdCapacity) fdIndex[s->fd].compare_exchange_strong(expected, SessionHandle{}.key());
+        s->fd = -1;
+        s->parked = true;
+        s->parkedAt = now;
+        return true;
+    }
+
+    /**
+     * @brief Attaches a parked session to the connection on `fd`.
+     *
+     * @param secret The secret half of the resume token, or nullptr if the caller already checked the password.
+     * @return std::shared_ptr<Outbox> The session's outbound queue, or nullptr if the session is not parked
+     *         or the secret does not match.
+     */
+    std::shared_ptr<Outbox> resume(SessionHandle h, const uint64_t *secret, int fd){
+        if(!h.valid() || fd < 0 || (size_t)fd >= fdCapacity) return nullptr;
+        Shard &shard = shards[h.index & (SESSION_SHARDS - 1)];
+
+        std::unique_lock<std::shared_mutex> lock(shard.m);
+        Session *s = shard.table.get(toLocal(h));
+        if(!s || !s->parked) return nullptr;
+        // compared without an early exit, so the time taken says nothing about the secret
+        if(secret && ((s->resumeSecret[0] ^ secret[0]) | (s->resumeSecret[1] ^ secret[1])) != 0) return nullptr;
+
+        s->fd = fd;
+        s->parked = false;
+        fdIndex[fd].store(h.key(), std::memory_order_release);
+        return s->outbox;
+    }
+
+    /**
+     * @brief Removes a session, like remove(), but only if it has stayed parked since `parkedAt`.
+     *
+     * @param outboxOut Set to the session's outbound queue, which the caller closes.
+     * @return bool Returns false if the session was resumed (or parked again later) in the meantime.
+     */
+    bool expire(SessionHandle h, int64_t parkedAt, std::vector<std::string> &groupsOut, std::shared_ptr<Outbox> &outboxOut){
+        if(!h.valid()) return false;
+        Shard &shard = shards[h.index & (SESSION_SHARDS - 1)];
+
+        std::unique_lock<std::shared_mutex> lock(shard.m);
+        SessionHandle local = toLocal(h);
+        Session *s = shard.table.get(local);
+        if(!s || !s->parked || s->parkedAt != parkedAt) return false;
+
+        groupsOut.swap(s->groups);
+        outboxOut = s->outbox;
+        shard.table.remove(local);
+        liveCount--;
+        return true;
+    }
+
+    SessionHandle byFd(int fd) const {
+        if(fd < 0 || (size_t)fd >= fdCapacity) return SessionHandle{};
+        return SessionHandle::fromKey(fdIndex[fd].load(std::memory_order_acquire));
+    }
+
+    SessionHandle byName(std::string_view username) const {
+        uint32_t shard = shardOf(username);
+        std::shared_lock<std::shared_mutex> lock(shards[shard].m);
+        SessionHandle local = shards[shard].table.byName(username);
+        return local.valid() ? toGlobal(local, shard) : local;
+    }
+
+    /**
+     * @brief Runs `f(const Session&)` under the shard's shared lock.
+     *
+     * @return bool Returns false (without calling `f`) if the handle is stale.
+     */
+    template<class F>
+    bool read(SessionHandle h, F f){
+        if(!h.valid()) return false;
+        Shard &shard = shards[h.index & (SESSION_SHARDS - 1)];
+        std::shared_lock<std::shared_mutex> lock(shard.m);
+        Session *s = shard.table.get(toLocal(h));
+        if(!s) return false;
+        f((const Session&)*s);
+        return true;
+    }
+
+    /**
+     * @brief Runs `f(Session&)` under the shard's exclusive lock.
+     *
+     * @return bool Returns false (without calling `f`) if the handle is stale.
+     */
+    template<class F>
+    bool write(SessionHandle h, F f){
+        if(!h.valid()) return false;
+        Shard &shard = shards[h.index & (SESSION_SHARDS - 1)];
+        std::unique_lock<std::shared_mutex> lock(shard.m);
+        Session *s = shard.table.get(toLocal(h));
+        if(!s) return false;
+        f(*s);
+        return true;
+    }
+
+    /**
+     * @brief Calls `f(handle, const Session&)` for every live session, one shard (and one shared lock) at a time.
+     */
+    template<class F>
+    void forEach(F f){
+        for(uint32_t i = 0; i < SESSION_SHARDS; i++){
+            std::shared_lock<std::shared_mutex> lock(shards[i].m);
+            shards[i].table.forEach([&](SessionHandle local, Session &s){ f(toGlobal(local, i), (const Session&)s); });
+        }
+    }
+
+    /**
+     * @brief Calls `f(handle, const Session&)` for the live sessions in slots [begin, end) of one shard.
+     *
+     * A shard's slots only ever grow, so cutting every shard's [0, slotCount(shard)) into ranges covers each
+     * session that was live at the time exactly once; sessions added meanwhile may or may not be seen.
+     */
+    template<class F>
+    void forEachIn(uint32_t shard, uint32_t begin, uint32_t end, F f){
+        std::shared_lock<std::shared_mutex> lock(shards[shard].m);
+        auto visit = [&](SessionHandle local, Session &s){ f(toGlobal(local, shard), (const Session&)s); };
+        shards[shard].table.forEachIn(begin, end, visit);
+    }
+
+    uint32_t slotCount(uint32_t shard) const {
+        std::shared_lock<std::shared_mutex> lock(shards[shard].m);
+        return shards[shard].table.slotCount();
+    }
+
+    size_t size() const { return liveCount.load(std::memory_order_relaxed); }
+
+private:
+    struct Shard{
+        mutable std::shared_mutex m;
+        SessionTable table;
+    };
+
+    static uint32_t shardOf(std::string_view username){
+        return (uint32_t)(StringHash()(username) & (SESSION_SHARDS - 1));
+    }
+    static SessionHandle toGlobal(SessionHandle local, uint32_t shard){
+        return SessionHandle{(local.index << SESSION_SHARD_BITS) | shard, local.generation};
+    }
+    static SessionHandle toLocal(SessionHandle h){
+        return SessionHandle{h.index >> SESSION_SHARD_BITS, h.generation};
+    }
+
+    std::array<Shard, SESSION_SHARDS> shards;
+    std::unique_ptr<std::atomic<uint64_t>[]> fdIndex;
+    size_t fdCapacity = 0;
+    std::atomic<size_t> liveCount{0};
+};
+
+/*
+*  A group's most recent messages, kept as the encoded frames that were sent
+*  to the members so replaying them costs no formatting or copying. The ring
+*  is a contiguous array of frame pointers that only grows up to the count
+*  limit; the oldest entries are evicted once either the count or the byte
+*  limit would be exceeded. It has its own mutex because messages are
+*  recorded while the group's shard is only held shared.
+*/
+class GroupHistory{
+public:
+    using Frame = SharedFrame;
+
+    void push(const Frame &frame, size_t maxCount, size_t maxBytes){
+        if(maxCount == 0 || frame->size() > maxBytes) return;
+        std::lock_guard<std::mutex> lock(m);
+        while(count > 0 && (count >= maxCount || bytes + frame->size() > maxBytes)) popOldest();
+
+        if(count == ring.size()){
+            // grow in place: make the oldest entry index 0 first, so the new slot lands at the end
+            std::rotate(ring.begin(), ring.begin() + head, ring.end());
+            head = 0;
+            ring.push_back(frame);
+        }
+        else ring[(head + count) % ring.size()] = frame;
+        count++;
+        bytes += frame->size();
+    }
+
+    /**
+     * @brief Appends the newest `n` frames (all of them if `n` is 0 or larger than the history), oldest first, to `out`.
+     */
+    template<class Out>
+    void last(size_t n, Out &out) const {
+        std::lock_guard<std::mutex> lock(m);
+        if(n == 0 || n > count) n = count;
+        for(size_t i = count - n; i < count; i++) out.push_back(ring[(head + i) % ring.size()]);
+    }
+
+    /**
+     * @brief Drops every frame and gives the ring's memory back.
+     */
+    void clear(){
+        std::lock_guard<std::mutex> lock(m);
+        std::vector<Frame>().swap(ring);
+        head = count = bytes = 0;
+    }
+
+private:
+    void popOldest(){
+        bytes -= ring[head]->size();
+        ring[head].reset();
+        head = (head + 1) % ring.size();
+        count--;
+    }
+
+    mutable std::mutex m;
+    std::vector<Frame> ring;
+    size_t head = 0;        // index of the oldest frame
+    size_t count = 0;
+    size_t bytes = 0;
+};
+
+/*
+*  A group's /members listing, kept until the group's version moves on, so
+*  asking again between joins and leaves costs no walk over the members.
+*/
+struct GroupRoster{
+    std::mutex m;
+    uint64_t version = 0;
+    std::shared_ptr<const std::vector<SharedFrame>> frames;     // null until first asked for
+};
+
+struct Group{
+    using allocator_type = std::pmr::polymorphic_allocator<std::byte>;
+
+    explicit Group(const allocator_type &alloc = {}) : members(alloc) {}
+
+    // member handle -> that member's outbound queue, so fan-out never has to look the session up
+    std::pmr::unordered_map<SessionHandle, std::shared_ptr<Outbox>, SessionHandleHash> members;
+    mutable GroupHistory history;
+    uint64_t version = 0;           // bumped by every join and leave, under the shard's exclusive lock
+    mutable GroupRoster roster;
+};
+
+/*
+*  Thread-safe group registry: groups are spread over GROUP_SHARDS maps by a
+*  hash of the group name, each behind its own reader/writer lock, so traffic
+*  in unrelated groups never contends. Lock order is group shard before
+*  session shard.
+*
+*  A shard's groups, their names and their member entries are carved from the
+*  shard's own slab pool (fixed-size chunks recycled per size), so joins and
+*  leaves reuse freed nodes instead of going to malloc. The pool is not
+*  thread-safe; it is only used under the shard's exclusive lock, which every
+*  operation that allocates or frees a node already takes.
+*/
+class GroupRegistry{
+public:
+    /**
+     * @brief Creates `name` with `creator` as its only member.
+     *
+     * @return bool Returns false if the group already exists.
+     */
+    bool create(std::string_view name, SessionHandle creator, std::shared_ptr<Outbox> outbox){
+        Shard &shard = shardOf(name);
+        std::unique_lock<std::shared_mutex> lock(shard.m);
+        if(shard.groups.find(name) != shard.groups.end()) return false;
+        shard.groups.try_emplace(std::pmr::string(name, &shard.slab)).first->second.members.emplace(creator, std::move(outbox));
+        groupCount++;
+        return true;
+    }
+
+    /**
+     * @brief Adds a member to an existing group and runs `onJoined(const Group&)` before anyone else can post to it.
+     *
+     * @return int Returns 1 on success, -1 if the group does not exist and -2 if the handle is already a member.
+     *
+     * `onJoined` runs under the shard's exclusive lock, so every group message is either already in the
+     * group's history at that point or is delivered to the new member afterwards, never both or neither.
+     */
+    template<class F>
+    int join(std::string_view name, SessionHandle member, std::shared_ptr<Outbox> outbox, F onJoined){
+        Shard &shard = shardOf(name);
+        std::unique_lock<std::shared_mutex> lock(shard.m);
+        auto it = shard.groups.find(name);
+        if(it == shard.groups.end()) return -1;
+        if(!it->second.members.emplace(member, std::move(outbox)).second) return -2;
+        it->second.version++;
+        onJoined((const Group&)it->second);
+        return 1;
+    }
+
+    /**
+     * @brief Removes a member from a group; the history of a group nobody is left in is released.
+     *
+     * @return bool Returns false if the group does not exist or the handle was not a member.
+     */
+    bool leave(std::string_view name, SessionHandle member){
+        Shard &shard = shardOf(name);
+        std::unique_lock<std::shared_mutex> lock(shard.m);
+        auto it = shard.groups.find(name);
+        if(it == shard.groups.end()) return false;
+        if(it->second.members.erase(member) == 0) return false;
+        it->second.version++;
+        if(it->second.members.empty()) it->second.history.clear();
+        return true;
+    }
+
+    /**
+     * @brief Runs `f(const Group&)` under the group's shard shared lock.
+     *
+     * @return bool Returns false (without calling `f`) if the group does not exist.
+     */
+    template<class F>
+    bool read(std::string_view name, F f){
+        Shard &shard = shardOf(name);
+        std::shared_lock<std::shared_mutex> lock(shard.m);
+        auto it = shard.groups.find(name);
+        if(it == shard.groups.end()) return false;
+        f((const Group&)it->second);
+        return true;
+    }
+
+    size_t size() const { return groupCount.load(std::memory_order_relaxed); }
+
+private:
+    struct Shard{
+        mutable std::shared_mutex m;
+        std::pmr::unsynchronized_pool_resource slab;
+        std::pmr::unordered_map<std::pmr::string, Group, StringHash, std::equal_to<>> groups{&slab};
+    };
+
+    Shard& shardOf(std::string_view name){
+        return shards[StringHash()(name) % GROUP_SHARDS];
+    }
+
+    std::array<Shard, GROUP_SHARDS> shards;
+    std::atomic<size_t> groupCount{0};
+};
+
+#endif
@@ -0,0 +1,210 @@
+// Hierarchical timer wheel: O(1) arm and cancel for the per-connection timeouts of a reactor
+
+#ifndef TIMER_WHEEL_H
+#define TIMER_WHEEL_H
+
+#include <vector>
+#include <cstdint>
+#include <algorithm>
+
+#define TIMER_TICK_MS 100               // resolution; timers fire on the first tick at or after their due time
+#define TIMER_LEVEL_BITS 6
+#define TIMER_SLOTS (1 << TIMER_LEVEL_BITS)
+#define TIMER_LEVELS 4                  // 64^4 ticks, about 19 days; later due times are clamped
+
+/*
+*  A handle names one node of the wheel plus the generation that node had
+*  when the timer was armed, so cancelling a timer that already fired (and
+*  whose node was reused) does nothing.
+*/
+struct TimerHandle{
+    uint32_t index = UINT32_MAX;
+    uint32_t generation = 0;
+
+    bool valid() const { return index != UINT32_MAX; }
+};
+
+/*
+*  Four wheels of 64 slots each. Level 0 holds the timers due within the next
+*  64 ticks, one slot per tick; a slot of level n covers 64^n ticks. Whenever
+*  level 0 wraps around, the next slot of level 1 is cascaded (re-sorted into
+*  level 0), and so on upwards, so every timer is touched at most once per
+*  level. Timers are nodes of one pooled array, linked into their slot by
+*  index, which makes arming and cancelling an unlink/link with no allocation
+*  once the pool has grown. A bitmap of occupied slots per level lets
+*  `nextDueMs()` tell the reactor how long it may sleep.
+*
+*  The wheel is not thread-safe: a reactor owns one and only touches it from
+*  its own thread.
+*/
+class TimerWheel{
+public:
+    TimerWheel(){
+        std::fill(&heads[0][0], &heads[0][0] + TIMER_LEVELS * TIMER_SLOTS, NIL);
+    }
+
+    /**
+     * @brief Sets the wheel's clock; must be called once, before anything is armed.
+     */
+    void start(int64_t nowMs){ current = nowMs / TIMER_TICK_MS; }
+
+    /**
+     * @brief Arms a timer that hands `key` back from `advance()` once `dueMs` has passed.
+     */
+    TimerHandle arm(int64_t dueMs, uint64_t key){
+        uint32_t index;
+        if(freeNodes != NIL){
+            index = freeNodes;
+            freeNodes = nodes[index].next;
+        }
+        else{
+            index = (uint32_t)nodes.size();
+            nodes.emplace_back();
+        }
+        Node &node = nodes[index];
+        node.due = std::max(current, (dueMs + TIMER_TICK_MS - 1) / TIMER_TICK_MS);
+        node.key = key;
+        node.armed = true;
+        link(index);
+        armedCount++;
+        return TimerHandle{index, node.generation};
+    }
+
+    /**
+     * @brief Disarms a timer and clears the handle.
+     *
+     * @return bool Returns false if the timer had already fired or been cancelled.
+     */
+    bool cancel(TimerHandle &handle){
+        TimerHandle h = handle;
+        handle = TimerHandle{};
+        if(!h.valid() || h.index >= nodes.size()) return false;
+        Node &node = nodes[h.index];
+        if(!node.armed || node.generation != h.generation) return false;
+        unlink(h.index);
+        release(h.index);
+        return true;
+    }
+
+    /**
+     * @brief Runs the wheel up to `nowMs` and calls `onExpire(key)` for every timer that fell due.
+     *
+     * The callbacks run after the wheel has caught up, so they may arm new timers (or cancel others) freely.
+     */
+    template<class F>
+    void advance(int64_t nowMs, F &&onExpire){
+        int64_t target = nowMs / TIMER_TICK_MS;
+        expired.clear();
+        while(current <= target){
+            if(armedCount == 0){
+                current = target + 1;
+                break;
+            }
+            if((current & (TIMER_SLOTS - 1)) == 0){
+                // level 0 wrapped: cascade every level whose own index wrapped too, highest first
+                int top = 1;
+                while(top < TIMER_LEVELS - 1 && ((current >> (TIMER_LEVEL_BITS * top)) & (TIMER_SLOTS - 1)) == 0) top++;
+                for(int level = top; level >= 1; level--) cascade(level);
+            }
+            size_t slot = current & (TIMER_SLOTS - 1);
+            uint32_t index = heads[0][slot];
+            heads[0][slot] = NIL;
+            occupied[0] &= ~(1ull << slot);
+            while(index != NIL){
+                uint32_t next = nodes[index].next;
+                expired.push_back(nodes[index].key);
+                release(index);
+                index = next;
+            }
+            current++;
+        }
+        for(uint64_t key : expired) onExpire(key);
+    }
+
+    /**
+     * @brief Returns when the wheel next needs `advance()` (steady clock, ms), or -1 if nothing is armed.
+     *
+     * That is the first occupied level 0 slot, or the next cascade if it comes sooner, since a cascade may
+     * bring timers down that are due right away.
+     */
+    int64_t nextDueMs() const {
+        if(armedCount == 0) return -1;
+        unsigned shift = current & (TIMER_SLOTS - 1);
+        int64_t next = shift ? (current | (TIMER_SLOTS - 1)) + 1 : current;
+        uint64_t ahead = shift ? (occupied[0] >> shift) | (occupied[0] << (TIMER_SLOTS - shift)) : occupied[0];
+        if(ahead) next = std::min<int64_t>(next, current + __builtin_ctzll(ahead));
+        return next * TIMER_TICK_MS;
+    }
+
+    size_t size() const { return armedCount; }
+
+private:
+    static constexpr uint32_t NIL = UINT32_MAX;
+
+    struct Node{
+        int64_t due = 0;            // in ticks
+        uint64_t key = 0;
+        uint32_t prev = NIL;
+        uint32_t next = NIL;
+        uint32_t generation = 0;
+        uint8_t level = 0;
+        uint8_t slot = 0;
+        bool armed = false;
+    };
+
+    void link(uint32_t index){
+        Node &node = nodes[index];
+        int64_t delta = std::min<int64_t>(node.due - current, ((int64_t)1 << (TIMER_LEVEL_BITS * TIMER_LEVELS)) - 1);
+        int level = 0;
+        while(level < TIMER_LEVELS - 1 && delta >= ((int64_t)1 << (TIMER_LEVEL_BITS * (level + 1)))) level++;
+        int64_t due = current + delta;
+        size_t slot = (due >> (TIMER_LEVEL_BITS * level)) & (TIMER_SLOTS - 1);
+
+        node.level = (uint8_t)level;
+        node.slot = (uint8_t)slot;
+        node.prev = NIL;
+        node.next = heads[level][slot];
+        if(node.next != NIL) nodes[node.next].prev = index;
+        heads[level][slot] = index;
+        occupied[level] |= 1ull << slot;
+    }
+
+    void unlink(uint32_t index){
+        Node &node = nodes[index];
+        if(node.prev != NIL) nodes[node.prev].next = node.next;
+        else heads[node.level][node.slot] = node.next;
+        if(node.next != NIL) nodes[node.next].prev = node.prev;
+        if(heads[node.level][node.slot] == NIL) occupied[node.level] &= ~(1ull << node.slot);
+    }
+
+    void release(uint32_t index){
+        Node &node = nodes[index];
+        node.armed = false;
+        node.generation++;
+        node.next = freeNodes;
+        freeNodes = index;
+        armedCount--;
+    }
+
+    void cascade(int level){
+        size_t slot = (current >> (TIMER_LEVEL_BITS * level)) & (TIMER_SLOTS - 1);
+        uint32_t index = heads[level][slot];
+        heads[level][slot] = NIL;
+        occupied[level] &= ~(1ull << slot);
+        while(index != NIL){
+            uint32_t next = nodes[index].next;
+            link(index);
+            index = next;
+        }
+    }
+
+    std::vector<Node> nodes;
+    uint32_t freeNodes = NIL;
+    uint32_t heads[TIMER_LEVELS][TIMER_SLOTS];
+    uint64_t occupied[TIMER_LEVELS] = {};
+    int64_t current = 0;            // the next tick to run
+    size_t armedCount = 0;
+    std::vector<uint64_t> expired;
+};
+
+#endif
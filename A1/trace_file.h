@@ -0,0 +1,252 @@
+// Binary traffic traces: the server's --capture writer and the reader replay_grp uses to play them back
+
+#ifndef TRACE_FILE_H
+#define TRACE_FILE_H
+
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+#include <cstdio>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+
+/*
+*  A trace is an 8 byte magic, the wall clock time the capture started (ns
+*  since the epoch, 8 bytes little-endian) and then a stream of records:
+*
+*      USER     type, user id, name length, name     a username, given the next free id when first seen
+*      FRAME    type, user id, delta, length, bytes  one frame that reached the command router
+*      END      type, user id, delta                 that user's connection closed
+*
+*  Every number is an unsigned LEB128 varint, and `delta` is the time in ns
+*  since the previous record, so a typical chat frame costs five or six bytes
+*  on top of its payload. Records are appended in the order their timestamps
+*  were taken, hence deltas are never negative, and one user's frames appear
+*  in the order the server handled them.
+*/
+#define TRACE_MAGIC "CHATTRC1"
+#define TRACE_MAGIC_SIZE 8
+#define TRACE_BUFFER_BYTES (64 * 1024)  // buffered records are written out beyond this (and by the flush thread)
+
+enum class TraceRecordType : uint8_t{
+    USER = 1,
+    FRAME = 2,
+    END = 3
+};
+
+inline void appendVarint(std::string &out, uint64_t value){
+    while(value >= 0x80){
+        out.push_back((char)(value | 0x80));
+        value >>= 7;
+    }
+    out.push_back((char)value);
+}
+
+/**
+ * @brief Decodes a varint from the front of `in` and drops it.
+ *
+ * @return bool Returns false if `in` ends in the middle of the number.
+ */
+inline bool takeVarint(std::string_view &in, uint64_t &value){
+    value = 0;
+    for(int shift = 0; shift < 64 && !in.empty(); shift += 7){
+        uint8_t byte = (uint8_t)in[0];
+        in.remove_prefix(1);
+        value |= (uint64_t)(byte & 0x7f) << shift;
+        if(!(byte & 0x80)) return true;
+    }
+    return false;
+}
+
+/*
+*  The capture side. Any thread may record; a record is encoded into a
+*  shared buffer under a mutex, and the buffer goes to the file in large
+*  writes, from the recording thread once it is full or from the server's
+*  flush thread every few milliseconds.
+*/
+class TraceWriter{
+public:
+    ~TraceWriter(){
+        flush();
+        if(fd >= 0) ::close(fd);
+    }
+
+    /**
+     * @brief Creates (or truncates) the trace file and writes its header.
+     *
+     * @param nowNs The steady clock in ns; record times are counted from here.
+     * @return int Returns 1 on success, otherwise returns -1 with the reason printed.
+     */
+    int open(const std::string &path, uint64_t wallNs, int64_t nowNs){
+        fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+        if(fd < 0){
+            fprintf(stderr, "Cannot open capture file %s: %s\n", path.c_str(), strerror(errno));
+            return -1;
+        }
+        buffer.assign(TRACE_MAGIC, TRACE_MAGIC_SIZE);
+        for(int i = 0; i < 8; i++) buffer.push_back((char)(wallNs >> (8 * i)));
+        last = nowNs;
+        return 1;
+    }
+
+    bool isOpen() const { return fd >= 0; }
+
+    /**
+     * @brief Records a frame from `username`'s session.
+     */
+    void frame(std::string_view username, std::string_view payload, int64_t nowNs){
+        bool full;
+        {
+            std::lock_guard<std::mutex> lock(m);
+            uint32_t id = userId(username);
+            buffer.push_back((char)TraceRecordType::FRAME);
+            appendVarint(buffer, id);
+            appendVarint(buffer, elapsed(nowNs));
+            appendVarint(buffer, payload.size());
+            buffer.append(payload);
+            full = buffer.size() >= TRACE_BUFFER_BYTES;
+        }
+        if(full) flush();
+    }
+
+    /**
+     * @brief Records that `username`'s connection closed.
+     */
+    void end(std::string_view username, int64_t nowNs){
+        std::lock_guard<std::mutex> lock(m);
+        uint32_t id = userId(username);
+        buffer.push_back((char)TraceRecordType::END);
+        appendVarint(buffer, id);
+        appendVarint(buffer, elapsed(nowNs));
+    }
+
+    /**
+     * @brief Writes everything recorded so far to the file.
+     */
+    void flush(){
+        // held across the write, so two flushes cannot put their buffers on disk in the wrong order
+        std::lock_guard<std::mutex> writing(writeMutex);
+        {
+            std::lock_guard<std::mutex> lock(m);
+            if(buffer.empty() || fd < 0) return;
+            pending.swap(buffer);
+        }
+        size_t done = 0;
+        while(done < pending.size()){
+            ssize_t n = ::write(fd, pending.data() + done, pending.size() - done);
+            if(n < 0 && errno == EINTR) continue;
+            if(n <= 0) break;
+            done += n;
+        }
+        pending.clear();
+    }
+
+private:
+    // the caller holds `m`; the timestamp is taken by the caller but only ordered here, so a late one counts as 0
+    uint64_t elapsed(int64_t nowNs){
+        uint64_t delta = nowNs > last ? (uint64_t)(nowNs - last) : 0;
+        if(nowNs > last) last = nowNs;
+        return delta;
+    }
+
+    uint32_t userId(std::string_view username){
+        auto it = users.find(std::string(username));
+        if(it != users.end()) return it->second;
+        uint32_t id = (uint32_t)users.size();
+        users.emplace(std::string(username), id);
+        buffer.push_back((char)TraceRecordType::USER);
+        appendVarint(buffer, id);
+        appendVarint(buffer, username.size());
+        buffer.append(username);
+        return id;
+    }
+
+    int fd = -1;
+    std::mutex m;                   // guards everything below but `pending`
+    std::mutex writeMutex;          // serialises flush(), guards `pending`
+    std::string buffer;
+    std::string pending;
+    int64_t last = 0;
+    std::unordered_map<std::string, uint32_t> users;
+};
+
+/*
+*  One record of a trace as the reader hands it out: the time is absolute
+*  (ns since the capture started) and the user is already resolved to an id
+*  into TraceReader::users.
+*/
+struct TraceRecord{
+    TraceRecordType type;
+    uint32_t user;
+    uint64_t at;
+    std::string payload;
+};
+
+/*
+*  Reads a whole trace into memory; a trace cut off in the middle of a record
+*  (the server was killed before its last flush) loses just that record.
+*/
+class TraceReader{
+public:
+    /**
+     * @brief Loads the trace at `path`.
+     *
+     * @return int Returns 1 on success, otherwise returns -1 with the reason printed.
+     */
+    int load(const std::string &path){
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if(fd < 0){
+            fprintf(stderr, "Cannot open trace %s: %s\n", path.c_str(), strerror(errno));
+            return -1;
+        }
+        std::string data;
+        char chunk[64 * 1024];
+        ssize_t n;
+        while((n = ::read(fd, chunk, sizeof(chunk))) > 0 || (n < 0 && errno == EINTR)) if(n > 0) data.append(chunk, n);
+        ::close(fd);
+        if(data.size() < TRACE_MAGIC_SIZE + 8 || data.compare(0, TRACE_MAGIC_SIZE, TRACE_MAGIC) != 0){
+            fprintf(stderr, "%s is not a trace\n", path.c_str());
+            return -1;
+        }
+        startedAtNs = 0;
+        for(int i = 0; i < 8; i++) startedAtNs |= (uint64_t)(uint8_t)data[TRACE_MAGIC_SIZE + i] << (8 * i);
+
+        std::string_view in(data);
+        in.remove_prefix(TRACE_MAGIC_SIZE + 8);
+        uint64_t at = 0;
+        while(!in.empty()){
+            TraceRecordType type = (TraceRecordType)in[0];
+            in.remove_prefix(1);
+            uint64_t id, delta, length;
+            if(!takeVarint(in, id)) break;
+            if(type == TraceRecordType::USER){
+                if(!takeVarint(in, length) || length > in.size() || id != users.size()) break;
+                users.emplace_back(in.substr(0, length));
+                in.remove_prefix(length);
+                continue;
+            }
+            if(id >= users.size() || !takeVarint(in, delta)) break;
+            at += delta;
+            TraceRecord record{type, (uint32_t)id, at, std::string()};
+            if(type == TraceRecordType::FRAME){
+                if(!takeVarint(in, length) || length > in.size()) break;
+                record.payload.assign(in.substr(0, length));
+                in.remove_prefix(length);
+            }
+            else if(type != TraceRecordType::END) break;
+            records.push_back(std::move(record));
+        }
+        return 1;
+    }
+
+    uint64_t startedAtNs = 0;       // wall clock, ns since the epoch
+    std::vector<std::string> users;
+    std::vector<TraceRecord> records;
+};
+
+#endif
@@ -0,0 +1,247 @@
+// Thin io_uring wrapper over the raw syscalls, used by the server's optional io_uring reactors
+
+#ifndef URING_H
+#define URING_H
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <poll.h>
+#include <unistd.h>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+
+/*
+*  One submission/completion ring pair plus one provided-buffer ring, mapped
+*  straight from the kernel (no liburing). SQEs are only queued by getSqe();
+*  nothing reaches the kernel until submit(), so everything prepared during
+*  one pass of a reactor loop goes in with a single io_uring_enter().
+*
+*  The ring is created with SINGLE_ISSUER | DEFER_TASKRUN: only the thread
+*  that called init() may use it, and completions are posted while that
+*  thread waits in submit(). Both flags need Linux 6.1, which also has every
+*  opcode the server relies on (multishot accept and recv, buffer rings), so
+*  init() failing is the signal to fall back to epoll.
+*/
+class Uring{
+public:
+    Uring() = default;
+    ~Uring(){ release(); }
+    Uring(const Uring&) = delete;
+    Uring& operator=(const Uring&) = delete;
+
+    /**
+     * @brief Creates the ring and maps its queues.
+     *
+     * @param entries The submission queue size (the completion queue gets twice as many).
+     * @return int Returns 1 on success, otherwise returns -1 with errno set.
+     */
+    int init(unsigned entries){
+        io_uring_params p{};
+        p.flags = IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+        fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+        if(fd < 0) return -1;
+
+        sqRingSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        cqRingSize = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+        bool single = p.features & IORING_FEAT_SINGLE_MMAP;
+        if(single) sqRingSize = cqRingSize = sqRingSize > cqRingSize ? sqRingSize : cqRingSize;
+
+        sqRing = mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+        if(sqRing == MAP_FAILED){ sqRing = nullptr; return fail(); }
+        cqRing = single ? sqRing : mmap(nullptr, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if(cqRing == MAP_FAILED){ cqRing = nullptr; return fail(); }
+        sqeBytes = p.sq_entries * sizeof(io_uring_sqe);
+        sqes = (io_uring_sqe*)mmap(nullptr, sqeBytes, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+        if(sqes == MAP_FAILED){ sqes = nullptr; return fail(); }
+
+        char *sq = (char*)sqRing, *cq = (char*)cqRing;
+        sqHead = (unsigned*)(sq + p.sq_off.head);
+        sqTail = (unsigned*)(sq + p.sq_off.tail);
+        sqArray = (unsigned*)(sq + p.sq_off.array);
+        sqMask = *(unsigned*)(sq + p.sq_off.ring_mask);
+        sqEntries = p.sq_entries;
+        cqHead = (unsigned*)(cq + p.cq_off.head);
+        cqTail = (unsigned*)(cq + p.cq_off.tail);
+        cqes = (io_uring_cqe*)(cq + p.cq_off.cqes);
+        cqMask = *(unsigned*)(cq + p.cq_off.ring_mask);
+        localTail = *sqTail;
+        return 1;
+    }
+
+    /**
+     * @brief Registers `count` buffers of `size` bytes as provided-buffer group `group`.
+     *
+     * @param count A power of two.
+     * @return int Returns 1 on success, otherwise returns -1 with errno set.
+     *
+     * Receives armed with IOSQE_BUFFER_SELECT pick a free buffer when data actually arrives, so idle
+     * connections pin no memory; the completion names the buffer, which goes back with recycleBuffer().
+     */
+    int setupBuffers(uint16_t group, unsigned count, unsigned size){
+        bufRingBytes = count * sizeof(io_uring_buf);
+        bufRing = (io_uring_buf*)mmap(nullptr, bufRingBytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(bufRing == MAP_FAILED){ bufRing = nullptr; return -1; }
+        bufPoolBytes = (size_t)count * size;
+        bufPool = (char*)mmap(nullptr, bufPoolBytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(bufPool == MAP_FAILED){ bufPool = nullptr; return -1; }
+
+        io_uring_buf_reg reg{};
+        reg.ring_addr = (uint64_t)(uintptr_t)bufRing;
+        reg.ring_entries = count;
+        reg.bgid = group;
+        if(syscall(__NR_io_uring_register, fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) return -1;
+
+        bufMask = count - 1;
+        bufSize = size;
+        for(unsigned i = 0; i < count; i++) recycleBuffer((uint16_t)i);
+        return 1;
+    }
+
+    char* bufferData(uint16_t id){ return bufPool + (size_t)id * bufSize; }
+
+    /**
+     * @brief Hands a provided buffer back to the kernel once its bytes have been consumed.
+     */
+    void recycleBuffer(uint16_t id){
+        io_uring_buf &buf = bufRing[bufTail & bufMask];
+        buf.addr = (uint64_t)(uintptr_t)bufferData(id);
+        buf.len = bufSize;
+        buf.bid = id;
+        bufTail++;
+        // the ring's tail lives in the first entry's `resv` field (io_uring_buf_ring); that struct is not
+        // used directly because its flexible array member is laid out one word too far in C++
+        __atomic_store_n(&bufRing[0].resv, bufTail, __ATOMIC_RELEASE);
+    }
+
+    /**
+     * @brief Claims the next submission slot, zeroed; flushes the queue to the kernel first if it is full.
+     *
+     * @return io_uring_sqe* The slot, or nullptr if the kernel would not take the queued entries.
+     */
+    io_uring_sqe* getSqe(){
+        if(localTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) >= sqEntries){
+            submit(0);
+            if(localTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE) >= sqEntries) return nullptr;
+        }
+        unsigned index = localTail & sqMask;
+        io_uring_sqe *sqe = &sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sqArray[index] = index;
+        localTail++;
+        return sqe;
+    }
+
+    /**
+     * @brief Submits every queued entry and optionally waits for completions.
+     *
+     * @param waitFor The number of completions to wait for (0 returns as soon as the entries are submitted).
+     * @param timeout Gives up waiting after this long (-1 with errno ETIME); nullptr waits indefinitely.
+     * @return int The number of entries submitted, or -1 with errno set.
+     */
+    int submit(unsigned waitFor, const __kernel_timespec *timeout = nullptr){
+        __atomic_store_n(sqTail, localTail, __ATOMIC_RELEASE);
+        unsigned pending = localTail - __atomic_load_n(sqHead, __ATOMIC_ACQUIRE);
+        unsigned flags = waitFor ? IORING_ENTER_GETEVENTS : 0;
+        if(!timeout) return (int)syscall(__NR_io_uring_enter, fd, pending, waitFor, flags, nullptr, 0);
+
+        io_uring_getevents_arg arg{};
+        arg.ts = (uint64_t)(uintptr_t)timeout;
+        return (int)syscall(__NR_io_uring_enter, fd, pending, waitFor, flags | IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+    }
+
+    /**
+     * @brief Calls `onCqe(const io_uring_cqe&)` for every completion that is ready, oldest first.
+     *
+     * Each entry is copied out and its slot released before the callback runs, so the callback may queue
+     * (and even flush) new submissions.
+     */
+    template<class F>
+    unsigned forEachCqe(F onCqe){
+        unsigned head = *cqHead;
+        unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+        unsigned seen = 0;
+        while(head != tail){
+            io_uring_cqe cqe = cqes[head & cqMask];
+            __atomic_store_n(cqHead, ++head, __ATOMIC_RELEASE);
+            onCqe(cqe);
+            seen++;
+        }
+        return seen;
+    }
+
+    static void prepMultishotAccept(io_uring_sqe *sqe, int listenFd){
+        sqe->opcode = IORING_OP_ACCEPT;
+        sqe->fd = listenFd;
+        sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    }
+    static void prepMultishotRecv(io_uring_sqe *sqe, int fd, uint16_t group){
+        sqe->opcode = IORING_OP_RECV;
+        sqe->fd = fd;
+        sqe->ioprio = IORING_RECV_MULTISHOT;
+        sqe->flags = IOSQE_BUFFER_SELECT;
+        sqe->buf_group = group;
+    }
+    static void prepMultishotPoll(io_uring_sqe *sqe, int fd, unsigned events){
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = fd;
+        sqe->len = IORING_POLL_ADD_MULTI;
+        sqe->poll32_events = events;
+    }
+    static void prepSendmsg(io_uring_sqe *sqe, int fd, const msghdr *msg, unsigned flags){
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = fd;
+        sqe->addr = (uint64_t)(uintptr_t)msg;
+        sqe->len = 1;
+        sqe->msg_flags = flags;
+    }
+    static void prepCancel(io_uring_sqe *sqe, uint64_t userData){
+        sqe->opcode = IORING_OP_ASYNC_CANCEL;
+        sqe->fd = -1;
+        sqe->addr = userData;
+    }
+
+private:
+    int fail(){
+        int saved = errno;
+        release();
+        errno = saved;
+        return -1;
+    }
+
+    void release(){
+        if(bufPool) munmap(bufPool, bufPoolBytes);
+        if(bufRing) munmap(bufRing, bufRingBytes);
+        if(sqes) munmap(sqes, sqeBytes);
+        if(cqRing && cqRing != sqRing) munmap(cqRing, cqRingSize);
+        if(sqRing) munmap(sqRing, sqRingSize);
+        if(fd >= 0) ::close(fd);
+        bufPool = nullptr;
+        bufRing = nullptr;
+        sqes = nullptr;
+        cqRing = sqRing = nullptr;
+        fd = -1;
+    }
+
+    int fd = -1;
+    void *sqRing = nullptr, *cqRing = nullptr;
+    size_t sqRingSize = 0, cqRingSize = 0, sqeBytes = 0;
+    io_uring_sqe *sqes = nullptr;
+    unsigned *sqHead = nullptr, *sqTail = nullptr, *sqArray = nullptr;
+    unsigned sqMask = 0, sqEntries = 0;
+    unsigned localTail = 0;                 // SQEs handed out; published to *sqTail on submit()
+    unsigned *cqHead = nullptr, *cqTail = nullptr;
+    io_uring_cqe *cqes = nullptr;
+    unsigned cqMask = 0;
+
+    io_uring_buf *bufRing = nullptr;
+    size_t bufRingBytes = 0;
+    char *bufPool = nullptr;
+    size_t bufPoolBytes = 0;
+    unsigned bufMask = 0, bufSize = 0;
+    uint16_t bufTail = 0;
+};
+
+#endif
@@ -0,0 +1,78 @@
+// Small thread pool that checks passwords off the reactor threads
+
+#ifndef VERIFIER_POOL_H
+#define VERIFIER_POOL_H
+
+#include <mutex>
+#include <deque>
+#include <thread>
+#include <vector>
+#include <functional>
+#include <condition_variable>
+
+/*
+*  A password check runs the credential store's PBKDF2 hash, a few
+*  milliseconds of CPU during which a reactor could not serve any of its
+*  other connections. Reactors hand each check to this pool instead and
+*  carry on; the job itself hands its verdict back to the reactor that owns
+*  the connection (see finishLogin() in the server). Jobs run in the order
+*  they were submitted, on whichever worker is free.
+*/
+class VerifierPool{
+public:
+    ~VerifierPool(){
+        {
+            std::lock_guard<std::mutex> lock(m);
+            stopping = true;
+        }
+        wake.notify_all();
+        for(auto &t : threads) t.join();
+    }
+
+    /**
+     * @brief Starts `count` worker threads; with 0 every job runs inline on the caller.
+     */
+    void start(unsigned count){
+        for(unsigned i = 0; i < count; i++) threads.emplace_back([this]{ work(); });
+    }
+
+    unsigned size() const { return (unsigned)threads.size(); }
+
+    /**
+     * @brief Queues `job` for the next free worker.
+     */
+    void submit(std::function<void()> job){
+        if(threads.empty()){
+            job();
+            return;
+        }
+        {
+            std::lock_guard<std::mutex> lock(m);
+            jobs.push_back(std::move(job));
+        }
+        wake.notify_one();
+    }
+
+private:
+    void work(){
+        while(true){
+            std::function<void()> job;
+            {
+                std::unique_lock<std::mutex> lock(m);
+                wake.wait(lock, [&]{ return stopping || !jobs.empty(); });
+                if(stopping) return;
+                job = std::move(jobs.front());
+                jobs.pop_front();
+            }
+            job();
+        }
+    }
+
+    std::vector<std::thread> threads;
+    std::mutex m;                               // guards `jobs` and `stopping`
+    std::condition_variable wake;
+    std::deque<std::function<void()>> jobs;
+    bool stopping = false;
+};
+
+#endif